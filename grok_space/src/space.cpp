@@ -18,6 +18,7 @@ const int ENEMY_SHOOT_INTERVAL = 2000; // ms
 const int ENEMY_SPAWN_INTERVAL = 1000; // 1 second between spawn events
 const int ENEMIES_PER_SPAWN = 3; // Spawn 3 enemies at once
 const int POWERUP_DURATION = 30000; // 30 seconds for power-up effects
+const int MAX_BULLETS = 4096; // Bullet pool capacity; shots fired while it is full are dropped
 
 // Power-up types
 enum PowerUpType {
@@ -53,30 +54,77 @@ struct Player {
     std::vector<PowerUpType> activePowerUps;
 };
 
-// Bullet structure
-struct Bullet {
-    SDL_Rect rect;
-    int speed;
-    bool isPlayerBullet;
-    SDL_Texture* texture;
-    Bullet(int x, int y, bool playerBullet, int spd, SDL_Renderer* r)
-        : rect({x, y, 10, 20}), speed(spd), isPlayerBullet(playerBullet) {
-        texture = IMG_LoadTexture(r, playerBullet ? "bullet_player.png" : "bullet_enemy.png");
-        if (!texture) {
-            SDL_Log("Failed to load bullet texture (%s): %s", playerBullet ? "player" : "enemy", IMG_GetError());
+// Bullet textures, loaded once and shared by every bullet through a handle
+enum BulletTexture : Uint8 {
+    PLAYER_BULLET_TEXTURE,
+    ENEMY_BULLET_TEXTURE,
+    BULLET_TEXTURE_COUNT
+};
+
+// Bullet pool: fixed capacity, stored as parallel arrays with the live bullets packed at the front,
+// so moving them is one pass over contiguous ints and firing or removing one never allocates
+struct BulletPool {
+    static const int WIDTH = 10;
+    static const int HEIGHT = 20;
+    static_assert(MAX_BULLETS % 4 == 0, "update() steps whole 4-int vectors");
+    int x[MAX_BULLETS] = {};
+    int y[MAX_BULLETS] = {};
+    int speed[MAX_BULLETS] = {}; // 0 in free slots, which update() also steps over
+    Uint8 texture[MAX_BULLETS] = {}; // BulletTexture handle, which also tells player bullets from enemy ones
+    int count = 0;
+    SDL_Texture* textures[BULLET_TEXTURE_COUNT] = {};
+
+    void loadTextures(SDL_Renderer* r) {
+        const char* files[BULLET_TEXTURE_COUNT] = {"bullet_player.png", "bullet_enemy.png"};
+        for (int i = 0; i < BULLET_TEXTURE_COUNT; i++) {
+            textures[i] = IMG_LoadTexture(r, files[i]);
+            if (!textures[i]) SDL_Log("Failed to load %s: %s", files[i], IMG_GetError());
         }
-        SDL_Log("Bullet created at (%d, %d), size 10x20, player=%d", x, y, playerBullet);
     }
-    ~Bullet() {
-        if (texture) SDL_DestroyTexture(texture);
+    void destroyTextures() {
+        for (auto& t : textures) {
+            if (t) SDL_DestroyTexture(t);
+            t = nullptr;
+        }
     }
+    // Returns false (and drops the shot) when the pool is full
+    bool spawn(int bx, int by, bool playerBullet, int spd) {
+        if (count == MAX_BULLETS) return false;
+        x[count] = bx;
+        y[count] = by;
+        speed[count] = spd;
+        texture[count] = playerBullet ? PLAYER_BULLET_TEXTURE : ENEMY_BULLET_TEXTURE;
+        count++;
+        return true;
+    }
+    // Moves the last bullet into slot i; callers iterating the pool stay on i
+    void remove(int i) {
+        count--;
+        x[i] = x[count];
+        y[i] = y[count];
+        speed[i] = speed[count];
+        texture[i] = texture[count];
+        speed[count] = 0;
+    }
+    bool isPlayerBullet(int i) const { return texture[i] == PLAYER_BULLET_TEXTURE; }
+    SDL_Rect rect(int i) const { return {x[i], y[i], WIDTH, HEIGHT}; }
     void update() {
-        rect.y += speed;
+        // Rounded up to whole 4-int vectors (free slots have speed 0), so the compiler vectorizes the loop even
+        // at -O2 without a scalar tail
+        const int n = (count + 3) & ~3;
+        for (int i = 0; i < n; i++) y[i] += speed[i];
     }
-    void render(SDL_Renderer* r) {
-        SDL_SetRenderDrawColor(r, isPlayerBullet ? 0 : 255, isPlayerBullet ? 255 : 0, 0, 255); // Green for player, red for enemy
-        SDL_RenderFillRect(r, &rect);
-        SDL_Log("Rendering bullet at (%d, %d), player=%d", rect.x, rect.y, isPlayerBullet);
+    void render(SDL_Renderer* r) const {
+        for (int i = 0; i < count; i++) {
+            SDL_Rect dst = rect(i);
+            SDL_Texture* t = textures[texture[i]];
+            if (t) {
+                SDL_RenderCopy(r, t, NULL, &dst);
+            } else {
+                SDL_SetRenderDrawColor(r, isPlayerBullet(i) ? 0 : 255, isPlayerBullet(i) ? 255 : 0, 0, 255); // Green for player, red for enemy
+                SDL_RenderFillRect(r, &dst);
+            }
+        }
     }
 };
 
@@ -89,16 +137,14 @@ public:
     Uint32 shootTimer;
     virtual ~Enemy() { if (texture) SDL_DestroyTexture(texture); }
     virtual void update() = 0;
-    void tryShoot(std::vector<Bullet>& bullets, SDL_Renderer* r) {
+    void tryShoot(BulletPool& bullets) {
         if (SDL_GetTicks() - shootTimer > ENEMY_SHOOT_INTERVAL) {
-            shoot(bullets, r);
+            shoot(bullets);
             shootTimer = SDL_GetTicks();
         }
     }
-    virtual void shoot(std::vector<Bullet>& bullets, SDL_Renderer* r) {
-        Bullet b(rect.x + rect.w / 2 - 5, rect.y + rect.h, false, 5, r);
-        bullets.push_back(b);
-        SDL_Log("Enemy shot bullet from (%d, %d)", rect.x + rect.w / 2 - 5, rect.y + rect.h);
+    virtual void shoot(BulletPool& bullets) {
+        bullets.spawn(rect.x + rect.w / 2 - 5, rect.y + rect.h, false, 5);
     }
     void render(SDL_Renderer* r) {
         if (texture) SDL_RenderCopy(r, texture, NULL, &rect);
@@ -163,16 +209,13 @@ class PowerUp {
 public:
     PowerUpType type;
     SDL_Rect rect;
-    PowerUp(PowerUpType t, int x, int y) : type(t), rect({x, y, 64, 64}) {
-        SDL_Log("PowerUp created at (%d, %d), type %d, size 64x64", x, y, t);
-    }
+    PowerUp(PowerUpType t, int x, int y) : type(t), rect({x, y, 64, 64}) {}
     void update() {
         rect.y += 5; // Faster drop speed
     }
     void render(SDL_Renderer* r) const {
         SDL_SetRenderDrawColor(r, 255, 255, 0, 255); // Yellow rectangle
         SDL_RenderFillRect(r, &rect);
-        SDL_Log("Rendering powerup at (%d, %d), type %d", rect.x, rect.y, type);
     }
 };
 
@@ -257,12 +300,13 @@ void spawnPowerUp(std::vector<PowerUp>& powerUps, int x, int y, SDL_Renderer* r)
 }
 
 // Check collisions and clean up off-screen objects
-void checkCollisions(Player& player, std::vector<Bullet>& bullets, std::vector<Enemy*>& enemies, std::vector<PowerUp>& powerUps, Decoy* decoy, Uint32& decoyEnd, int& score, bool& running) {
-    for (auto bIt = bullets.begin(); bIt != bullets.end();) {
-        if (bIt->isPlayerBullet) {
-            bool hit = false;
+void checkCollisions(Player& player, BulletPool& bullets, std::vector<Enemy*>& enemies, std::vector<PowerUp>& powerUps, Decoy* decoy, Uint32& decoyEnd, int& score, bool& running) {
+    for (int i = 0; i < bullets.count;) {
+        SDL_Rect bulletRect = bullets.rect(i);
+        bool hit = false;
+        if (bullets.isPlayerBullet(i)) {
             for (auto eIt = enemies.begin(); eIt != enemies.end();) {
-                if (SDL_HasIntersection(&bIt->rect, &(*eIt)->rect)) {
+                if (SDL_HasIntersection(&bulletRect, &(*eIt)->rect)) {
                     (*eIt)->health -= 10;
                     if ((*eIt)->health <= 0) {
                         spawnPowerUp(powerUps, (*eIt)->rect.x, (*eIt)->rect.y, renderer);
@@ -278,27 +322,23 @@ void checkCollisions(Player& player, std::vector<Bullet>& bullets, std::vector<E
                     ++eIt;
                 }
             }
-            if (hit) {
-                bIt = bullets.erase(bIt);
-            } else {
-                ++bIt;
-            }
-        } else {
-            if (SDL_HasIntersection(&bIt->rect, &player.rect)) {
-                if (!player.invincible) {
-                    player.health -= 10;
-                    SDL_Log("Player hit, health now %d", player.health);
-                    if (player.health <= 0) {
-                        player.lives--;
-                        player.health = player.maxHealth;
-                        SDL_Log("Player lost a life, lives remaining: %d", player.lives);
-                        if (player.lives <= 0) running = false;
-                    }
+        } else if (SDL_HasIntersection(&bulletRect, &player.rect)) {
+            if (!player.invincible) {
+                player.health -= 10;
+                SDL_Log("Player hit, health now %d", player.health);
+                if (player.health <= 0) {
+                    player.lives--;
+                    player.health = player.maxHealth;
+                    SDL_Log("Player lost a life, lives remaining: %d", player.lives);
+                    if (player.lives <= 0) running = false;
                 }
-                bIt = bullets.erase(bIt);
-            } else {
-                ++bIt;
             }
+            hit = true;
+        }
+        if (hit) {
+            bullets.remove(i);
+        } else {
+            ++i;
         }
     }
 
@@ -311,18 +351,17 @@ void checkCollisions(Player& player, std::vector<Bullet>& bullets, std::vector<E
         }
     }
 
-    for (auto bIt = bullets.begin(); bIt != bullets.end();) {
-        if (bIt->rect.y < -20 || bIt->rect.y > WINDOW_HEIGHT + 20) {
-            bIt = bullets.erase(bIt);
+    for (int i = 0; i < bullets.count;) {
+        if (bullets.y[i] < -20 || bullets.y[i] > WINDOW_HEIGHT + 20) {
+            bullets.remove(i);
         } else {
-            ++bIt;
+            ++i;
         }
     }
 
     for (auto pIt = powerUps.begin(); pIt != powerUps.end();) {
         if (pIt->rect.y > WINDOW_HEIGHT + 64) {
             pIt = powerUps.erase(pIt);
-            SDL_Log("PowerUp removed (off-screen)");
         } else {
             ++pIt;
         }
@@ -332,7 +371,6 @@ void checkCollisions(Player& player, std::vector<Bullet>& bullets, std::vector<E
         if ((*eIt)->rect.y > WINDOW_HEIGHT + 64) {
             delete *eIt;
             eIt = enemies.erase(eIt);
-            SDL_Log("Enemy removed (off-screen)");
         } else {
             ++eIt;
         }
@@ -491,7 +529,8 @@ int main() {
     }
 
     Player player = {{WINDOW_WIDTH / 2 - 25, WINDOW_HEIGHT - 100, 64, 64}, playerTexture};
-    std::vector<Bullet> bullets;
+    BulletPool bullets;
+    bullets.loadTextures(renderer);
     std::vector<Enemy*> enemies;
     std::vector<PowerUp> powerUps;
     Decoy* decoy = nullptr;
@@ -522,11 +561,9 @@ int main() {
         if (keystates[SDL_SCANCODE_SPACE] && SDL_GetTicks() - lastShot > 300) {
             for (int i = 0; i < player.bulletCount; i++) {
                 int offset = (i - (player.bulletCount - 1) / 2) * 20;
-                Bullet b(player.rect.x + player.rect.w / 2 + offset - 5, player.rect.y - 20, true, -player.bulletSpeed, renderer);
-                bullets.push_back(b);
+                bullets.spawn(player.rect.x + player.rect.w / 2 + offset - 5, player.rect.y - 20, true, -player.bulletSpeed);
             }
             lastShot = SDL_GetTicks();
-            SDL_Log("Player fired %d bullets", player.bulletCount);
         }
 
         // Spawn enemies (multiple per interval)
@@ -541,15 +578,14 @@ int main() {
                 }
             }
             lastEnemySpawn = SDL_GetTicks();
-            SDL_Log("Spawned %d enemies", ENEMIES_PER_SPAWN);
         }
 
         // Update game objects
         Uint32 currentTime = SDL_GetTicks();
-        for (auto& b : bullets) b.update();
+        bullets.update();
         for (auto e : enemies) {
             e->update();
-            e->tryShoot(bullets, renderer);
+            e->tryShoot(bullets);
         }
         for (auto& p : powerUps) p.update();
         if (decoy) decoy->update();
@@ -589,7 +625,7 @@ int main() {
         renderBackground(renderer, bgTexture, bgY);
         SDL_RenderCopy(renderer, player.texture, NULL, &player.rect);
         for (const auto& e : enemies) e->render(renderer);
-        for (auto& b : bullets) b.render(renderer);
+        bullets.render(renderer);
         for (const auto& p : powerUps) p.render(renderer);
         if (decoy) decoy->render(renderer);
         renderHUD(renderer, font, score, player.health, player.lives, level, player.activePowerUps, bossApproaching);
@@ -607,6 +643,7 @@ int main() {
     // Cleanup
     for (auto e : enemies) delete e;
     if (decoy) delete decoy;
+    bullets.destroyTextures();
     SDL_DestroyTexture(bgTexture);
     SDL_DestroyTexture(playerTexture);
     TTF_CloseFont(font);
@@ -1,30 +1,121 @@
+#ifdef STARCRAFT_HEADLESS
+// Headless build: simulation and benchmark only, no SDL; these stand in for the few SDL names the simulation uses
+#include <cstdint>
+using Uint8 = uint8_t;
+using Uint16 = uint16_t;
+using Uint32 = uint32_t;
+struct SDL_Texture;
+#else
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 #include <SDL2/SDL_mixer.h>
 #include <SDL2/SDL_net.h>
+#endif
 #include <vector>
 #include <string>
 #include <cstdlib>
+#include <cstdio>
 #include <ctime>
 #include <algorithm>
 #include <queue>
 #include <map>
 #include <unordered_map>
 #include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cinttypes>
+#include <list>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <atomic>
+#include <array>
+#include <type_traits>
+#if defined(__linux__) && !defined(STARCRAFT_HEADLESS)
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+#if defined(STARCRAFT_HEADLESS) && !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 // Constants
 const int SCREEN_WIDTH = 800;
 const int SCREEN_HEIGHT = 600;
+const int TERRAIN_CHUNK_TILES = 16; // Tiles per cached terrain chunk side
+const int ATLAS_COLUMNS = 8;        // Sprite atlas width in TILE_SIZE cells
 const int TILE_SIZE = 32;
-const int MAP_WIDTH = 20;
+const int MAP_WIDTH = 20;             // Generated map size when no map file is given
 const int MAP_HEIGHT = 15;
+const int MAP_MAX_SIDE = 1024;        // Largest map file side, in tiles
+const size_t MAP_HEADER_BYTES = 16;
+const uint16_t MAP_FILE_VERSION = 1;
+const int CAMERA_SCROLL_TILES = 4;    // Tiles the view moves per arrow key press
+const int TERRAIN_CACHED_CHUNKS = 64; // Chunk textures kept before those away from the view are freed
+const size_t PROFILER_THREAD_EVENTS = 1 << 14; // Zone events a thread can hold between two frames
+const size_t PROFILER_MAX_ZONES = 64;
+const size_t PROFILER_WINDOW_FRAMES = 60;      // Frames the overlay averages over
+const size_t COMMAND_RING_CAPACITY = 4096;     // Commands queued between two ticks at most
+const size_t SAVE_CHUNK_BYTES = 4096;          // Granularity at which autosaves compare and rewrite a save file
+const uint32_t AUTOSAVE_INTERVAL_TICKS = 600;  // 30 s of game time
+const int BARRACKS_COST = 100;
+const int MARINE_COST = 50;
+const uint32_t MARINE_BUILD_TICKS = 60;        // 3 s
+const int PRODUCTION_QUEUE_SLOTS = 5;          // Units a building can have queued, the one in training included
+const size_t PRODUCTION_WHEEL_SLOTS = 256;     // Ticks the production timer wheel spans per revolution
 const int GRID_CELL_SIZE = 4;
+const int CLUSTER_SIZE = 16;
+const size_t PATH_CACHE_CAPACITY = 256;
+const Uint32 SIM_TICK_MS = 50;        // Simulation tick length (20 Hz)
+const Uint32 MAX_CATCHUP_TICKS = 5;   // Ticks run in one frame at most; beyond that the game slows down
+const uint32_t INPUT_DELAY_TICKS = 3; // Local commands are scheduled this many ticks ahead to hide latency
+const int32_t FIXED_ONE = 256;        // Fixed-point units per tile for simulated positions
+const Uint32 MOVE_MS_PER_TILE = 100;
+const uint32_t COMBAT_COOLDOWN_TICKS = 20;     // One attack per second
+const size_t COMBAT_PARALLEL_MIN = 4096;       // Attackers per extra acquisition thread
+const int SIGHT_RADIUS_UNIT = 5;               // Tiles
+const int SIGHT_RADIUS_BUILDING = 7;
+const int COMBAT_CELL_SIZE = 4;                // Tiles per target bin side; covers ranges up to a few tiles cheaply
+const int INFLUENCE_CELL_SIZE = 4;             // Tiles per influence map cell side
+const int INFLUENCE_RADIUS = 3;                // Cells a source reaches, with linear falloff
+const size_t AI_DECISIONS_PER_TICK = 32;       // Units evaluated per tick in deterministic runs
+const double AI_TIME_BUDGET_MS = 1.0;          // Otherwise, AI time per tick before it resumes next tick
+const uint32_t AI_ORDER_SETTLE_TICKS = 10;     // Ticks before a unit that was just ordered is re-ordered
+const int AI_HARVEST_SEARCH_CELLS = 6;
+const int32_t AI_DISTANCE_PENALTY = 24;        // Harvest utility lost per influence cell of distance
+const int32_t AI_RETREAT_WEIGHT = 4;
+const int32_t AI_RETURN_UTILITY = 300;
 
 // Enums
 enum TerrainType { GRASS, DIRT };
-enum ComponentType { POSITION, RENDER, HEALTH, MOVEMENT, WORKER, ATTACK, BUILDING };
+enum ComponentType { POSITION, RENDER, HEALTH, MOVEMENT, WORKER, ATTACK, BUILDING, FACTION, UNIT };
 enum Faction { TERRAN, ZERG, PROTOSS };
+const int FACTION_COUNT = 3;
+inline Faction playerFaction(int player) { return static_cast<Faction>(player % FACTION_COUNT); } // The host, player 0, is Terran
+
+// Generational handle: low 32 bits index a slot, high 32 bits count how often that slot was reused,
+// so a handle to a destroyed entity never resolves to whatever took its slot
+using EntityID = uint64_t;
+const EntityID INVALID_ENTITY = static_cast<EntityID>(-1);
+inline uint32_t entityIndex(EntityID id) { return static_cast<uint32_t>(id); }
+inline uint32_t entityGeneration(EntityID id) { return static_cast<uint32_t>(id >> 32); }
+inline EntityID makeEntityID(uint32_t index, uint32_t generation) { return (static_cast<EntityID>(generation) << 32) | index; }
+class ECS;
 
 // Components for ECS
 struct Point { 
@@ -33,339 +124,4892 @@ struct Point {
     bool operator<(const Point& p) const { return x < p.x || (x == p.x && y < p.y); }
 };
 
-struct PositionComponent { int x, y; float interpX, interpY; Uint32 lastUpdate; };
-struct RenderComponent { SDL_Texture* texture; };
-struct HealthComponent { int health; };
-struct MovementComponent { std::vector<Point> path; size_t pathIndex = 0; };
-struct WorkerComponent { bool isCarrying = false; int minerals = 0; size_t targetResource = 0; size_t base = 0; };
-struct AttackComponent { 
-    int damage, range; 
-    void attack(ECS& ecs, EntityID target) {
-        if (ecs.healths.count(target) && abs(ecs.positions[id].x - ecs.positions[target].x) + 
-            abs(ecs.positions[id].y - ecs.positions[target].y) <= range) {
-            ecs.healths[target].health -= damage;
+// x, y is the tile a unit occupies; fx, fy its fixed-point position, which is what the simulation moves.
+// prevFx, prevFy hold the position before the last tick; render blends the two and never writes back.
+struct PositionComponent { int x, y; int32_t fx, fy; int32_t prevFx, prevFy; };
+inline PositionComponent tilePosition(int x, int y) {
+    return {x, y, x * FIXED_ONE, y * FIXED_ONE, x * FIXED_ONE, y * FIXED_ONE};
+}
+struct RenderComponent { SDL_Texture* texture; };
+struct HealthComponent { int health; };
+struct MovementComponent {
+    std::vector<Point> path;
+    size_t pathIndex = 0;
+    int flowField = -1;      // >= 0 steers by a shared flow field instead of path
+    uint32_t pathOrder = 0;  // Bumped by every new order so late async path results can be recognised
+    bool patrolling = false; // On reaching patrolTo the unit turns back towards patrolFrom
+    Point patrolFrom{0, 0}, patrolTo{0, 0};
+};
+struct WorkerComponent { bool isCarrying = false; int minerals = 0; EntityID targetResource = INVALID_ENTITY; EntityID base = INVALID_ENTITY; };
+struct AttackComponent { 
+    int damage, range; 
+    uint32_t readyTick = 0;         // Tick of the next allowed attack
+    EntityID focus = INVALID_ENTITY; // Ordered target, preferred whenever it is in range
+};
+// Units waiting to be trained, front first; the front one completes at readyTick
+struct ProductionQueue {
+    std::array<ComponentType, PRODUCTION_QUEUE_SLOTS> units{};
+    uint32_t count = 0;
+    uint32_t readyTick = 0;
+};
+// techRequirements maps a unit to the components the faction must already own an entity with (UNIT: a trained unit)
+struct BuildingComponent { 
+    std::vector<ComponentType> produceableUnits; 
+    std::map<ComponentType, std::vector<ComponentType>> techRequirements; 
+    ProductionQueue queue;
+};
+
+// Command for Multiplayer: a fixed-size tagged POD, so queues, rings and messages carry it by value without
+// allocating. Only the payload named after type is meaningful; STOP has none.
+enum CommandType : uint8_t { CMD_MOVE, CMD_PRODUCE, CMD_ATTACK, CMD_BUILD, CMD_GATHER, CMD_STOP, CMD_PATROL, CMD_TYPES };
+struct MovePayload { int32_t x, y; };
+struct ProducePayload { uint8_t unit; };   // ComponentType to train; id is the building
+struct AttackPayload { EntityID target; };
+struct BuildPayload { int32_t x, y; };     // Barracks tile
+struct GatherPayload { EntityID resource; };
+struct PatrolPayload { int32_t x, y; };    // Far end; the unit's tile when ordered is the near one
+struct Command {
+    Uint32 timestamp;
+    CommandType type;
+    EntityID id; // Unit given the order; the building for PRODUCE
+    union {
+        MovePayload move;
+        ProducePayload produce;
+        AttackPayload attack;
+        BuildPayload build;
+        GatherPayload gather;
+        PatrolPayload patrol;
+    };
+};
+static_assert(std::is_trivially_copyable_v<Command>, "Commands are copied through rings as raw values");
+
+// Archetype Storage: entities sharing a component set live in one archetype whose
+// components are packed into parallel arrays, so systems walk contiguous memory
+using ComponentMask = uint32_t;
+constexpr ComponentMask componentBit(ComponentType type) { return 1u << type; }
+
+const ComponentMask UNIT_ARCHETYPE = componentBit(POSITION) | componentBit(RENDER) | componentBit(HEALTH) |
+                                     componentBit(MOVEMENT) | componentBit(ATTACK) | componentBit(FACTION);
+const ComponentMask WORKER_ARCHETYPE = UNIT_ARCHETYPE | componentBit(WORKER);
+const ComponentMask BUILDING_ARCHETYPE = componentBit(POSITION) | componentBit(RENDER) | componentBit(HEALTH) |
+                                         componentBit(BUILDING) | componentBit(FACTION);
+const ComponentMask RESOURCE_ARCHETYPE = componentBit(POSITION) | componentBit(RENDER) | componentBit(HEALTH) |
+                                         componentBit(FACTION);
+
+struct Archetype {
+    ComponentMask mask = 0;
+    uint32_t version = 0; // Bumped whenever an entity enters or leaves
+    std::vector<EntityID> ids;
+    std::vector<PositionComponent> positions;
+    std::vector<RenderComponent> renders;
+    std::vector<HealthComponent> healths;
+    std::vector<MovementComponent> movements;
+    std::vector<WorkerComponent> workers;
+    std::vector<AttackComponent> attacks;
+    std::vector<BuildingComponent> buildings;
+    std::vector<Faction> factions;
+
+    // Visits only the columns this archetype actually stores
+    template <typename F> void forEachColumn(F&& f) {
+        if (mask & componentBit(POSITION)) f(positions);
+        if (mask & componentBit(RENDER)) f(renders);
+        if (mask & componentBit(HEALTH)) f(healths);
+        if (mask & componentBit(MOVEMENT)) f(movements);
+        if (mask & componentBit(WORKER)) f(workers);
+        if (mask & componentBit(ATTACK)) f(attacks);
+        if (mask & componentBit(BUILDING)) f(buildings);
+        if (mask & componentBit(FACTION)) f(factions);
+    }
+};
+
+template <typename T> struct ComponentInfo;
+template <> struct ComponentInfo<PositionComponent> {
+    static constexpr ComponentType type = POSITION;
+    template <typename A> static auto& column(A& a) { return a.positions; }
+};
+template <> struct ComponentInfo<RenderComponent> {
+    static constexpr ComponentType type = RENDER;
+    template <typename A> static auto& column(A& a) { return a.renders; }
+};
+template <> struct ComponentInfo<HealthComponent> {
+    static constexpr ComponentType type = HEALTH;
+    template <typename A> static auto& column(A& a) { return a.healths; }
+};
+template <> struct ComponentInfo<MovementComponent> {
+    static constexpr ComponentType type = MOVEMENT;
+    template <typename A> static auto& column(A& a) { return a.movements; }
+};
+template <> struct ComponentInfo<WorkerComponent> {
+    static constexpr ComponentType type = WORKER;
+    template <typename A> static auto& column(A& a) { return a.workers; }
+};
+template <> struct ComponentInfo<AttackComponent> {
+    static constexpr ComponentType type = ATTACK;
+    template <typename A> static auto& column(A& a) { return a.attacks; }
+};
+template <> struct ComponentInfo<BuildingComponent> {
+    static constexpr ComponentType type = BUILDING;
+    template <typename A> static auto& column(A& a) { return a.buildings; }
+};
+template <> struct ComponentInfo<Faction> {
+    static constexpr ComponentType type = FACTION;
+    template <typename A> static auto& column(A& a) { return a.factions; }
+};
+
+// ECS System
+class ECS {
+public:
+    struct EntityRecord { uint32_t archetype = 0; uint32_t row = 0; uint32_t generation = 0; bool alive = false; };
+
+    std::vector<Archetype> archetypes;
+    std::vector<EntityRecord> records; // Indexed by entityIndex(id)
+    std::vector<uint32_t> freeIndices;
+    std::vector<EntityID> pendingDestroy;
+    std::unordered_map<ComponentMask, uint32_t> archetypeLookup;
+    size_t entityCount = 0;
+
+    EntityID createEntity(ComponentMask mask) {
+        // Slots claimed through createEntityWithID stay in the free list until popped here
+        while (!freeIndices.empty() && records[freeIndices.back()].alive) freeIndices.pop_back();
+        uint32_t index;
+        if (!freeIndices.empty()) {
+            index = freeIndices.back();
+            freeIndices.pop_back();
+        } else {
+            index = static_cast<uint32_t>(records.size());
+            records.emplace_back();
+        }
+        return place(makeEntityID(index, records[index].generation), mask);
+    }
+
+    // Used when the ID is dictated by the server (state sync)
+    EntityID createEntityWithID(EntityID id, ComponentMask mask) {
+        uint32_t index = entityIndex(id);
+        while (records.size() <= index) {
+            freeIndices.push_back(static_cast<uint32_t>(records.size()));
+            records.emplace_back();
+        }
+        if (records[index].alive) destroyEntity(makeEntityID(index, records[index].generation));
+        records[index].generation = entityGeneration(id);
+        return place(id, mask);
+    }
+
+    // Swap-and-pop keeps every column packed; the slot's generation is bumped so old handles go stale
+    void destroyEntity(EntityID id) {
+        if (!isAlive(id)) return;
+        EntityRecord& record = records[entityIndex(id)];
+        Archetype& arch = archetypes[record.archetype];
+        size_t row = record.row;
+        size_t last = arch.ids.size() - 1;
+        if (row != last) {
+            arch.ids[row] = arch.ids[last];
+            records[entityIndex(arch.ids[row])].row = static_cast<uint32_t>(row);
+            arch.forEachColumn([&](auto& column) { column[row] = std::move(column[last]); });
+        }
+        arch.ids.pop_back();
+        arch.forEachColumn([](auto& column) { column.pop_back(); });
+        arch.version++;
+        record.alive = false;
+        record.generation++;
+        freeIndices.push_back(entityIndex(id));
+        entityCount--;
+    }
+
+    // Deferred destruction: safe to call while iterating, committed in one batch by flushDestroyed()
+    void queueDestroy(EntityID id) { pendingDestroy.push_back(id); }
+
+    size_t flushDestroyed() {
+        size_t destroyed = 0;
+        for (auto id : pendingDestroy) {
+            if (!isAlive(id)) continue; // Queued twice or already removed by state sync
+            destroyEntity(id);
+            destroyed++;
+        }
+        pendingDestroy.clear();
+        return destroyed;
+    }
+
+    bool isAlive(EntityID id) const {
+        uint32_t index = entityIndex(id);
+        return index < records.size() && records[index].alive && records[index].generation == entityGeneration(id);
+    }
+    size_t size() const { return entityCount; }
+
+    ComponentMask maskOf(EntityID id) const { return isAlive(id) ? archetypes[records[entityIndex(id)].archetype].mask : 0; }
+
+    template <typename T> bool has(EntityID id) const { return maskOf(id) & componentBit(ComponentInfo<T>::type); }
+
+    template <typename T> T* get(EntityID id) {
+        if (!has<T>(id)) return nullptr;
+        const EntityRecord& record = records[entityIndex(id)];
+        return &ComponentInfo<T>::column(archetypes[record.archetype])[record.row];
+    }
+    template <typename T> const T* get(EntityID id) const {
+        if (!has<T>(id)) return nullptr;
+        const EntityRecord& record = records[entityIndex(id)];
+        return &ComponentInfo<T>::column(archetypes[record.archetype])[record.row];
+    }
+
+    // Unchecked access for entities known to carry the component
+    template <typename T> T& at(EntityID id) { return *get<T>(id); }
+    template <typename T> const T& at(EntityID id) const { return *get<T>(id); }
+
+    // Calls f(id, Ts&...) for every entity holding all Ts and none of the excluded components.
+    // Must not create or destroy entities while iterating.
+    template <typename... Ts, typename F> void each(F&& f, ComponentMask exclude = 0) { eachIn<Ts...>(*this, f, exclude); }
+    template <typename... Ts, typename F> void each(F&& f, ComponentMask exclude = 0) const { eachIn<Ts...>(*this, f, exclude); }
+
+    // First entity matching pred, or INVALID_ENTITY
+    template <typename... Ts, typename F> EntityID findEntity(F&& pred, ComponentMask exclude = 0) const {
+        const ComponentMask required = (componentBit(ComponentInfo<Ts>::type) | ... | 0u);
+        for (const auto& arch : archetypes) {
+            if ((arch.mask & required) != required || (arch.mask & exclude)) continue;
+            for (size_t row = 0; row < arch.ids.size(); row++) {
+                if (pred(arch.ids[row], ComponentInfo<Ts>::column(arch)[row]...)) return arch.ids[row];
+            }
+        }
+        return INVALID_ENTITY;
+    }
+
+private:
+    EntityID place(EntityID id, ComponentMask mask) {
+        uint32_t index = archetypeFor(mask);
+        Archetype& arch = archetypes[index];
+        EntityRecord& record = records[entityIndex(id)];
+        record.archetype = index;
+        record.row = static_cast<uint32_t>(arch.ids.size());
+        record.alive = true;
+        arch.ids.push_back(id);
+        arch.forEachColumn([](auto& column) { column.emplace_back(); });
+        arch.version++;
+        entityCount++;
+        return id;
+    }
+
+    uint32_t archetypeFor(ComponentMask mask) {
+        auto it = archetypeLookup.find(mask);
+        if (it != archetypeLookup.end()) return it->second;
+        uint32_t index = static_cast<uint32_t>(archetypes.size());
+        archetypes.emplace_back();
+        archetypes.back().mask = mask;
+        archetypeLookup[mask] = index;
+        return index;
+    }
+
+    template <typename... Ts, typename Self, typename F> static void eachIn(Self& self, F& f, ComponentMask exclude) {
+        const ComponentMask required = (componentBit(ComponentInfo<Ts>::type) | ... | 0u);
+        for (auto& arch : self.archetypes) {
+            if ((arch.mask & required) != required || (arch.mask & exclude)) continue;
+            const size_t count = arch.ids.size();
+            [&](auto*... columns) {
+                for (size_t row = 0; row < count; row++) f(arch.ids[row], columns[row]...);
+            }(ComponentInfo<Ts>::column(arch).data()...);
+        }
+    }
+};
+
+// Resources are anything that is neither a worker nor a building
+const ComponentMask NON_RESOURCE_MASK = componentBit(WORKER) | componentBit(BUILDING);
+
+// Entity Configuration for Scalability
+struct EntityConfig {
+    Faction faction;
+    int x, y;
+    int health;
+    bool isWorker;
+    bool isBuilding;
+    std::vector<ComponentType> produceableUnits;
+    std::string textureName;
+};
+
+// Single-producer single-consumer ring: one thread pushes and one pops, with no lock and no allocation after
+// construction. The two indices sit on separate cache lines so producer and consumer do not contend for one.
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "ring capacity must be a power of two");
+    static_assert(std::is_trivially_copyable_v<T>, "ring slots are overwritten in place");
+
+public:
+    // False when full; the value is not queued
+    bool push(const T& value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == Capacity) return false;
+        slots[h & (Capacity - 1)] = value;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        value = slots[t & (Capacity - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+private:
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) T slots[Capacity];
+};
+
+using CommandRing = SpscRing<Command, COMMAND_RING_CAPACITY>;
+
+// Profiler: PROFILE_ZONE scopes record [start, end) into an SpscRing owned by the recording thread, which the
+// main thread drains once per frame, so recording never takes a lock. Per zone it keeps
+// milliseconds per frame over the last PROFILER_WINDOW_FRAMES for the overlay, and it can write the events of a
+// window of frames as a Chrome trace_event file. While off, a zone costs one relaxed load and a branch.
+class Profiler {
+public:
+    struct Event { uint16_t zone; uint16_t thread; uint64_t startNs, endNs; };
+
+    std::atomic<bool> enabled{false};
+    size_t eventsDropped = 0; // Ring overflows (a thread recorded faster than frames drained it)
+
+    static uint64_t now() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    // Id for a zone name, registered once per call site; ids past PROFILER_MAX_ZONES share the last one
+    uint16_t zone(const char* name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t count = zoneCount.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < count; i++) {
+            if (strcmp(zoneNames[i], name) == 0) return static_cast<uint16_t>(i);
+        }
+        if (count == PROFILER_MAX_ZONES) return PROFILER_MAX_ZONES - 1;
+        zoneNames[count] = name;
+        zoneCount.store(count + 1, std::memory_order_release);
+        return static_cast<uint16_t>(count);
+    }
+
+    void record(uint16_t zone, uint64_t startNs, uint64_t endNs) {
+        ThreadBuffer& buffer = localBuffer();
+        if (!buffer.events.push({zone, buffer.thread, startNs, endNs})) buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Writes the frames [firstFrame, firstFrame + frameCount) to path when the last of them ends
+    void captureTrace(const std::string& path, uint32_t firstFrame, uint32_t frameCount) {
+        tracePath = path;
+        traceFirst = firstFrame;
+        traceEnd = firstFrame + std::max(1u, frameCount);
+        updateEnabled();
+    }
+
+    void setOverlay(bool on) {
+        overlay = on;
+        updateEnabled();
+    }
+    bool overlayShown() const { return overlay; }
+
+    // Main thread, once per frame: drains every thread's ring into the rolling totals and the trace
+    void endFrame() {
+        if (!enabled.load(std::memory_order_relaxed)) {
+            frame++;
+            return;
+        }
+        double frameMs[PROFILER_MAX_ZONES] = {};
+        bool tracing = !tracePath.empty() && frame >= traceFirst && frame < traceEnd;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& buffer : buffers) {
+                Event event;
+                while (buffer->events.pop(event)) {
+                    frameMs[event.zone] += (event.endNs - event.startNs) / 1e6;
+                    if (tracing) trace.push_back(event);
+                }
+                eventsDropped += buffer->dropped.exchange(0, std::memory_order_relaxed);
+            }
+        }
+        for (size_t zone = 0; zone < PROFILER_MAX_ZONES; zone++) history[zone][frame % PROFILER_WINDOW_FRAMES] = frameMs[zone];
+        frame++;
+        if (!tracePath.empty() && frame == traceEnd) writeTrace();
+    }
+
+    // Mean milliseconds per frame over the window, for each zone seen so far
+    template <typename Visit>
+    void forEachZone(Visit visit) const {
+        size_t count = zoneCount.load(std::memory_order_acquire);
+        for (size_t zone = 0; zone < count; zone++) {
+            double sum = 0;
+            for (double ms : history[zone]) sum += ms;
+            visit(zoneNames[zone], sum / PROFILER_WINDOW_FRAMES);
+        }
+    }
+
+    // A trace whose window has not ended yet (the game quit early) is written with what it has
+    void finish() {
+        if (!tracePath.empty() && frame > traceFirst) writeTrace();
+    }
+
+private:
+    struct ThreadBuffer {
+        SpscRing<Event, PROFILER_THREAD_EVENTS> events; // Recording thread to main thread
+        std::atomic<size_t> dropped{0};
+        std::atomic<bool> released{false}; // Its thread exited; reused by the next new thread once drained
+        uint16_t thread = 0;
+    };
+    // Hands the buffer back when its thread exits, so any thread that records zones and then ends frees its ring
+    struct BufferLease {
+        ThreadBuffer* buffer = nullptr;
+        ~BufferLease() { if (buffer) buffer->released.store(true, std::memory_order_release); }
+    };
+
+    std::mutex mutex; // Guards buffers and zone registration, never taken while recording
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    const char* zoneNames[PROFILER_MAX_ZONES] = {};
+    std::atomic<size_t> zoneCount{0};
+    double history[PROFILER_MAX_ZONES][PROFILER_WINDOW_FRAMES] = {};
+    uint32_t frame = 0;
+    bool overlay = false;
+    std::string tracePath;
+    uint32_t traceFirst = 0, traceEnd = 0;
+    std::vector<Event> trace;
+
+    void updateEnabled() { enabled.store(overlay || !tracePath.empty(), std::memory_order_relaxed); }
+
+    ThreadBuffer& localBuffer() {
+        thread_local BufferLease lease;
+        if (lease.buffer) return *lease.buffer;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& buffer : buffers) {
+            if (buffer->released.load(std::memory_order_acquire) && buffer->events.empty()) {
+                buffer->released.store(false, std::memory_order_relaxed);
+                lease.buffer = buffer.get();
+            }
+            if (lease.buffer) break;
+        }
+        if (!lease.buffer) {
+            buffers.push_back(std::make_unique<ThreadBuffer>());
+            buffers.back()->thread = static_cast<uint16_t>(buffers.size());
+            lease.buffer = buffers.back().get();
+        }
+        return *lease.buffer;
+    }
+
+    void writeTrace() {
+        std::ofstream file(tracePath, std::ios::trunc);
+        uint64_t origin = trace.empty() ? 0 : trace.front().startNs;
+        for (const auto& event : trace) origin = std::min(origin, event.startNs);
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        for (size_t i = 0; i < trace.size(); i++) {
+            const Event& event = trace[i];
+            char line[256];
+            snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n", zoneNames[event.zone],
+                     static_cast<unsigned>(event.thread), (event.startNs - origin) / 1e3, (event.endNs - event.startNs) / 1e3, i + 1 < trace.size() ? "," : "");
+            file << line;
+        }
+        file << "]}\n";
+        if (file) std::cout << "Wrote " << trace.size() << " trace events to " << tracePath << std::endl;
+        else std::cerr << "Cannot write trace " << tracePath << std::endl;
+        trace.clear();
+        tracePath.clear();
+        updateEnabled();
+    }
+};
+
+inline Profiler& profiler() {
+    static Profiler instance;
+    return instance;
+}
+
+// Times its enclosing scope when the profiler is on
+class ProfileScope {
+public:
+    explicit ProfileScope(uint16_t zone) : zone(zone), startNs(profiler().enabled.load(std::memory_order_relaxed) ? Profiler::now() : 0) {}
+    ~ProfileScope() { if (startNs) profiler().record(zone, startNs, Profiler::now()); }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    uint16_t zone;
+    uint64_t startNs;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name) \
+    static const uint16_t PROFILE_CONCAT(profileZone, __LINE__) = profiler().zone(name); \
+    ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(PROFILE_CONCAT(profileZone, __LINE__))
+
+// Incremental Spatial Grid: an entity only changes buckets when it crosses a cell boundary.
+// Buckets cache positions so range queries never go back to the ECS.
+class SpatialGrid {
+public:
+    struct CellEntry { EntityID id; int x, y; };
+    struct Tracked { EntityID id = INVALID_ENTITY; int cell = -1; uint32_t slot = 0; uint32_t seenFrame = 0; };
+    struct CellMove { EntityID id; int from, to; }; // -1 for off the grid: created, destroyed or outside the map
+
+    std::vector<std::vector<CellEntry>> cells; // cols * rows buckets, row-major
+    std::vector<Tracked> tracked;              // Indexed by entityIndex(id)
+    int cellSize;
+    int cols, rows;
+    uint32_t frame = 0;
+
+    SpatialGrid(int mapWidth, int mapHeight) : SpatialGrid(mapWidth, mapHeight, std::max(GRID_CELL_SIZE, std::max(mapWidth, mapHeight) / 10)) {}
+
+    SpatialGrid(int mapWidth, int mapHeight, int fixedCellSize) : cellSize(fixedCellSize) {
+        cols = (mapWidth + cellSize - 1) / cellSize;
+        rows = (mapHeight + cellSize - 1) / cellSize;
+        cells.resize(cols * rows);
+    }
+
+    // With moves, every entity that changed cell this frame is appended to it
+    void update(const ECS& ecs, std::vector<CellMove>* moves = nullptr) {
+        frame++;
+        ecs.each<PositionComponent>([&](EntityID id, const PositionComponent& pos) {
+            uint32_t index = entityIndex(id);
+            if (index >= tracked.size()) tracked.resize(index + 1);
+            Tracked& entry = tracked[index];
+            if (entry.id != id && entry.cell >= 0) { // Slot reused by a new entity
+                if (moves) moves->push_back({entry.id, entry.cell, -1});
+                removeFromCell(index);
+            }
+            entry.id = id;
+            entry.seenFrame = frame;
+            int cell = cellIndex(pos.x, pos.y);
+            if (cell != entry.cell) {
+                if (moves) moves->push_back({id, entry.cell, cell});
+                if (entry.cell >= 0) removeFromCell(index);
+                if (cell >= 0) insertIntoCell(index, cell, pos.x, pos.y);
+            } else if (cell >= 0) {
+                CellEntry& cached = cells[cell][entry.slot];
+                cached.x = pos.x;
+                cached.y = pos.y;
+            }
+        });
+        // Entities not visited this frame were destroyed
+        for (uint32_t index = 0; index < tracked.size(); index++) {
+            if (tracked[index].cell < 0 || tracked[index].seenFrame == frame) continue;
+            if (moves) moves->push_back({tracked[index].id, tracked[index].cell, -1});
+            removeFromCell(index);
+        }
+    }
+
+    // Entities inside the inclusive tile rectangle, appended to out
+    void queryRect(int minX, int minY, int maxX, int maxY, std::vector<EntityID>& out) const {
+        if (minX > maxX) std::swap(minX, maxX);
+        if (minY > maxY) std::swap(minY, maxY);
+        int cx0 = std::max(0, minX / cellSize), cx1 = std::min(cols - 1, maxX / cellSize);
+        int cy0 = std::max(0, minY / cellSize), cy1 = std::min(rows - 1, maxY / cellSize);
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                for (const auto& entry : cells[cy * cols + cx]) {
+                    if (entry.x >= minX && entry.x <= maxX && entry.y >= minY && entry.y <= maxY) out.push_back(entry.id);
+                }
+            }
+        }
+    }
+
+    // Entities within Manhattan distance radius (the metric AttackComponent uses), appended to out
+    void queryRadius(int x, int y, int radius, std::vector<EntityID>& out) const {
+        int cx0 = std::max(0, (x - radius) / cellSize), cx1 = std::min(cols - 1, (x + radius) / cellSize);
+        int cy0 = std::max(0, (y - radius) / cellSize), cy1 = std::min(rows - 1, (y + radius) / cellSize);
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                for (const auto& entry : cells[cy * cols + cx]) {
+                    if (abs(entry.x - x) + abs(entry.y - y) <= radius) out.push_back(entry.id);
+                }
+            }
+        }
+    }
+
+private:
+    int cellIndex(int x, int y) const {
+        if (x < 0 || y < 0) return -1;
+        int gx = x / cellSize, gy = y / cellSize;
+        if (gx >= cols || gy >= rows) return -1;
+        return gy * cols + gx;
+    }
+
+    void insertIntoCell(uint32_t index, int cell, int x, int y) {
+        tracked[index].cell = cell;
+        tracked[index].slot = static_cast<uint32_t>(cells[cell].size());
+        cells[cell].push_back({tracked[index].id, x, y});
+    }
+
+    void removeFromCell(uint32_t index) {
+        Tracked& entry = tracked[index];
+        auto& bucket = cells[entry.cell];
+        if (entry.slot != bucket.size() - 1) {
+            bucket[entry.slot] = bucket.back();
+            tracked[entityIndex(bucket[entry.slot].id)].slot = entry.slot;
+        }
+        bucket.pop_back();
+        entry.cell = -1;
+    }
+};
+
+// Inclusive tile rectangle used to keep searches inside one cluster
+struct TileRect {
+    int minX, minY, maxX, maxY;
+    bool contains(int x, int y) const { return x >= minX && x <= maxX && y >= minY && y <= maxY; }
+};
+
+// A* Pathfinding: per-tile bookkeeping lives in flat arrays reused between searches. A search stamp
+// marks which entries belong to the current request, so nothing is cleared or allocated per path.
+class PathFinder {
+public:
+    int width, height;
+    std::vector<uint64_t> blocked; // Building occupancy bitmap, one bit per tile
+
+    PathFinder(int mapWidth, int mapHeight) : width(mapWidth), height(mapHeight) {
+        size_t tiles = static_cast<size_t>(width) * height;
+        blocked.assign((tiles + 63) / 64, 0);
+        stamp.assign(tiles, 0);
+        cost.resize(tiles);
+        parent.resize(tiles);
+    }
+
+    bool inBounds(int x, int y) const { return x >= 0 && x < width && y >= 0 && y < height; }
+    bool isBlocked(int x, int y) const {
+        uint32_t tile = y * width + x;
+        return (blocked[tile >> 6] >> (tile & 63)) & 1;
+    }
+    void setBlocked(int x, int y, bool value) {
+        uint32_t tile = y * width + x;
+        if (value) blocked[tile >> 6] |= 1ull << (tile & 63);
+        else blocked[tile >> 6] &= ~(1ull << (tile & 63));
+    }
+
+    // Rebuilds the occupancy bitmap only when a building archetype gained or lost entities.
+    // Tiles whose state flipped are appended to changedTiles when given.
+    bool syncObstacles(const ECS& ecs, std::vector<uint32_t>* changedTiles = nullptr) {
+        uint64_t version = 0;
+        for (const auto& arch : ecs.archetypes) {
+            if (arch.mask & componentBit(BUILDING)) version += arch.version;
+        }
+        if (version == obstacleVersion) return false;
+        obstacleVersion = version;
+        incoming.assign(blocked.size(), 0);
+        ecs.each<BuildingComponent, PositionComponent>([&](EntityID, const BuildingComponent&, const PositionComponent& pos) {
+            if (!inBounds(pos.x, pos.y)) return;
+            uint32_t tile = pos.y * width + pos.x;
+            incoming[tile >> 6] |= 1ull << (tile & 63);
+        });
+        loadObstacles(incoming, changedTiles);
+        return true;
+    }
+
+    // Replaces the occupancy bitmap wholesale (e.g. from a snapshot), reporting flipped tiles
+    void loadObstacles(const std::vector<uint64_t>& bitmap, std::vector<uint32_t>* changedTiles = nullptr) {
+        if (changedTiles) {
+            for (size_t word = 0; word < blocked.size(); word++) {
+                for (uint64_t diff = blocked[word] ^ bitmap[word]; diff; diff &= diff - 1) {
+                    changedTiles->push_back(static_cast<uint32_t>(word * 64 + __builtin_ctzll(diff)));
+                }
+            }
+        }
+        blocked = bitmap;
+    }
+
+    // Writes the tiles after start up to and including goal into path (cleared first).
+    // Returns false when the goal is unreachable. A bounded search never leaves the rectangle.
+    bool findPath(int startX, int startY, int endX, int endY, std::vector<Point>& path, const TileRect* bounds = nullptr) {
+        path.clear();
+        if (!inBounds(startX, startY) || !inBounds(endX, endY)) return false;
+        nextSearch();
+        uint32_t start = startY * width + startX;
+        uint32_t goal = endY * width + endX;
+        auto heuristic = [&](uint32_t tile) { // Chebyshev: diagonal steps cost the same as straight ones
+            return std::max(abs(static_cast<int>(tile % width) - endX), abs(static_cast<int>(tile / width) - endY));
+        };
+
+        open.clear();
+        stamp[start] = searchStamp;
+        cost[start] = 0;
+        parent[start] = start;
+        pushOpen({heuristic(start), 0, start});
+
+        while (!open.empty()) {
+            std::pop_heap(open.begin(), open.end(), nodeOrder);
+            Node current = open.back();
+            open.pop_back();
+            if (current.g != cost[current.tile]) continue; // Superseded by a cheaper entry
+            if (current.tile == goal) break;
+
+            int cx = current.tile % width, cy = current.tile / width;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (dx == 0 && dy == 0) continue;
+                    int nx = cx + dx, ny = cy + dy;
+                    if (!inBounds(nx, ny) || isBlocked(nx, ny) || (bounds && !bounds->contains(nx, ny))) continue;
+                    uint32_t next = ny * width + nx;
+                    int newCost = current.g + 1;
+                    if (stamp[next] != searchStamp || newCost < cost[next]) {
+                        stamp[next] = searchStamp;
+                        cost[next] = newCost;
+                        parent[next] = current.tile;
+                        pushOpen({newCost + heuristic(next), newCost, next});
+                    }
+                }
+            }
+        }
+
+        if (stamp[goal] != searchStamp) return false; // Path not found
+        for (uint32_t tile = goal; tile != start; tile = parent[tile]) {
+            path.push_back({static_cast<int>(tile % width), static_cast<int>(tile / width)});
+        }
+        std::reverse(path.begin(), path.end());
+        return true;
+    }
+
+    // Breadth-first flood inside bounds; read the step counts back with floodCost() before the next search
+    void flood(int startX, int startY, const TileRect& bounds) {
+        nextSearch();
+        uint32_t start = startY * width + startX;
+        stamp[start] = searchStamp;
+        cost[start] = 0;
+        queue.clear();
+        queue.push_back(start);
+        for (size_t head = 0; head < queue.size(); head++) {
+            uint32_t tile = queue[head];
+            int cx = tile % width, cy = tile / width;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int nx = cx + dx, ny = cy + dy;
+                    if (!bounds.contains(nx, ny) || !inBounds(nx, ny) || isBlocked(nx, ny)) continue;
+                    uint32_t next = ny * width + nx;
+                    if (stamp[next] == searchStamp) continue;
+                    stamp[next] = searchStamp;
+                    cost[next] = cost[tile] + 1;
+                    queue.push_back(next);
+                }
+            }
+        }
+    }
+
+    int floodCost(int x, int y) const {
+        uint32_t tile = y * width + x;
+        return stamp[tile] == searchStamp ? cost[tile] : -1;
+    }
+
+private:
+    struct Node { int f, g; uint32_t tile; };
+
+    void nextSearch() {
+        if (++searchStamp == 0) {
+            std::fill(stamp.begin(), stamp.end(), 0);
+            searchStamp = 1;
+        }
+    }
+
+    // Min-heap on f, preferring the deeper node on ties
+    static bool nodeOrder(const Node& a, const Node& b) { return a.f > b.f || (a.f == b.f && a.g < b.g); }
+
+    void pushOpen(const Node& node) {
+        open.push_back(node);
+        std::push_heap(open.begin(), open.end(), nodeOrder);
+    }
+
+    std::vector<uint32_t> stamp;
+    std::vector<int> cost;
+    std::vector<uint32_t> parent;
+    std::vector<Node> open; // Keeps its capacity between searches
+    std::vector<uint32_t> queue;
+    std::vector<uint64_t> incoming;
+    uint32_t searchStamp = 0;
+    uint64_t obstacleVersion = ~0ull;
+};
+
+// Hierarchical Pathfinding (HPA*): the map is cut into CLUSTER_SIZE clusters joined by portals on
+// their shared borders. Long paths are planned over the portal graph and refined cluster by cluster.
+// Refined portal-to-portal corridors are kept in an LRU cache keyed by (start cluster, goal cluster).
+class HierarchicalPathFinder {
+public:
+    struct PortalNode {
+        int x, y, cluster;
+        int partner;                           // Portal on the other side of the border (step cost 1)
+        std::vector<std::pair<int, int>> edges; // (node, cost) to portals of the same cluster
+        bool alive;
+    };
+    struct CachedCorridor { uint64_t key; std::vector<Point> tiles; };
+
+    PathFinder& low;
+    int clustersX, clustersY;
+    std::vector<PortalNode> nodes;
+    std::vector<int> freeNodes;
+    std::vector<std::vector<int>> clusterNodes;
+    std::vector<std::vector<int>> borderNodes; // [cluster * 2] east border, [cluster * 2 + 1] south border
+    std::list<CachedCorridor> cache;           // Most recently used first
+    std::unordered_map<uint64_t, std::list<CachedCorridor>::iterator> cacheIndex;
+    size_t cacheHits = 0, cacheMisses = 0;
+    bool useCache = true; // Off when results must not depend on earlier searches (deterministic simulation)
+
+    explicit HierarchicalPathFinder(PathFinder& pathfinder) : low(pathfinder) {
+        clustersX = (low.width + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        clustersY = (low.height + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        clusterNodes.resize(clustersX * clustersY);
+        borderNodes.resize(clustersX * clustersY * 2);
+        std::vector<int> all(clustersX * clustersY);
+        for (size_t c = 0; c < all.size(); c++) all[c] = static_cast<int>(c);
+        rebuild(all);
+    }
+
+    // Pulls building changes into the occupancy bitmap and rebuilds only the clusters they touched.
+    // Returns true when any tile changed.
+    bool sync(const ECS& ecs) {
+        changedTiles.clear();
+        if (!low.syncObstacles(ecs, &changedTiles)) return false;
+        return rebuildChanged();
+    }
+
+    // Same as sync() but from a bitmap, for searchers that work on an obstacle snapshot
+    bool applyObstacles(const std::vector<uint64_t>& bitmap) {
+        changedTiles.clear();
+        low.loadObstacles(bitmap, &changedTiles);
+        return rebuildChanged();
+    }
+
+    bool findPath(int startX, int startY, int endX, int endY, std::vector<Point>& path) {
+        path.clear();
+        if (!low.inBounds(startX, startY) || !low.inBounds(endX, endY)) return false;
+        int startCluster = clusterOf(startX, startY), goalCluster = clusterOf(endX, endY);
+        int dx = abs(startCluster % clustersX - goalCluster % clustersX);
+        int dy = abs(startCluster / clustersX - goalCluster / clustersX);
+        if (dx <= 1 && dy <= 1) return low.findPath(startX, startY, endX, endY, path); // Short hop, plain A* is cheapest
+        if (low.isBlocked(endX, endY)) return false;
+
+        uint64_t key = (static_cast<uint64_t>(startCluster) << 32) | static_cast<uint32_t>(goalCluster);
+        auto hit = useCache ? cacheIndex.find(key) : cacheIndex.end();
+        if (hit != cacheIndex.end()) {
+            cache.splice(cache.begin(), cache, hit->second);
+            if (splice(startX, startY, endX, endY, hit->second->tiles, path)) {
+                cacheHits++;
+                return true;
+            }
+        }
+        cacheMisses++;
+
+        if (!searchAbstract(startX, startY, startCluster, endX, endY, goalCluster)) return false;
+        std::vector<Point> corridor;
+        refine(corridor);
+        if (!splice(startX, startY, endX, endY, corridor, path)) return false;
+        if (useCache) store(key, std::move(corridor));
+        return true;
+    }
+
+private:
+    struct OpenNode { int f, g, node; };
+    static bool openOrder(const OpenNode& a, const OpenNode& b) { return a.f > b.f || (a.f == b.f && a.g < b.g); }
+
+    std::vector<uint32_t> changedTiles;
+    std::vector<Point> segment;
+    std::vector<std::pair<int, int>> entryCosts;
+    std::vector<int> goalCost, nodeCost, nodeParent;
+    std::vector<uint32_t> nodeStamp;
+    std::vector<OpenNode> open;
+    std::vector<int> abstractPath;
+    uint32_t searchStamp = 0;
+
+    int clusterOf(int x, int y) const { return (y / CLUSTER_SIZE) * clustersX + x / CLUSTER_SIZE; }
+
+    bool rebuildChanged() {
+        if (changedTiles.empty()) return false;
+        std::vector<int> dirty;
+        for (auto tile : changedTiles) dirty.push_back(clusterOf(tile % low.width, tile / low.width));
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+        rebuild(dirty);
+        return true;
+    }
+
+    TileRect clusterBounds(int cluster) const {
+        int minX = (cluster % clustersX) * CLUSTER_SIZE, minY = (cluster / clustersX) * CLUSTER_SIZE;
+        return {minX, minY, std::min(minX + CLUSTER_SIZE, low.width) - 1, std::min(minY + CLUSTER_SIZE, low.height) - 1};
+    }
+
+    void rebuild(const std::vector<int>& dirty) {
+        std::vector<char> borderDirty(borderNodes.size(), 0), clusterDirty(clusterNodes.size(), 0);
+        for (int c : dirty) {
+            int cx = c % clustersX, cy = c / clustersX;
+            borderDirty[c * 2] = borderDirty[c * 2 + 1] = 1;
+            if (cx > 0) borderDirty[(c - 1) * 2] = 1;
+            if (cy > 0) borderDirty[(c - clustersX) * 2 + 1] = 1;
+            // Neighbours share the rebuilt borders, so their intra-cluster edges change too
+            clusterDirty[c] = 1;
+            if (cx > 0) clusterDirty[c - 1] = 1;
+            if (cx + 1 < clustersX) clusterDirty[c + 1] = 1;
+            if (cy > 0) clusterDirty[c - clustersX] = 1;
+            if (cy + 1 < clustersY) clusterDirty[c + clustersX] = 1;
+        }
+        for (size_t b = 0; b < borderNodes.size(); b++) {
+            if (!borderDirty[b]) continue;
+            clearBorder(static_cast<int>(b));
+            buildBorder(static_cast<int>(b));
+        }
+        for (size_t c = 0; c < clusterNodes.size(); c++) {
+            if (clusterDirty[c]) buildIntraEdges(static_cast<int>(c));
+        }
+        invalidate(clusterDirty);
+    }
+
+    void clearBorder(int border) {
+        for (int n : borderNodes[border]) {
+            auto& members = clusterNodes[nodes[n].cluster];
+            members.erase(std::remove(members.begin(), members.end(), n), members.end());
+            nodes[n].alive = false;
+            nodes[n].edges.clear();
+            freeNodes.push_back(n);
+        }
+        borderNodes[border].clear();
+    }
+
+    int addNode(int x, int y, int border) {
+        int n;
+        if (!freeNodes.empty()) {
+            n = freeNodes.back();
+            freeNodes.pop_back();
+        } else {
+            n = static_cast<int>(nodes.size());
+            nodes.emplace_back();
+        }
+        nodes[n].x = x;
+        nodes[n].y = y;
+        nodes[n].cluster = clusterOf(x, y);
+        nodes[n].partner = -1;
+        nodes[n].alive = true;
+        clusterNodes[nodes[n].cluster].push_back(n);
+        borderNodes[border].push_back(n);
+        return n;
+    }
+
+    // Each maximal open run along a border becomes an entrance: one portal pair in the middle,
+    // or one at each end when the run is long
+    void buildBorder(int border) {
+        int cluster = border / 2;
+        bool east = border % 2 == 0;
+        int cx = cluster % clustersX, cy = cluster / clustersX;
+        if ((east && cx + 1 >= clustersX) || (!east && cy + 1 >= clustersY)) return;
+        TileRect rect = clusterBounds(cluster);
+        int length = east ? rect.maxY - rect.minY + 1 : rect.maxX - rect.minX + 1;
+        auto tileAt = [&](int i, int side) {
+            return east ? Point{rect.maxX + side, rect.minY + i} : Point{rect.minX + i, rect.maxY + side};
+        };
+        auto addPair = [&](int i) {
+            Point a = tileAt(i, 0), b = tileAt(i, 1);
+            int na = addNode(a.x, a.y, border);
+            int nb = addNode(b.x, b.y, border);
+            nodes[na].partner = nb;
+            nodes[nb].partner = na;
+        };
+        int runStart = -1;
+        for (int i = 0; i <= length; i++) {
+            bool open = false;
+            if (i < length) {
+                Point a = tileAt(i, 0), b = tileAt(i, 1);
+                open = !low.isBlocked(a.x, a.y) && !low.isBlocked(b.x, b.y);
+            }
+            if (open && runStart < 0) runStart = i;
+            if (!open && runStart >= 0) {
+                int runEnd = i - 1;
+                if (runEnd - runStart + 1 >= 6) {
+                    addPair(runStart);
+                    addPair(runEnd);
+                } else {
+                    addPair((runStart + runEnd) / 2);
+                }
+                runStart = -1;
+            }
+        }
+    }
+
+    void buildIntraEdges(int cluster) {
+        const auto& members = clusterNodes[cluster];
+        for (int n : members) nodes[n].edges.clear();
+        TileRect bounds = clusterBounds(cluster);
+        for (size_t i = 0; i < members.size(); i++) {
+            low.flood(nodes[members[i]].x, nodes[members[i]].y, bounds);
+            for (size_t j = i + 1; j < members.size(); j++) {
+                int steps = low.floodCost(nodes[members[j]].x, nodes[members[j]].y);
+                if (steps < 0) continue;
+                nodes[members[i]].edges.push_back({members[j], steps});
+                nodes[members[j]].edges.push_back({members[i], steps});
+            }
+        }
+    }
+
+    // A* over portals. Start and goal are attached through floods of their own clusters, and the goal
+    // is a virtual node (index nodes.size()) reached from any portal that can see it.
+    bool searchAbstract(int startX, int startY, int startCluster, int endX, int endY, int goalCluster) {
+        const int goal = static_cast<int>(nodes.size());
+        if (nodeStamp.size() < nodes.size() + 1) {
+            nodeStamp.resize(nodes.size() + 1, 0);
+            nodeCost.resize(nodes.size() + 1);
+            nodeParent.resize(nodes.size() + 1);
+            goalCost.resize(nodes.size() + 1);
+        }
+        if (++searchStamp == 0) {
+            std::fill(nodeStamp.begin(), nodeStamp.end(), 0);
+            searchStamp = 1;
+        }
+
+        entryCosts.clear();
+        low.flood(startX, startY, clusterBounds(startCluster));
+        for (int n : clusterNodes[startCluster]) {
+            int steps = low.floodCost(nodes[n].x, nodes[n].y);
+            if (steps >= 0) entryCosts.push_back({n, steps});
+        }
+        for (int n : clusterNodes[goalCluster]) goalCost[n] = -1;
+        low.flood(endX, endY, clusterBounds(goalCluster));
+        for (int n : clusterNodes[goalCluster]) goalCost[n] = low.floodCost(nodes[n].x, nodes[n].y);
+
+        auto heuristic = [&](int n) { return std::max(abs(nodes[n].x - endX), abs(nodes[n].y - endY)); };
+        auto relax = [&](int n, int g, int from) {
+            if (nodeStamp[n] == searchStamp && g >= nodeCost[n]) return;
+            nodeStamp[n] = searchStamp;
+            nodeCost[n] = g;
+            nodeParent[n] = from;
+            open.push_back({g + (n == goal ? 0 : heuristic(n)), g, n});
+            std::push_heap(open.begin(), open.end(), openOrder);
+        };
+
+        open.clear();
+        for (auto& entry : entryCosts) relax(entry.first, entry.second, -1);
+        while (!open.empty()) {
+            std::pop_heap(open.begin(), open.end(), openOrder);
+            OpenNode current = open.back();
+            open.pop_back();
+            if (current.g != nodeCost[current.node]) continue;
+            if (current.node == goal) break;
+            const PortalNode& node = nodes[current.node];
+            if (node.cluster == goalCluster && goalCost[current.node] >= 0) relax(goal, current.g + goalCost[current.node], current.node);
+            if (node.partner >= 0) relax(node.partner, current.g + 1, current.node);
+            for (auto& edge : node.edges) relax(edge.first, current.g + edge.second, current.node);
+        }
+        if (nodeStamp[goal] != searchStamp) return false;
+
+        abstractPath.clear();
+        for (int n = nodeParent[goal]; n >= 0; n = nodeParent[n]) abstractPath.push_back(n);
+        std::reverse(abstractPath.begin(), abstractPath.end());
+        return true;
+    }
+
+    // Expands the abstract path into tiles from its first portal to its last
+    void refine(std::vector<Point>& corridor) {
+        corridor.push_back({nodes[abstractPath.front()].x, nodes[abstractPath.front()].y});
+        for (size_t i = 1; i < abstractPath.size(); i++) {
+            const PortalNode& from = nodes[abstractPath[i - 1]];
+            const PortalNode& to = nodes[abstractPath[i]];
+            if (from.partner == abstractPath[i]) {
+                corridor.push_back({to.x, to.y});
+                continue;
+            }
+            TileRect bounds = clusterBounds(from.cluster);
+            low.findPath(from.x, from.y, to.x, to.y, segment, &bounds);
+            corridor.insert(corridor.end(), segment.begin(), segment.end());
+        }
+    }
+
+    // start -> corridor front (inside the start cluster) + corridor + corridor back -> goal (inside the goal cluster)
+    bool splice(int startX, int startY, int endX, int endY, const std::vector<Point>& corridor, std::vector<Point>& path) {
+        TileRect startBounds = clusterBounds(clusterOf(startX, startY));
+        if (!low.findPath(startX, startY, corridor.front().x, corridor.front().y, path, &startBounds)) return false;
+        path.insert(path.end(), corridor.begin() + 1, corridor.end());
+        TileRect goalBounds = clusterBounds(clusterOf(endX, endY));
+        if (!low.findPath(corridor.back().x, corridor.back().y, endX, endY, segment, &goalBounds)) {
+            path.clear();
+            return false;
+        }
+        path.insert(path.end(), segment.begin(), segment.end());
+        return true;
+    }
+
+    void store(uint64_t key, std::vector<Point>&& tiles) {
+        auto existing = cacheIndex.find(key);
+        if (existing != cacheIndex.end()) {
+            cache.erase(existing->second);
+            cacheIndex.erase(existing);
+        }
+        cache.push_front({key, std::move(tiles)});
+        cacheIndex[key] = cache.begin();
+        if (cache.size() > PATH_CACHE_CAPACITY) {
+            cacheIndex.erase(cache.back().key);
+            cache.pop_back();
+        }
+    }
+
+    // Drops corridors that start, end or pass through a rebuilt cluster
+    void invalidate(const std::vector<char>& clusterDirty) {
+        for (auto it = cache.begin(); it != cache.end();) {
+            bool stale = clusterDirty[it->key >> 32] || clusterDirty[static_cast<uint32_t>(it->key)];
+            for (size_t i = 0; !stale && i < it->tiles.size(); i++) stale = clusterDirty[clusterOf(it->tiles[i].x, it->tiles[i].y)];
+            if (stale) {
+                cacheIndex.erase(it->key);
+                it = cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+};
+
+// Flow Fields: one field per destination tile, shared by every unit ordered there. Each field stores a
+// single direction byte per tile pointing one step down the integration (BFS distance) field.
+const int FLOW_DX[8] = {1, -1, 0, 0, 1, 1, -1, -1};
+const int FLOW_DY[8] = {0, 0, 1, -1, 1, -1, 1, -1};
+const uint8_t FLOW_GOAL = 8;
+const uint8_t FLOW_UNREACHABLE = 255;
+
+class FlowFieldSystem {
+public:
+    struct FlowField {
+        uint32_t goal = 0;
+        uint32_t lastUsed = 0;
+        bool active = false;
+        std::vector<uint8_t> direction;
+    };
+
+    const PathFinder& grid;
+    std::vector<FlowField> fields;
+    std::vector<int> freeFields;
+    std::unordered_map<uint32_t, int> fieldByGoal;
+    uint32_t tick = 0;
+
+    explicit FlowFieldSystem(const PathFinder& pathfinder) : grid(pathfinder) {}
+
+    // Returns the shared field for this destination, building it on first use
+    int acquire(int goalX, int goalY) {
+        uint32_t goal = goalY * grid.width + goalX;
+        auto it = fieldByGoal.find(goal);
+        if (it != fieldByGoal.end()) {
+            fields[it->second].lastUsed = tick;
+            return it->second;
+        }
+        int index;
+        if (!freeFields.empty()) {
+            index = freeFields.back();
+            freeFields.pop_back();
+        } else {
+            index = static_cast<int>(fields.size());
+            fields.emplace_back();
+        }
+        FlowField& field = fields[index];
+        field.goal = goal;
+        field.lastUsed = tick;
+        field.active = true;
+        build(field);
+        fieldByGoal[goal] = index;
+        return index;
+    }
+
+    // Next tile from (x, y); false once the goal is reached or unreachable
+    bool nextStep(int index, int x, int y, Point& next) {
+        FlowField& field = fields[index];
+        field.lastUsed = tick;
+        uint8_t dir = field.direction[y * grid.width + x];
+        if (dir >= FLOW_GOAL) return false;
+        next = {x + FLOW_DX[dir], y + FLOW_DY[dir]};
+        return true;
+    }
+
+    // Obstacles moved: every live field is rebuilt in place
+    void rebuildAll() {
+        for (auto& field : fields) {
+            if (field.active) build(field);
+        }
+    }
+
+    // Frees fields no unit has read since the previous tick
+    void collect() {
+        for (size_t i = 0; i < fields.size(); i++) {
+            FlowField& field = fields[i];
+            if (!field.active || tick - field.lastUsed <= 1) continue;
+            field.active = false;
+            fieldByGoal.erase(field.goal);
+            freeFields.push_back(static_cast<int>(i));
+        }
+        tick++;
+    }
+
+private:
+    std::vector<uint32_t> integration;
+    std::vector<uint32_t> frontier;
+
+    void build(FlowField& field) {
+        const int width = grid.width, height = grid.height;
+        const size_t tiles = static_cast<size_t>(width) * height;
+        integration.assign(tiles, UINT32_MAX);
+        field.direction.assign(tiles, FLOW_UNREACHABLE);
+        frontier.clear();
+        integration[field.goal] = 0;
+        frontier.push_back(field.goal);
+        for (size_t head = 0; head < frontier.size(); head++) {
+            uint32_t tile = frontier[head];
+            int x = tile % width, y = tile / width;
+            for (int d = 0; d < 8; d++) {
+                int nx = x + FLOW_DX[d], ny = y + FLOW_DY[d];
+                if (!grid.inBounds(nx, ny) || grid.isBlocked(nx, ny)) continue;
+                uint32_t next = ny * width + nx;
+                if (integration[next] != UINT32_MAX) continue;
+                integration[next] = integration[tile] + 1;
+                frontier.push_back(next);
+            }
+        }
+        // Each reached tile points at its cheapest neighbour; straight moves win ties since they come first
+        for (uint32_t tile : frontier) {
+            if (tile == field.goal) {
+                field.direction[tile] = FLOW_GOAL;
+                continue;
+            }
+            int x = tile % width, y = tile / width;
+            uint32_t best = integration[tile];
+            for (int d = 0; d < 8; d++) {
+                int nx = x + FLOW_DX[d], ny = y + FLOW_DY[d];
+                if (!grid.inBounds(nx, ny)) continue;
+                uint32_t value = integration[ny * width + nx];
+                if (value < best) {
+                    best = value;
+                    field.direction[tile] = static_cast<uint8_t>(d);
+                }
+            }
+        }
+    }
+};
+
+// Asynchronous Path Requests: searches run on a worker pool, each worker owning its own HPA* over an
+// immutable snapshot of the obstacle bitmap. Results are applied on the main thread at the start of the
+// next tick, in submission order; results for dead units or superseded orders are dropped.
+struct ObstacleSnapshot {
+    uint64_t version;
+    std::vector<uint64_t> blocked;
+};
+
+class PathRequestService {
+public:
+    struct Request { EntityID unit; uint32_t order; uint64_t sequence; int startX, startY, endX, endY; bool exact; std::shared_ptr<const ObstacleSnapshot> obstacles; };
+    struct Result { EntityID unit; uint32_t order; uint64_t sequence; bool found; std::vector<Point> path; };
+
+    int width, height;
+    size_t applied = 0, dropped = 0;
+    bool exact = false; // Skip the per-worker corridor caches, so a path does not depend on which thread solved it
+
+    PathRequestService(int mapWidth, int mapHeight, unsigned threadCount = 0) : width(mapWidth), height(mapHeight) {
+        obstacles = std::make_shared<ObstacleSnapshot>(ObstacleSnapshot{0, std::vector<uint64_t>((static_cast<size_t>(width) * height + 63) / 64, 0)});
+        if (threadCount == 0) threadCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
+        for (unsigned i = 0; i < threadCount; i++) workers.emplace_back(&PathRequestService::workerLoop, this);
+    }
+
+    ~PathRequestService() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    // Requests submitted after this call are solved against the new bitmap
+    void publishObstacles(const std::vector<uint64_t>& blocked) {
+        obstacles = std::make_shared<ObstacleSnapshot>(ObstacleSnapshot{obstacles->version + 1, blocked});
+    }
+
+    // Starts a new order for the unit; any path still in flight for an older order will be dropped
+    void submit(EntityID unit, MovementComponent& movement, int startX, int startY, int endX, int endY) {
+        movement.pathOrder++;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back({unit, movement.pathOrder, nextSequence++, startX, startY, endX, endY, exact, obstacles});
+            inFlight++;
+        }
+        wake.notify_one();
+    }
+
+    // waitForAll blocks until every submitted search has finished, so lockstep peers apply the same set each tick
+    size_t applyResults(ECS& ecs, bool waitForAll = false) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (waitForAll) idle.wait(lock, [&] { return inFlight == 0; });
+            ready.swap(done);
+        }
+        std::sort(ready.begin(), ready.end(), [](const Result& a, const Result& b) { return a.sequence < b.sequence; });
+        size_t count = 0;
+        for (auto& result : ready) {
+            MovementComponent* movement = ecs.get<MovementComponent>(result.unit);
+            if (!movement || movement->pathOrder != result.order) {
+                dropped++;
+                continue;
+            }
+            movement->path = std::move(result.path);
+            movement->pathIndex = 0;
+            movement->flowField = -1;
+            count++;
+        }
+        ready.clear();
+        applied += count;
+        return count;
+    }
+
+    size_t pending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return inFlight;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::deque<Request> jobs;
+    std::vector<Result> done, ready;
+    std::vector<std::thread> workers;
+    std::shared_ptr<const ObstacleSnapshot> obstacles;
+    uint64_t nextSequence = 0;
+    size_t inFlight = 0;
+    bool stopping = false;
+
+    void workerLoop() {
+        PathFinder grid(width, height);
+        HierarchicalPathFinder hierarchy(grid);
+        uint64_t version = 0;
+        for (;;) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return; // Stopping
+                request = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            if (request.obstacles->version != version) {
+                hierarchy.applyObstacles(request.obstacles->blocked);
+                version = request.obstacles->version;
+            }
+            PROFILE_ZONE("path search");
+            Result result{request.unit, request.order, request.sequence, false, {}};
+            hierarchy.useCache = !request.exact;
+            result.found = hierarchy.findPath(request.startX, request.startY, request.endX, request.endY, result.path);
+            std::lock_guard<std::mutex> lock(mutex);
+            done.push_back(std::move(result));
+            if (--inFlight == 0) idle.notify_all();
+        }
+    }
+};
+
+// Seeded xorshift64* generator: the same seed yields the same sequence on every platform, unlike rand()
+class SimRandom {
+public:
+    uint64_t state;
+    explicit SimRandom(uint64_t seed = 1) : state(seed ? seed : 0x9E3779B97F4A7C15ull) {}
+
+    uint32_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return static_cast<uint32_t>((state * 0x2545F4914F6CDD1Dull) >> 32);
+    }
+    uint32_t below(uint32_t bound) { return next() % bound; }
+};
+
+// Tile Map: one terrain byte per tile, sized at run time. Map files are a 16-byte header ["SCMP"][u16 version]
+// [u16 width][u16 height][6 reserved] followed by the tiles row by row. They are memory-mapped rather than read,
+// so opening even a 1024x1024 map is a few system calls and only the pages that get drawn are ever touched;
+// edits to a mapped map stay private to the process.
+class TileMap {
+public:
+    int width = 0, height = 0;
+
+    TileMap() = default;
+    TileMap(const TileMap&) = delete;
+    TileMap& operator=(const TileMap&) = delete;
+    TileMap(TileMap&& other) noexcept { *this = std::move(other); }
+    TileMap& operator=(TileMap&& other) noexcept {
+        if (this == &other) return *this;
+        unmap();
+        width = other.width;
+        height = other.height;
+        owned = std::move(other.owned); // Keeps its buffer, so tiles stays valid
+        tiles = other.tiles;
+        mapping = other.mapping;
+        mappingSize = other.mappingSize;
+        other.width = other.height = 0;
+        other.tiles = nullptr;
+        other.mapping = nullptr;
+        other.mappingSize = 0;
+        return *this;
+    }
+    ~TileMap() { unmap(); }
+
+    // Random grass and dirt; the same seed gives every peer the same map
+    void generate(int mapWidth, int mapHeight, uint32_t seed) {
+        unmap();
+        width = mapWidth;
+        height = mapHeight;
+        owned.resize(static_cast<size_t>(width) * height);
+        SimRandom random(seed);
+        for (auto& tile : owned) tile = static_cast<uint8_t>(random.below(2));
+        tiles = owned.data();
+    }
+
+    bool load(const std::string& path) {
+        unmap();
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary);
+        owned.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (!readHeader(owned.data(), owned.size())) return false;
+        owned.erase(owned.begin(), owned.begin() + MAP_HEADER_BYTES);
+        tiles = owned.data();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info{};
+        void* mapped = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(MAP_HEADER_BYTES)) {
+            mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+        close(fd); // The mapping holds its own reference to the file
+        if (mapped == MAP_FAILED) return false;
+        mapping = mapped;
+        mappingSize = static_cast<size_t>(info.st_size);
+        if (!readHeader(static_cast<const uint8_t*>(mapping), mappingSize)) {
+            unmap();
+            return false;
+        }
+        tiles = static_cast<uint8_t*>(mapping) + MAP_HEADER_BYTES;
+#endif
+        return true;
+    }
+
+    bool save(const std::string& path) const {
+        uint8_t header[MAP_HEADER_BYTES] = {'S', 'C', 'M', 'P'};
+        const uint16_t fields[3] = {MAP_FILE_VERSION, static_cast<uint16_t>(width), static_cast<uint16_t>(height)};
+        for (int i = 0; i < 3; i++) {
+            header[4 + i * 2] = static_cast<uint8_t>(fields[i]);
+            header[5 + i * 2] = static_cast<uint8_t>(fields[i] >> 8);
+        }
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(tiles), static_cast<std::streamsize>(width) * height);
+        return file.good();
+    }
+
+    bool mapped() const { return mapping != nullptr; }
+    bool contains(int x, int y) const { return x >= 0 && y >= 0 && x < width && y < height; }
+    uint8_t at(int x, int y) const { return tiles[static_cast<size_t>(y) * width + x]; }
+    void set(int x, int y, uint8_t tile) { tiles[static_cast<size_t>(y) * width + x] = tile; }
+
+private:
+    uint8_t* tiles = nullptr;
+    std::vector<uint8_t> owned; // Generated (or, without mmap, loaded) tiles
+    void* mapping = nullptr;
+    size_t mappingSize = 0;
+
+    bool readHeader(const uint8_t* data, size_t size) {
+        if (size < MAP_HEADER_BYTES || memcmp(data, "SCMP", 4) != 0) return false;
+        auto u16 = [&](size_t offset) { return static_cast<int>(data[offset] | data[offset + 1] << 8); };
+        int mapWidth = u16(6), mapHeight = u16(8);
+        if (u16(4) != MAP_FILE_VERSION || mapWidth < 1 || mapHeight < 1 || mapWidth > MAP_MAX_SIDE || mapHeight > MAP_MAX_SIDE) return false;
+        if (size - MAP_HEADER_BYTES < static_cast<size_t>(mapWidth) * mapHeight) return false;
+        width = mapWidth;
+        height = mapHeight;
+        return true;
+    }
+
+    void unmap() {
+#ifndef _WIN32
+        if (mapping) munmap(mapping, mappingSize);
+#endif
+        mapping = nullptr;
+        mappingSize = 0;
+        owned.clear();
+        tiles = nullptr;
+        width = height = 0;
+    }
+};
+
+// Influence Maps: per coarse cell, the summed attack strength of each faction and the resource health left,
+// spread over nearby cells with linear falloff. Only sources that moved or changed value touch the maps,
+// each by stamping a delta over its neighbourhood, so a quiet tick costs one pass over the sources.
+class InfluenceMap {
+public:
+    enum Layer { THREAT_TERRAN, THREAT_ZERG, THREAT_PROTOSS, RESOURCES, LAYERS }; // Threat layers follow Faction
+    int cols, rows, width, height;
+    std::vector<int32_t> spread[LAYERS]; // What the AI reads
+    std::vector<int32_t> raw[LAYERS];    // Unspread sums, to tell which cells hold sources
+
+    InfluenceMap(int mapWidth, int mapHeight) : width(mapWidth), height(mapHeight) {
+        cols = (mapWidth + INFLUENCE_CELL_SIZE - 1) / INFLUENCE_CELL_SIZE;
+        rows = (mapHeight + INFLUENCE_CELL_SIZE - 1) / INFLUENCE_CELL_SIZE;
+        for (int layer = 0; layer < LAYERS; layer++) {
+            spread[layer].assign(cols * rows, 0);
+            raw[layer].assign(cols * rows, 0);
+        }
+    }
+
+    void update(const ECS& ecs) {
+        frame++;
+        ecs.each<PositionComponent, AttackComponent, Faction>([&](EntityID id, const PositionComponent& pos, const AttackComponent& attack,
+                                                                  const Faction& faction) {
+            track(id, static_cast<Layer>(faction), cellOf(pos.x, pos.y), attack.damage);
+        });
+        ecs.each<PositionComponent, HealthComponent>([&](EntityID id, const PositionComponent& pos, const HealthComponent& health) {
+            track(id, RESOURCES, cellOf(pos.x, pos.y), std::max(0, health.health));
+        }, NON_RESOURCE_MASK);
+        // Sources not visited this frame were destroyed
+        for (auto& source : tracked) {
+            if (source.cell >= 0 && source.seenFrame != frame) {
+                stamp(source.layer, source.cell, -source.value);
+                source.cell = -1;
+            }
+        }
+    }
+
+    int cellOf(int x, int y) const {
+        int cx = std::clamp(x / INFLUENCE_CELL_SIZE, 0, cols - 1), cy = std::clamp(y / INFLUENCE_CELL_SIZE, 0, rows - 1);
+        return cy * cols + cx;
+    }
+    int32_t at(Layer layer, int cell) const { return spread[layer][cell]; }
+    int32_t enemyThreat(Faction faction, int cell) const {
+        int32_t threat = 0;
+        for (int layer = THREAT_TERRAN; layer <= THREAT_PROTOSS; layer++) if (layer != faction) threat += spread[layer][cell];
+        return threat;
+    }
+    Point center(int cell) const {
+        return {std::min(width - 1, cell % cols * INFLUENCE_CELL_SIZE + INFLUENCE_CELL_SIZE / 2),
+                std::min(height - 1, cell / cols * INFLUENCE_CELL_SIZE + INFLUENCE_CELL_SIZE / 2)};
+    }
+    int distance(int a, int b) const { return std::max(abs(a % cols - b % cols), abs(a / cols - b / cols)); }
+
+private:
+    struct Source { EntityID id = INVALID_ENTITY; Layer layer = RESOURCES; int cell = -1; int32_t value = 0; uint32_t seenFrame = 0; };
+    std::vector<Source> tracked; // Indexed by entityIndex(id)
+    uint32_t frame = 0;
+
+    void track(EntityID id, Layer layer, int cell, int32_t value) {
+        uint32_t index = entityIndex(id);
+        if (index >= tracked.size()) tracked.resize(index + 1);
+        Source& source = tracked[index];
+        source.seenFrame = frame;
+        if (source.id == id && source.cell == cell && source.value == value) return;
+        if (source.cell >= 0) stamp(source.layer, source.cell, -source.value); // Moved, changed, or the slot was reused
+        source = {id, layer, cell, value, frame};
+        stamp(layer, cell, value);
+    }
+
+    void stamp(Layer layer, int cell, int32_t delta) {
+        if (delta == 0) return;
+        raw[layer][cell] += delta;
+        int cx = cell % cols, cy = cell / cols;
+        for (int y = std::max(0, cy - INFLUENCE_RADIUS); y <= std::min(rows - 1, cy + INFLUENCE_RADIUS); y++) {
+            for (int x = std::max(0, cx - INFLUENCE_RADIUS); x <= std::min(cols - 1, cx + INFLUENCE_RADIUS); x++) {
+                int falloff = INFLUENCE_RADIUS + 1 - std::max(abs(x - cx), abs(y - cy));
+                spread[layer][y * cols + x] += delta * falloff;
+            }
+        }
+    }
+};
+
+// AI Controller: each unit picks the highest-utility order (return cargo, harvest, retreat) from the
+// influence maps; fighting in range is left to CombatSystem. Every tick it evaluates a slice of its units, picking up where
+// the last tick stopped, so AI cost stays bounded however large the Zerg side grows.
+class AIController {
+public:
+    std::vector<EntityID> aiUnits;
+    std::vector<EntityID> nearby; // Scratch buffer reused across queries
+    SimRandom rng;
+    double budgetMs = AI_TIME_BUDGET_MS; // 0 evaluates exactly AI_DECISIONS_PER_TICK units, as deterministic runs need
+    size_t cursor = 0;                   // Next unit to evaluate
+    size_t decisions = 0;
+    std::vector<uint32_t> nextOrder;     // Per entityIndex(id): tick from which the unit may be ordered again
+
+    void update(ECS& ecs, const SpatialGrid& grid, const InfluenceMap& influence, PathRequestService& paths, uint32_t tick) {
+        auto start = std::chrono::steady_clock::now();
+        size_t limit = budgetMs > 0 ? aiUnits.size() : std::min(aiUnits.size(), AI_DECISIONS_PER_TICK);
+        for (size_t done = 0; done < limit;) {
+            if (cursor >= aiUnits.size()) cursor = 0;
+            EntityID id = aiUnits[cursor];
+            if (!ecs.has<PositionComponent>(id)) {
+                aiUnits[cursor] = aiUnits.back(); // Dead: the last unit takes its place and is evaluated next
+                aiUnits.pop_back();
+                limit = std::min(limit, aiUnits.size());
+                continue;
+            }
+            decide(ecs, grid, influence, paths, id, tick);
+            cursor++;
+            done++;
+            decisions++;
+            if (budgetMs > 0 && done % 8 == 0 &&
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() > budgetMs) break;
+        }
+    }
+
+private:
+    void decide(ECS& ecs, const SpatialGrid& grid, const InfluenceMap& influence, PathRequestService& paths, EntityID id, uint32_t tick) {
+        if (entityIndex(id) >= nextOrder.size()) nextOrder.resize(entityIndex(id) + 1, 0);
+        uint32_t& orderTick = nextOrder[entityIndex(id)];
+        const PositionComponent& pos = ecs.at<PositionComponent>(id);
+        Faction faction = ecs.at<Faction>(id);
+        WorkerComponent* worker = ecs.get<WorkerComponent>(id);
+        MovementComponent* movement = ecs.get<MovementComponent>(id);
+
+        // Movement orders need an idle unit, and time for the last order's async path to arrive
+        if (!movement || !movement->path.empty() || movement->flowField >= 0 || tick < orderTick) return;
+        int cell = influence.cellOf(pos.x, pos.y);
+        auto order = [&](int x, int y) {
+            paths.submit(id, *movement, pos.x, pos.y, x, y);
+            orderTick = tick + AI_ORDER_SETTLE_TICKS;
+        };
+
+        int32_t danger = influence.enemyThreat(faction, cell) - influence.at(static_cast<InfluenceMap::Layer>(faction), cell);
+        int32_t retreatUtility = danger > 0 ? danger * AI_RETREAT_WEIGHT : 0;
+        int32_t returnUtility = 0, harvestUtility = 0;
+        const PositionComponent* basePos = worker ? ecs.get<PositionComponent>(worker->base) : nullptr;
+        if (worker && worker->isCarrying && basePos && (abs(pos.x - basePos->x) > 1 || abs(pos.y - basePos->y) > 1)) returnUtility = AI_RETURN_UTILITY;
+        int harvestCell = -1;
+        if (worker && !worker->isCarrying) {
+            // Idle and settled but not on the patch: it was mined out or no path reached it, so pick again
+            const PositionComponent* targetPos = ecs.get<PositionComponent>(worker->targetResource);
+            if (!targetPos || targetPos->x != pos.x || targetPos->y != pos.y) worker->targetResource = INVALID_ENTITY;
+            if (worker->targetResource == INVALID_ENTITY) harvestCell = bestResourceCell(influence, faction, cell, harvestUtility);
+        }
+
+        if (retreatUtility > returnUtility && retreatUtility > harvestUtility) {
+            int safest = cell;
+            int32_t lowest = influence.enemyThreat(faction, cell);
+            int cx = cell % influence.cols, cy = cell / influence.cols;
+            for (int y = std::max(0, cy - 2); y <= std::min(influence.rows - 1, cy + 2); y++) {
+                for (int x = std::max(0, cx - 2); x <= std::min(influence.cols - 1, cx + 2); x++) {
+                    int32_t threat = influence.enemyThreat(faction, y * influence.cols + x);
+                    if (threat < lowest) {
+                        lowest = threat;
+                        safest = y * influence.cols + x;
+                    }
+                }
+            }
+            if (safest != cell) {
+                Point to = influence.center(safest);
+                order(to.x, to.y);
+                return;
+            }
+        }
+        if (returnUtility > 0 && returnUtility >= harvestUtility) {
+            // The base tile itself is blocked; head for the neighbouring tile on this side of it
+            order(basePos->x + (pos.x > basePos->x) - (pos.x < basePos->x), basePos->y + (pos.y > basePos->y) - (pos.y < basePos->y));
+        } else if (harvestCell >= 0) {
+            EntityID resource = resourceIn(ecs, grid, influence, harvestCell, pos);
+            if (resource == INVALID_ENTITY) return;
+            const PositionComponent& to = ecs.at<PositionComponent>(resource);
+            worker->targetResource = resource;
+            order(to.x, to.y);
+        }
+    }
+
+    // Scores cells holding resources by what is left nearby, minus enemy threat and distance; a little
+    // noise from the shared RNG keeps idle workers from all piling onto one patch
+    int bestResourceCell(const InfluenceMap& influence, Faction faction, int from, int32_t& utility) {
+        int best = -1;
+        utility = 0;
+        auto consider = [&](int cell) {
+            if (influence.raw[InfluenceMap::RESOURCES][cell] <= 0) return;
+            int32_t score = influence.at(InfluenceMap::RESOURCES, cell) - 2 * influence.enemyThreat(faction, cell) -
+                            AI_DISTANCE_PENALTY * influence.distance(from, cell) + static_cast<int32_t>(rng.below(32));
+            if (score > utility) {
+                utility = score;
+                best = cell;
+            }
+        };
+        int cx = from % influence.cols, cy = from / influence.cols;
+        for (int y = std::max(0, cy - AI_HARVEST_SEARCH_CELLS); y <= std::min(influence.rows - 1, cy + AI_HARVEST_SEARCH_CELLS); y++) {
+            for (int x = std::max(0, cx - AI_HARVEST_SEARCH_CELLS); x <= std::min(influence.cols - 1, cx + AI_HARVEST_SEARCH_CELLS); x++) {
+                consider(y * influence.cols + x);
+            }
+        }
+        if (best < 0) {
+            // Nothing close: fall back to every cell, which only idle workers far from all minerals pay for
+            for (int cell = 0; cell < influence.cols * influence.rows; cell++) consider(cell);
+        }
+        return best;
+    }
+
+    EntityID resourceIn(const ECS& ecs, const SpatialGrid& grid, const InfluenceMap& influence, int cell, const PositionComponent& from) {
+        int minX = cell % influence.cols * INFLUENCE_CELL_SIZE, minY = cell / influence.cols * INFLUENCE_CELL_SIZE;
+        nearby.clear();
+        grid.queryRect(minX, minY, minX + INFLUENCE_CELL_SIZE - 1, minY + INFLUENCE_CELL_SIZE - 1, nearby);
+        EntityID best = INVALID_ENTITY;
+        int bestDistance = INT32_MAX;
+        for (auto other : nearby) {
+            const HealthComponent* health = ecs.get<HealthComponent>(other);
+            if (!health || health->health <= 0 || ecs.has<WorkerComponent>(other) || ecs.has<BuildingComponent>(other)) continue;
+            const PositionComponent& pos = ecs.at<PositionComponent>(other);
+            int distance = abs(pos.x - from.x) + abs(pos.y - from.y);
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = other;
+            }
+        }
+        return best;
+    }
+};
+
+// Fog of War: per faction, how many sight circles cover each tile, plus a bitset of the tiles where that count
+// is nonzero. A viewer's circle is only subtracted and re-added when it changes tile, appears or dies, so a
+// tick where little moves costs one pass over the viewers. Resources give no sight.
+class VisibilityMap {
+public:
+    int width, height;
+    size_t tilesFlipped = 0; // Tiles that became visible or hidden, over all ticks
+
+    VisibilityMap(int mapWidth, int mapHeight) : width(mapWidth), height(mapHeight) {
+        for (int faction = 0; faction < FACTION_COUNT; faction++) {
+            coverage[faction].assign(static_cast<size_t>(width) * height, 0);
+            visible[faction].assign((static_cast<size_t>(width) * height + 63) / 64, 0);
+        }
+        for (int radius : {SIGHT_RADIUS_UNIT, SIGHT_RADIUS_BUILDING}) {
+            if (spans.size() <= static_cast<size_t>(radius)) spans.resize(radius + 1);
+            for (int dy = -radius; dy <= radius; dy++) spans[radius].push_back(static_cast<int>(std::sqrt(radius * radius - dy * dy)));
+        }
+    }
+
+    void update(const ECS& ecs) {
+        frame++;
+        ecs.each<PositionComponent, Faction, MovementComponent>([&](EntityID id, const PositionComponent& pos, const Faction& faction,
+                                                                   const MovementComponent&) {
+            track(id, faction, pos.x, pos.y, SIGHT_RADIUS_UNIT);
+        });
+        ecs.each<PositionComponent, Faction, BuildingComponent>([&](EntityID id, const PositionComponent& pos, const Faction& faction,
+                                                                   const BuildingComponent&) {
+            track(id, faction, pos.x, pos.y, SIGHT_RADIUS_BUILDING);
+        });
+        // Viewers not visited this frame were destroyed
+        for (auto& viewer : viewers) {
+            if (viewer.radius > 0 && viewer.seenFrame != frame) {
+                stamp(viewer, false);
+                viewer.radius = 0;
+            }
+        }
+    }
+
+    bool isVisible(Faction faction, int x, int y) const {
+        if (x < 0 || y < 0 || x >= width || y >= height) return false;
+        size_t tile = static_cast<size_t>(y) * width + x;
+        return visible[faction][tile >> 6] >> (tile & 63) & 1;
+    }
+
+private:
+    struct Viewer { EntityID id = INVALID_ENTITY; int x = 0, y = 0, radius = 0; Faction faction = TERRAN; uint32_t seenFrame = 0; };
+    std::vector<uint16_t> coverage[FACTION_COUNT]; // Circles covering each tile
+    std::vector<uint64_t> visible[FACTION_COUNT];  // Bit per tile: coverage > 0
+    std::vector<std::vector<int>> spans;           // [radius][dy + radius]: half width of the circle's row
+    std::vector<Viewer> viewers;                   // Indexed by entityIndex(id)
+    uint32_t frame = 0;
+
+    void track(EntityID id, Faction faction, int x, int y, int radius) {
+        uint32_t index = entityIndex(id);
+        if (index >= viewers.size()) viewers.resize(index + 1);
+        Viewer& viewer = viewers[index];
+        viewer.seenFrame = frame;
+        if (viewer.id == id && viewer.radius == radius && viewer.x == x && viewer.y == y) return;
+        if (viewer.radius > 0) stamp(viewer, false); // Moved, or the slot was reused
+        viewer = {id, x, y, radius, faction, frame};
+        stamp(viewer, true);
+    }
+
+    void stamp(const Viewer& viewer, bool add) {
+        uint16_t* counts = coverage[viewer.faction].data();
+        uint64_t* bits = visible[viewer.faction].data();
+        const std::vector<int>& rows = spans[viewer.radius];
+        for (int dy = -viewer.radius; dy <= viewer.radius; dy++) {
+            int y = viewer.y + dy;
+            if (y < 0 || y >= height) continue;
+            int halfWidth = rows[dy + viewer.radius];
+            size_t rowStart = static_cast<size_t>(y) * width;
+            for (int x = std::max(0, viewer.x - halfWidth); x <= std::min(width - 1, viewer.x + halfWidth); x++) {
+                size_t tile = rowStart + x;
+                if (add ? counts[tile]++ == 0 : --counts[tile] == 0) {
+                    bits[tile >> 6] ^= 1ull << (tile & 63);
+                    tilesFlipped++;
+                }
+            }
+        }
+    }
+};
+
+// Combat: every attacker off cooldown finds the weakest enemy fighter in range and writes it into its own
+// slot of a flat buffer; the damage is applied in one pass afterwards. Fighters are binned each tick into a
+// fine grid (counting sort into one array), so acquisition scans a few small cells with no ECS lookups.
+// An attacker's ordered focus wins whenever it is in range; otherwise targets are picked against health as it
+// stood before this tick's damage and ties go to the lower entity id, and subtraction commutes, so results do
+// not depend on iteration order or on how acquisition is split across the worker pool.
+class CombatSystem {
+public:
+    struct Engagement { EntityID attacker; int x, y, range, damage; Faction faction; EntityID focus, target; };
+    std::vector<Engagement> engagements;
+    size_t hits = 0;
+    unsigned threads;
+
+    CombatSystem(int mapWidth, int mapHeight, unsigned threadCount = 0)
+        : threads(threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency())) {
+        cols = (mapWidth + COMBAT_CELL_SIZE - 1) / COMBAT_CELL_SIZE;
+        rows = (mapHeight + COMBAT_CELL_SIZE - 1) / COMBAT_CELL_SIZE;
+        cellStart.resize(cols * rows + 1);
+        for (unsigned i = 1; i < threads; i++) workers.emplace_back(&CombatSystem::workerLoop, this);
+    }
+
+    ~CombatSystem() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    void update(ECS& ecs, uint32_t tick) {
+        engagements.clear();
+        fighters.clear();
+        ecs.each<PositionComponent, AttackComponent, Faction, HealthComponent>([&](EntityID id, PositionComponent& pos, AttackComponent& attack,
+                                                                                   Faction& faction, HealthComponent& health) {
+            if (health.health <= 0) return;
+            fighters.push_back({id, pos.x, pos.y, health.health, faction});
+            if (tick >= attack.readyTick) engagements.push_back({id, pos.x, pos.y, attack.range, attack.damage, faction, attack.focus, INVALID_ENTITY});
+        });
+        binFighters();
+
+        // Acquisition only reads the bins and writes disjoint slots, so large fights split across the workers;
+        // this thread takes the first chunk
+        size_t chunks = std::min({static_cast<size_t>(threads), workers.size() + 1, engagements.size() / COMBAT_PARALLEL_MIN + 1});
+        if (chunks == 1) {
+            acquire(0, engagements.size());
+        } else {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                chunkSize = (engagements.size() + chunks - 1) / chunks;
+                chunkCount = chunks;
+                nextChunk = 1;
+                chunksLeft = chunks - 1;
+            }
+            wake.notify_all();
+            acquire(0, chunkSize);
+            std::unique_lock<std::mutex> lock(mutex);
+            idle.wait(lock, [&] { return chunksLeft == 0; });
+        }
+
+        for (const auto& engagement : engagements) {
+            if (engagement.target == INVALID_ENTITY) continue;
+            ecs.at<HealthComponent>(engagement.target).health -= engagement.damage;
+            ecs.at<AttackComponent>(engagement.attacker).readyTick = tick + COMBAT_COOLDOWN_TICKS;
+            hits++;
+        }
+    }
+
+private:
+    struct Fighter { EntityID id; int x, y, health; Faction faction; };
+    int cols, rows;
+    std::vector<Fighter> fighters, binned; // binned is fighters ordered by cell
+    std::vector<uint32_t> cellStart;       // binned[cellStart[c] .. cellStart[c + 1]) lie in cell c
+    std::vector<uint32_t> cellFill;        // Next free slot per cell while binning
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::vector<std::thread> workers;
+    size_t chunkSize = 0, chunkCount = 0, nextChunk = 0, chunksLeft = 0;
+    bool stopping = false;
+
+    void workerLoop() {
+        for (;;) {
+            size_t chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || nextChunk < chunkCount; });
+                if (stopping) return;
+                chunk = nextChunk++;
+            }
+            acquire(chunk * chunkSize, std::min(engagements.size(), (chunk + 1) * chunkSize));
+            bool last;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                last = --chunksLeft == 0;
+            }
+            if (last) idle.notify_one();
+        }
+    }
+
+    int cellOf(int x, int y) const {
+        return std::clamp(y / COMBAT_CELL_SIZE, 0, rows - 1) * cols + std::clamp(x / COMBAT_CELL_SIZE, 0, cols - 1);
+    }
+
+    void binFighters() {
+        std::fill(cellStart.begin(), cellStart.end(), 0);
+        for (const auto& fighter : fighters) cellStart[cellOf(fighter.x, fighter.y) + 1]++;
+        for (size_t cell = 1; cell < cellStart.size(); cell++) cellStart[cell] += cellStart[cell - 1];
+        binned.resize(fighters.size());
+        cellFill.assign(cellStart.begin(), cellStart.end() - 1);
+        for (const auto& fighter : fighters) binned[cellFill[cellOf(fighter.x, fighter.y)]++] = fighter;
+    }
+
+    void acquire(size_t begin, size_t end) {
+        PROFILE_ZONE("combat acquire");
+        for (size_t i = begin; i < end; i++) {
+            Engagement& engagement = engagements[i];
+            int targetHealth = INT32_MAX;
+            int cx0 = std::max(0, (engagement.x - engagement.range) / COMBAT_CELL_SIZE);
+            int cx1 = std::min(cols - 1, (engagement.x + engagement.range) / COMBAT_CELL_SIZE);
+            int cy0 = std::max(0, (engagement.y - engagement.range) / COMBAT_CELL_SIZE);
+            int cy1 = std::min(rows - 1, (engagement.y + engagement.range) / COMBAT_CELL_SIZE);
+            for (int cy = cy0; cy <= cy1; cy++) {
+                for (int cx = cx0; cx <= cx1; cx++) {
+                    for (uint32_t k = cellStart[cy * cols + cx]; k < cellStart[cy * cols + cx + 1]; k++) {
+                        const Fighter& other = binned[k];
+                        if (other.faction == engagement.faction || abs(other.x - engagement.x) + abs(other.y - engagement.y) > engagement.range) continue;
+                        if (other.id == engagement.focus) {
+                            engagement.target = other.id;
+                            targetHealth = INT32_MIN; // Nothing displaces it
+                        } else if (other.health < targetHealth || (other.health == targetHealth && other.id < engagement.target)) {
+                            engagement.target = other.id;
+                            targetHealth = other.health;
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+
+// Faction Census: per faction, how many entities carry each component (UNIT counting trained units), adjusted
+// wherever the simulation creates or destroys an entity, so a tech check is a few array reads
+class FactionCensus {
+public:
+    void add(const ECS& ecs, EntityID id) { change(ecs, id, 1); }
+    void remove(const ECS& ecs, EntityID id) { change(ecs, id, -1); }
+
+    int count(Faction faction, ComponentType type) const { return counts[faction][type]; }
+
+    bool meets(Faction faction, const std::vector<ComponentType>& required) const {
+        for (ComponentType type : required) {
+            if (counts[faction][type] <= 0) return false;
+        }
+        return true;
+    }
+
+    // Full recount, for worlds that did not grow through the simulation (a loaded save)
+    void rebuild(const ECS& ecs) {
+        memset(counts, 0, sizeof(counts));
+        for (const auto& arch : ecs.archetypes) {
+            for (EntityID id : arch.ids) add(ecs, id);
+        }
+    }
+
+private:
+    int32_t counts[FACTION_COUNT][UNIT + 1] = {};
+
+    void change(const ECS& ecs, EntityID id, int32_t delta) {
+        ComponentMask mask = ecs.maskOf(id);
+        if (!(mask & componentBit(FACTION))) return;
+        Faction faction = ecs.at<Faction>(id);
+        for (int type = POSITION; type < UNIT; type++) {
+            if (mask & componentBit(static_cast<ComponentType>(type))) counts[faction][type] += delta;
+        }
+        if (mask == UNIT_ARCHETYPE) counts[faction][UNIT] += delta;
+    }
+};
+
+// Production: each building trains the front unit of its queue until readyTick. Completions sit in a timer wheel
+// of PRODUCTION_WHEEL_SLOTS per-tick slots (later ones wait in their slot for another revolution), and the
+// earliest is cached, so a tick in which nothing completes costs one comparison however many buildings exist.
+// Timers are not withdrawn: one whose building died or whose readyTick moved is dropped when it fires.
+class ProductionSystem {
+public:
+    uint32_t nextCompletion = UINT32_MAX;
+
+    ProductionSystem() : wheel(PRODUCTION_WHEEL_SLOTS) {}
+
+    // Queues a unit; false when the queue is full. The first unit starts training at once
+    bool enqueue(EntityID id, BuildingComponent& building, ComponentType unit, uint32_t tick) {
+        ProductionQueue& queue = building.queue;
+        if (queue.count >= PRODUCTION_QUEUE_SLOTS) return false;
+        queue.units[queue.count++] = unit;
+        if (queue.count == 1) {
+            queue.readyTick = tick + MARINE_BUILD_TICKS;
+            arm(id, queue.readyTick);
+        }
+        return true;
+    }
+
+    // Calls complete(building, unit) for every unit finishing by tick, in the order their timers were armed.
+    // complete may create entities.
+    template <typename F> void update(ECS& ecs, uint32_t tick, F&& complete) {
+        while (nextCompletion <= tick) {
+            uint32_t due = nextCompletion;
+            std::vector<Timer>& slot = wheel[due % PRODUCTION_WHEEL_SLOTS];
+            fired.clear();
+            for (size_t i = 0; i < slot.size();) {
+                if (slot[i].tick != due) {
+                    i++;
+                    continue;
+                }
+                fired.push_back(slot[i].building);
+                slot.erase(slot.begin() + static_cast<std::ptrdiff_t>(i)); // Keeps arming order, which replays rely on
+                armed--;
+            }
+            for (EntityID id : fired) {
+                BuildingComponent* building = ecs.get<BuildingComponent>(id);
+                if (!building || building->queue.count == 0 || building->queue.readyTick != due) continue; // Stale timer
+                ProductionQueue& queue = building->queue;
+                ComponentType unit = queue.units[0];
+                std::copy(queue.units.begin() + 1, queue.units.begin() + queue.count, queue.units.begin());
+                if (--queue.count > 0) {
+                    queue.readyTick = due + MARINE_BUILD_TICKS;
+                    arm(id, queue.readyTick);
+                }
+                complete(id, unit);
+            }
+            findNext(due);
+        }
+    }
+
+    // Re-arms every queue, for worlds that did not grow through the simulation (a loaded save)
+    void rebuild(const ECS& ecs) {
+        for (auto& slot : wheel) slot.clear();
+        armed = 0;
+        nextCompletion = UINT32_MAX;
+        ecs.each<BuildingComponent>([&](EntityID id, const BuildingComponent& building) {
+            if (building.queue.count > 0) arm(id, building.queue.readyTick);
+        });
+    }
+
+private:
+    struct Timer { EntityID building; uint32_t tick; };
+    std::vector<std::vector<Timer>> wheel;
+    std::vector<EntityID> fired;
+    size_t armed = 0;
+
+    void arm(EntityID id, uint32_t tick) {
+        wheel[tick % PRODUCTION_WHEEL_SLOTS].push_back({id, tick});
+        armed++;
+        nextCompletion = std::min(nextCompletion, tick);
+    }
+
+    // Earliest timer after tick: the next revolution's slots first, then (rarely) every timer
+    void findNext(uint32_t tick) {
+        nextCompletion = UINT32_MAX;
+        if (armed == 0) return;
+        for (uint32_t ahead = 1; ahead <= PRODUCTION_WHEEL_SLOTS; ahead++) {
+            for (const Timer& timer : wheel[(tick + ahead) % PRODUCTION_WHEEL_SLOTS]) {
+                if (timer.tick == tick + ahead) {
+                    nextCompletion = timer.tick;
+                    return;
+                }
+            }
+        }
+        for (const auto& slot : wheel) {
+            for (const Timer& timer : slot) nextCompletion = std::min(nextCompletion, timer.tick);
+        }
+    }
+};
+
+// Wall time per system, summed over ticks while enabled; the headless benchmark reports it
+struct SystemTimes {
+    enum System { PATHS, COMMANDS, PRODUCTION, MOVEMENT, HARVEST, COMBAT, DEATHS, GRID, VISION, OBSTACLES, AI, COUNT };
+    static constexpr const char* names[COUNT] = {"paths", "commands", "produce", "movement", "harvest", "combat", "deaths", "grid", "vision", "obstacles", "ai"};
+    bool enabled = false;
+    double seconds[COUNT] = {};
+
+    // Profiler zone of each system, so ticks show up per system in the overlay and traces
+    static uint16_t zone(System system) {
+        static const std::array<uint16_t, COUNT> zones = [] {
+            std::array<uint16_t, COUNT> ids{};
+            for (int i = 0; i < COUNT; i++) ids[i] = profiler().zone(names[i]);
+            return ids;
+        }();
+        return zones[system];
+    }
+};
+
+// Simulation: everything a tick touches, with no SDL video, audio or network, so it also runs headless
+class Simulation {
+public:
+    ECS ecs;
+    int minerals = 50;
+    AIController ai;
+    SpatialGrid spatialGrid;
+    InfluenceMap influence;
+    CombatSystem combat;
+    VisibilityMap visibility;
+    FactionCensus census;
+    ProductionSystem production;
+    PathFinder pathfinder;
+    FlowFieldSystem flowFields;
+    PathRequestService pathRequests;
+    CommandRing commands;             // Executed at the start of the next tick; see queueCommand
+    size_t commandsDropped = 0;       // Commands refused because the ring was full
+    std::vector<Command> executed;    // Commands the latest tick ran, for replay logs
+    uint32_t tick = 0;                // Ticks simulated so far
+    bool deterministic = false;       // Wait for async paths every tick, as lockstep and replays require
+    SDL_Texture* marineTexture = nullptr;
+    SDL_Texture* barracksTexture = nullptr;
+    SystemTimes times;
+    // Initial state, kept so a replay can rebuild the world it started from
+    uint32_t seedValue = 0;
+    int startMinerals = 50;
+    std::vector<EntityConfig> configs;
+
+    Simulation(int width, int height) : spatialGrid(width, height), influence(width, height), combat(width, height), visibility(width, height), pathfinder(width, height), flowFields(pathfinder), 
+                                        pathRequests(width, height) {}
+
+    // The AI's random stream is the only randomness in a tick
+    void seed(uint32_t value) {
+        seedValue = value;
+        ai.rng = SimRandom(static_cast<uint64_t>(value) * 0x9E3779B97F4A7C15ull + 1);
+    }
+
+    // Equal seeds, configs and commands only give equal ticks once path results stop depending on thread timing
+    void setDeterministic(bool on) {
+        deterministic = on;
+        pathRequests.exact = on;
+        ai.budgetMs = on ? 0 : AI_TIME_BUDGET_MS;
+    }
+
+    void setupEntities(const std::vector<EntityConfig>& initial) {
+        configs = initial;
+        startMinerals = minerals;
+        EntityID terranBase = INVALID_ENTITY, zergBase = INVALID_ENTITY;
+        for (const auto& config : configs) {
+            EntityID id = ecs.createEntity(config.isWorker ? WORKER_ARCHETYPE : config.isBuilding ? BUILDING_ARCHETYPE : RESOURCE_ARCHETYPE);
+            ecs.at<PositionComponent>(id) = tilePosition(config.x, config.y);
+            ecs.at<HealthComponent>(id) = {config.health};
+            ecs.at<Faction>(id) = config.faction;
+            ecs.at<RenderComponent>(id) = {nullptr}; // Set in init()
+            if (config.isWorker) {
+                ecs.at<AttackComponent>(id) = {config.faction == PROTOSS ? 8 : 6, 1};
+                if (config.faction == ZERG) ai.aiUnits.push_back(id);
+            } else if (config.isBuilding) {
+                ecs.at<BuildingComponent>(id).produceableUnits = config.produceableUnits;
+                if (config.faction == TERRAN && config.x == 5) terranBase = id;
+                if (config.faction == ZERG && config.x == 15) zergBase = id;
+            }
+            census.add(ecs, id);
+        }
+        ecs.each<WorkerComponent, Faction>([&](EntityID, WorkerComponent& worker, Faction& faction) {
+            worker.base = (faction == TERRAN ? terranBase : zergBase);
+        });
+    }
+
+
+    void spawnMarine(EntityID id, int x, int y) {
+        ecs.at<PositionComponent>(id) = tilePosition(x, y);
+        ecs.at<HealthComponent>(id) = {40};
+        ecs.at<Faction>(id) = TERRAN;
+        ecs.at<RenderComponent>(id) = {marineTexture};
+        ecs.at<AttackComponent>(id) = {6, 1};
+        census.add(ecs, id);
+    }
+
+    // A trained unit steps out on the building's east side (west at the map edge)
+    void completeUnit(EntityID building, ComponentType unit) {
+        if (unit != UNIT) return; // Marines are the only trainable unit so far
+        const PositionComponent& pos = ecs.at<PositionComponent>(building);
+        int x = pathfinder.inBounds(pos.x + 1, pos.y) ? pos.x + 1 : pos.x - 1;
+        spawnMarine(ecs.createEntity(UNIT_ARCHETYPE), x, pos.y);
+    }
+
+    // Building changes invalidate flow fields and the snapshot async searches run against
+    void syncObstacles() {
+        if (!pathfinder.syncObstacles(ecs)) return;
+        flowFields.rebuildAll();
+        pathRequests.publishObstacles(pathfinder.blocked);
+    }
+
+    EntityID findResourceAt(int x, int y) const {
+        return ecs.findEntity<PositionComponent>(
+            [&](EntityID, const PositionComponent& pos) { return pos.x == x && pos.y == y; }, NON_RESOURCE_MASK);
+    }
+
+    // Includes buildings placed this tick, which the obstacle bitmap only learns about at the end of it
+    EntityID buildingAt(int x, int y) const {
+        return ecs.findEntity<PositionComponent, BuildingComponent>(
+            [&](EntityID, const PositionComponent& pos, const BuildingComponent&) { return pos.x == x && pos.y == y; });
+    }
+
+
+    // Queues a command for the next tick; false (and counted) when the ring is full
+    bool queueCommand(const Command& cmd) {
+        if (commands.push(cmd)) return true;
+        commandsDropped++;
+        return false;
+    }
+
+    void executeCommand(const Command& cmd) {
+        if (cmd.type == CMD_PRODUCE) {
+            // Paid when queued; the unit is allocated when it completes, so its id never needs sending
+            BuildingComponent* building = ecs.get<BuildingComponent>(cmd.id);
+            ComponentType unit = static_cast<ComponentType>(cmd.produce.unit);
+            if (!building || minerals < MARINE_COST || 
+                std::find(building->produceableUnits.begin(), building->produceableUnits.end(), unit) == building->produceableUnits.end()) return;
+            auto requirements = building->techRequirements.find(unit);
+            if (requirements != building->techRequirements.end() && !census.meets(ecs.at<Faction>(cmd.id), requirements->second)) return;
+            if (production.enqueue(cmd.id, *building, unit, tick)) minerals -= MARINE_COST;
+            return;
+        }
+        MovementComponent* movement = ecs.get<MovementComponent>(cmd.id);
+        if (!movement) return;
+        WorkerComponent* worker = ecs.get<WorkerComponent>(cmd.id);
+        AttackComponent* attack = ecs.get<AttackComponent>(cmd.id);
+        const PositionComponent& pos = ecs.at<PositionComponent>(cmd.id);
+
+        if (cmd.type == CMD_MOVE && pathfinder.inBounds(cmd.move.x, cmd.move.y)) {
+            newOrder(*movement, worker, attack);
+            movement->flowField = flowFields.acquire(cmd.move.x, cmd.move.y);
+        } else if (cmd.type == CMD_GATHER && worker && ecs.has<PositionComponent>(cmd.gather.resource) && 
+                   !(ecs.maskOf(cmd.gather.resource) & NON_RESOURCE_MASK)) {
+            const PositionComponent& resource = ecs.at<PositionComponent>(cmd.gather.resource);
+            newOrder(*movement, worker, attack);
+            worker->targetResource = cmd.gather.resource;
+            movement->flowField = flowFields.acquire(resource.x, resource.y);
+        } else if (cmd.type == CMD_ATTACK && attack && ecs.has<PositionComponent>(cmd.attack.target) && ecs.has<HealthComponent>(cmd.attack.target)) {
+            // Walk to where the target stands now; combat takes over once it is in range
+            const PositionComponent& target = ecs.at<PositionComponent>(cmd.attack.target);
+            newOrder(*movement, worker, attack);
+            attack->focus = cmd.attack.target;
+            movement->flowField = flowFields.acquire(target.x, target.y);
+        } else if (cmd.type == CMD_PATROL && pathfinder.inBounds(cmd.patrol.x, cmd.patrol.y)) {
+            newOrder(*movement, worker, attack);
+            movement->patrolling = true;
+            movement->patrolFrom = {pos.x, pos.y};
+            movement->patrolTo = {cmd.patrol.x, cmd.patrol.y};
+            movement->flowField = flowFields.acquire(cmd.patrol.x, cmd.patrol.y);
+        } else if (cmd.type == CMD_STOP) {
+            newOrder(*movement, worker, attack);
+        } else if (cmd.type == CMD_BUILD && worker && ecs.at<Faction>(cmd.id) == TERRAN && minerals >= BARRACKS_COST && 
+                   pathfinder.inBounds(cmd.build.x, cmd.build.y) && buildingAt(cmd.build.x, cmd.build.y) == INVALID_ENTITY) {
+            // Placed at once; syncObstacles picks it up at the end of the tick like any new building
+            minerals -= BARRACKS_COST;
+            EntityID barracks = ecs.createEntity(BUILDING_ARCHETYPE);
+            ecs.at<PositionComponent>(barracks) = tilePosition(cmd.build.x, cmd.build.y);
+            ecs.at<HealthComponent>(barracks) = {200};
+            ecs.at<Faction>(barracks) = TERRAN;
+            ecs.at<RenderComponent>(barracks) = {barracksTexture};
+            ecs.at<BuildingComponent>(barracks).produceableUnits = {UNIT};
+            census.add(ecs, barracks);
+        }
+    }
+
+    // Drops whatever the unit was doing: path, flow field, patrol, harvest target and attack focus
+    void newOrder(MovementComponent& movement, WorkerComponent* worker, AttackComponent* attack) {
+        std::vector<Point>().swap(movement.path);
+        movement.pathIndex = 0;
+        movement.pathOrder++;
+        movement.flowField = -1;
+        movement.patrolling = false;
+        if (worker) worker->targetResource = INVALID_ENTITY;
+        if (attack) attack->focus = INVALID_ENTITY;
+    }
+
+    // One SIM_TICK_MS simulation step. Only integer state feeds back into it, so equal inputs give equal results
+    void simulate() {
+        PROFILE_ZONE("simulate");
+        bool profiling = profiler().enabled.load(std::memory_order_relaxed);
+        uint64_t clock = times.enabled || profiling ? Profiler::now() : 0;
+        auto lap = [&](SystemTimes::System system) {
+            if (!clock) return;
+            uint64_t now = Profiler::now();
+            if (times.enabled) times.seconds[system] += (now - clock) / 1e9;
+            if (profiling) profiler().record(SystemTimes::zone(system), clock, now);
+            clock = now;
+        };
+
+        pathRequests.applyResults(ecs, deterministic);
+        lap(SystemTimes::PATHS);
+        syncObstacles();
+        lap(SystemTimes::OBSTACLES);
+        executed.clear();
+        Command cmd;
+        while (commands.pop(cmd)) {
+            executed.push_back(cmd);
+            executeCommand(cmd);
+        }
+        lap(SystemTimes::COMMANDS);
+        production.update(ecs, tick, [&](EntityID building, ComponentType unit) { completeUnit(building, unit); });
+        lap(SystemTimes::PRODUCTION);
+
+        moveUnits(SIM_TICK_MS);
+        flowFields.collect();
+        lap(SystemTimes::MOVEMENT);
+        ecs.each<PositionComponent, WorkerComponent, Faction>([&](EntityID, PositionComponent& pos, WorkerComponent& worker, Faction& faction) {
+            if (worker.targetResource != INVALID_ENTITY && !worker.isCarrying) {
+                const PositionComponent* resPos = ecs.get<PositionComponent>(worker.targetResource);
+                HealthComponent* resHealth = ecs.get<HealthComponent>(worker.targetResource);
+                if (resPos && resHealth && pos.x == resPos->x && pos.y == resPos->y && resHealth->health > 0) {
+                    resHealth->health -= 8;
+                    worker.minerals += 8;
+                    worker.isCarrying = true;
+                }
+            } else if (worker.isCarrying) {
+                const PositionComponent* basePos = ecs.get<PositionComponent>(worker.base);
+                if (basePos && abs(pos.x - basePos->x) <= 1 && abs(pos.y - basePos->y) <= 1) { // Buildings block their own tile
+                    if (faction == TERRAN) minerals += worker.minerals; // The AI side keeps no bank
+                    worker.minerals = 0;
+                    worker.isCarrying = false;
+                    worker.targetResource = INVALID_ENTITY;
+                }
+            }
+        });
+        lap(SystemTimes::HARVEST);
+
+        combat.update(ecs, tick);
+        lap(SystemTimes::COMBAT);
+        ecs.each<HealthComponent>([&](EntityID id, HealthComponent& health) {
+            if (health.health > 0) return;
+            census.remove(ecs, id);
+            ecs.queueDestroy(id);
+        });
+        ecs.flushDestroyed();
+        lap(SystemTimes::DEATHS);
+        spatialGrid.update(ecs);
+        lap(SystemTimes::GRID);
+        visibility.update(ecs);
+        lap(SystemTimes::VISION);
+        syncObstacles();
+        lap(SystemTimes::OBSTACLES);
+        influence.update(ecs);
+        ai.update(ecs, spatialGrid, influence, pathRequests, tick);
+        lap(SystemTimes::AI);
+        tick++;
+    }
+
+    // Moves units in fixed-point steps along their flow field or path; a step may cross several tiles
+    void moveUnits(Uint32 elapsedMs) {
+        int32_t stride = static_cast<int32_t>(elapsedMs * FIXED_ONE / MOVE_MS_PER_TILE);
+        ecs.each<PositionComponent, MovementComponent>([&](EntityID, PositionComponent& pos, MovementComponent& movement) {
+            pos.prevFx = pos.fx;
+            pos.prevFy = pos.fy;
+            int32_t budget = stride;
+            while (budget > 0) {
+                Point next;
+                if (movement.flowField >= 0) {
+                    if (!flowFields.nextStep(movement.flowField, pos.x, pos.y, next)) {
+                        movement.flowField = -1; // Arrived, or the goal is unreachable
+                        if (movement.patrolling && pos.x == movement.patrolTo.x && pos.y == movement.patrolTo.y) {
+                            std::swap(movement.patrolFrom, movement.patrolTo);
+                            movement.flowField = flowFields.acquire(movement.patrolTo.x, movement.patrolTo.y);
+                        }
+                        break;
+                    }
+                } else if (movement.pathIndex < movement.path.size()) {
+                    next = movement.path[movement.pathIndex];
+                } else {
+                    break;
+                }
+                int32_t dx = next.x * FIXED_ONE - pos.fx, dy = next.y * FIXED_ONE - pos.fy;
+                int32_t distance = std::max(std::abs(dx), std::abs(dy));
+                if (distance > budget) {
+                    pos.fx += std::clamp(dx, -budget, budget);
+                    pos.fy += std::clamp(dy, -budget, budget);
+                    break;
+                }
+                budget -= distance;
+                pos.x = next.x;
+                pos.y = next.y;
+                pos.fx = next.x * FIXED_ONE;
+                pos.fy = next.y * FIXED_ONE;
+                if (movement.flowField < 0 && ++movement.pathIndex >= movement.path.size()) {
+                    movement.path.clear();
+                    movement.pathIndex = 0;
+                }
+            }
+        });
+    }
+
+    // Hash of all simulation state in slot order; lockstep peers compare it to detect desyncs
+    uint64_t stateChecksum() const {
+        uint64_t hash = 1469598103934665603ull;
+        auto mix = [&](uint64_t value) { hash = (hash ^ value) * 1099511628211ull; };
+        for (uint32_t index = 0; index < ecs.records.size(); index++) {
+            const ECS::EntityRecord& record = ecs.records[index];
+            if (!record.alive) continue;
+            const Archetype& arch = ecs.archetypes[record.archetype];
+            mix(arch.ids[record.row]);
+            mix(arch.mask);
+            if (arch.mask & componentBit(POSITION)) {
+                const PositionComponent& pos = arch.positions[record.row];
+                mix(static_cast<uint32_t>(pos.fx));
+                mix(static_cast<uint32_t>(pos.fy));
+            }
+            if (arch.mask & componentBit(HEALTH)) mix(static_cast<uint32_t>(arch.healths[record.row].health));
+            if (arch.mask & componentBit(ATTACK)) {
+                mix(arch.attacks[record.row].readyTick);
+                mix(arch.attacks[record.row].focus);
+            }
+            if (arch.mask & componentBit(WORKER)) {
+                const WorkerComponent& worker = arch.workers[record.row];
+                mix(worker.targetResource);
+                mix(static_cast<uint32_t>(worker.minerals) << 1 | worker.isCarrying);
+            }
+            if (arch.mask & componentBit(BUILDING)) {
+                const ProductionQueue& queue = arch.buildings[record.row].queue;
+                mix(queue.count ? static_cast<uint64_t>(queue.readyTick) << 8 | queue.count : 0);
+            }
+        }
+        mix(static_cast<uint32_t>(minerals));
+        mix(ai.rng.state);
+        return hash;
+    }
+
+};
+
+// Save Games: a versioned binary image of the simulation in which every component column of every archetype is one
+// contiguous block, copied straight from and back into the ECS arrays. Saving is a handful of large copies and
+// writes and loading is one read plus one copy per column, never a per-entity parse. Blocks start on
+// SAVE_CHUNK_BYTES boundaries and leave room to grow, so an autosave to the same file rewrites in place only the
+// chunks that differ from the previous save. Live flow fields are saved too, as they cost far more to rebuild than
+// to read. Files are native-endian, meant for the build that wrote them; block element sizes are checked on load.
+// Textures are not saved (the game assigns them again) and neither are path searches still in flight, whose units
+// simply get ordered again.
+const uint32_t SAVE_MAGIC = 0x56534353; // "SCSV"
+const uint32_t SAVE_VERSION = 2; // 2: production queues and tech requirements
+
+enum SaveBlockKind : uint32_t {
+    SAVE_GLOBALS, SAVE_RECORDS, SAVE_FREE_SLOTS, SAVE_AI_UNITS, SAVE_AI_ORDER_TICKS, // Once per file, in this order
+    SAVE_FLOW_FIELDS, SAVE_FLOW_DIRECTIONS,
+    SAVE_IDS, SAVE_POSITIONS, SAVE_HEALTHS, SAVE_MOVEMENTS, SAVE_PATH_POINTS,        // Then per archetype: its ids,
+    SAVE_WORKERS, SAVE_ATTACKS, SAVE_BUILDINGS, SAVE_PRODUCEABLE, SAVE_FACTIONS,      // then the columns it stores
+    SAVE_PRODUCTION, SAVE_TECH,
+    SAVE_BLOCK_KINDS
+};
+const size_t SAVE_PRELUDE_BLOCKS = SAVE_IDS;
+
+struct SaveHeader { uint32_t magic, version; int32_t width, height; uint32_t blockCount, reserved; };
+struct SaveBlock { uint32_t kind; ComponentMask mask; uint64_t count, offset, capacity; }; // capacity in bytes
+struct SavedGlobals { uint32_t tick, seedValue; int32_t minerals, startMinerals; uint64_t aiRng, aiCursor; uint32_t flowTick, reserved; };
+// One per flow field slot; active ones have a direction byte per tile, in slot order, in SAVE_FLOW_DIRECTIONS
+struct SavedFlowField { uint32_t goal, lastUsed, active; };
+// MovementComponent without its path, which goes to SAVE_PATH_POINTS
+struct SavedMovement { uint32_t pathIndex, pathLength, pathOrder; int32_t flowField; Point patrolFrom, patrolTo; uint32_t patrolling; };
+// Buildings are saved as their produceable unit count, with the units themselves one byte each in SAVE_PRODUCEABLE,
+// their ProductionQueue as is, and each tech requirement as a separate entry
+struct SavedTech { uint32_t row; uint8_t unit, requirement; uint16_t reserved; };
+
+const size_t SAVE_ELEMENT_BYTES[SAVE_BLOCK_KINDS] = {
+    sizeof(SavedGlobals), sizeof(ECS::EntityRecord), sizeof(uint32_t), sizeof(EntityID), sizeof(uint32_t),
+    sizeof(SavedFlowField), sizeof(uint8_t), sizeof(EntityID), sizeof(PositionComponent), sizeof(HealthComponent), sizeof(SavedMovement), sizeof(Point),
+    sizeof(WorkerComponent), sizeof(AttackComponent), sizeof(uint32_t), sizeof(uint8_t), sizeof(Faction),
+    sizeof(ProductionQueue), sizeof(SavedTech)
+};
+static_assert(std::is_trivially_copyable_v<ECS::EntityRecord> && std::is_trivially_copyable_v<PositionComponent> &&
+              std::is_trivially_copyable_v<HealthComponent> && std::is_trivially_copyable_v<WorkerComponent> &&
+              std::is_trivially_copyable_v<AttackComponent> && std::is_trivially_copyable_v<ProductionQueue>, "Saved columns are copied as raw bytes");
+
+// Blocks an archetype writes after SAVE_IDS, in file order
+std::vector<SaveBlockKind> savedColumns(ComponentMask mask) {
+    std::vector<SaveBlockKind> kinds;
+    if (mask & componentBit(POSITION)) kinds.push_back(SAVE_POSITIONS);
+    if (mask & componentBit(HEALTH)) kinds.push_back(SAVE_HEALTHS);
+    if (mask & componentBit(MOVEMENT)) {
+        kinds.push_back(SAVE_MOVEMENTS);
+        kinds.push_back(SAVE_PATH_POINTS);
+    }
+    if (mask & componentBit(WORKER)) kinds.push_back(SAVE_WORKERS);
+    if (mask & componentBit(ATTACK)) kinds.push_back(SAVE_ATTACKS);
+    if (mask & componentBit(BUILDING)) {
+        kinds.push_back(SAVE_BUILDINGS);
+        kinds.push_back(SAVE_PRODUCEABLE);
+        kinds.push_back(SAVE_PRODUCTION);
+        kinds.push_back(SAVE_TECH);
+    }
+    if (mask & componentBit(FACTION)) kinds.push_back(SAVE_FACTIONS);
+    return kinds;
+}
+
+inline size_t roundToChunk(size_t bytes) { return (bytes + SAVE_CHUNK_BYTES - 1) / SAVE_CHUNK_BYTES * SAVE_CHUNK_BYTES; }
+
+class SaveWriter {
+public:
+    size_t bytesWritten = 0; // File bytes the latest save wrote
+    bool wroteAll = false;   // Whether it had to write the whole file
+
+    // Lays the file out afresh and replaces path with it through a temporary file
+    bool save(const Simulation& sim, const std::string& path) { return write(sim, path, false); }
+
+    // Like save, except that when the last save went to the same path and every block still fits its old place,
+    // only the chunks that differ from that save are rewritten
+    bool autosave(const Simulation& sim, const std::string& path) { return write(sim, path, true); }
+
+private:
+    struct PendingBlock { SaveBlock block; const Archetype* arch; };
+    std::vector<PendingBlock> pending;
+    std::vector<SaveBlock> layout; // Blocks of the last save, with their offsets and capacities
+    std::vector<uint8_t> image, previous;
+    std::string previousPath;
+
+    bool write(const Simulation& sim, const std::string& path, bool incremental) {
+        collect(sim);
+        size_t tableBytes = sizeof(SaveHeader) + pending.size() * sizeof(SaveBlock);
+        bool reuse = incremental && path == previousPath && layout.size() == pending.size();
+        for (size_t i = 0; reuse && i < pending.size(); i++) {
+            const SaveBlock& block = pending[i].block;
+            reuse = layout[i].kind == block.kind && layout[i].mask == block.mask && 
+                    block.count * SAVE_ELEMENT_BYTES[block.kind] <= layout[i].capacity;
+        }
+        size_t offset = roundToChunk(tableBytes);
+        for (size_t i = 0; i < pending.size(); i++) {
+            SaveBlock& block = pending[i].block;
+            size_t bytes = block.count * SAVE_ELEMENT_BYTES[block.kind];
+            block.offset = reuse ? layout[i].offset : offset;
+            block.capacity = reuse ? layout[i].capacity : roundToChunk(std::max<size_t>(bytes + bytes / 4, 1)); // A quarter to grow into
+            offset = block.offset + block.capacity;
+        }
+
+        image.resize(offset);
+        SaveHeader header{SAVE_MAGIC, SAVE_VERSION, sim.pathfinder.width, sim.pathfinder.height, static_cast<uint32_t>(pending.size()), 0};
+        memcpy(image.data(), &header, sizeof(header));
+        memset(image.data() + sizeof(header), 0, roundToChunk(tableBytes) - sizeof(header));
+        layout.clear();
+        for (size_t i = 0; i < pending.size(); i++) {
+            const SaveBlock& block = pending[i].block;
+            memcpy(image.data() + sizeof(header) + i * sizeof(SaveBlock), &block, sizeof(SaveBlock));
+            size_t bytes = block.count * SAVE_ELEMENT_BYTES[block.kind];
+            fill(sim, pending[i], image.data() + block.offset);
+            memset(image.data() + block.offset + bytes, 0, block.capacity - bytes);
+            layout.push_back(block);
+        }
+
+        bool ok = reuse && previous.size() == image.size() ? writeChanged(path) : writeAll(path);
+        previousPath = ok ? path : std::string();
+        image.swap(previous);
+        return ok;
+    }
+
+    void collect(const Simulation& sim) {
+        pending.clear();
+        auto add = [&](SaveBlockKind kind, size_t count, const Archetype* arch = nullptr) { 
+            pending.push_back({{kind, arch ? arch->mask : 0, count, 0, 0}, arch}); 
+        };
+        add(SAVE_GLOBALS, 1);
+        add(SAVE_RECORDS, sim.ecs.records.size());
+        add(SAVE_FREE_SLOTS, sim.ecs.freeIndices.size());
+        add(SAVE_AI_UNITS, sim.ai.aiUnits.size());
+        add(SAVE_AI_ORDER_TICKS, sim.ai.nextOrder.size());
+        add(SAVE_FLOW_FIELDS, sim.flowFields.fields.size());
+        size_t directions = 0;
+        for (const auto& field : sim.flowFields.fields) directions += field.active ? field.direction.size() : 0;
+        add(SAVE_FLOW_DIRECTIONS, directions);
+        for (const auto& arch : sim.ecs.archetypes) {
+            add(SAVE_IDS, arch.ids.size(), &arch);
+            for (SaveBlockKind kind : savedColumns(arch.mask)) {
+                size_t count = arch.ids.size();
+                if (kind == SAVE_PATH_POINTS) {
+                    count = 0;
+                    for (const auto& movement : arch.movements) count += movement.path.size();
+                } else if (kind == SAVE_PRODUCEABLE) {
+                    count = 0;
+                    for (const auto& building : arch.buildings) count += building.produceableUnits.size();
+                } else if (kind == SAVE_TECH) {
+                    count = 0;
+                    for (const auto& building : arch.buildings) {
+                        for (const auto& [unit, required] : building.techRequirements) count += required.size();
+                    }
+                }
+                add(kind, count, &arch);
+            }
+        }
+    }
+
+    template <typename T> static void copyColumn(const std::vector<T>& column, uint8_t* out) {
+        if (!column.empty()) memcpy(out, column.data(), column.size() * sizeof(T));
+    }
+
+    void fill(const Simulation& sim, const PendingBlock& entry, uint8_t* out) {
+        const Archetype* arch = entry.arch;
+        SaveBlockKind kind = static_cast<SaveBlockKind>(entry.block.kind);
+        if (kind == SAVE_GLOBALS) {
+            SavedGlobals globals{sim.tick, sim.seedValue, sim.minerals, sim.startMinerals, sim.ai.rng.state, sim.ai.cursor, sim.flowFields.tick, 0};
+            memcpy(out, &globals, sizeof(globals));
+        } else if (kind == SAVE_RECORDS) {
+            copyColumn(sim.ecs.records, out);
+        } else if (kind == SAVE_FREE_SLOTS) {
+            copyColumn(sim.ecs.freeIndices, out);
+        } else if (kind == SAVE_AI_UNITS) {
+            copyColumn(sim.ai.aiUnits, out);
+        } else if (kind == SAVE_AI_ORDER_TICKS) {
+            copyColumn(sim.ai.nextOrder, out);
+        } else if (kind == SAVE_FLOW_FIELDS) {
+            for (const auto& field : sim.flowFields.fields) {
+                SavedFlowField saved{field.goal, field.lastUsed, field.active};
+                memcpy(out, &saved, sizeof(saved));
+                out += sizeof(saved);
+            }
+        } else if (kind == SAVE_FLOW_DIRECTIONS) {
+            for (const auto& field : sim.flowFields.fields) {
+                if (!field.active) continue;
+                copyColumn(field.direction, out);
+                out += field.direction.size();
+            }
+        } else if (kind == SAVE_IDS) {
+            copyColumn(arch->ids, out);
+        } else if (kind == SAVE_POSITIONS) {
+            copyColumn(arch->positions, out);
+        } else if (kind == SAVE_HEALTHS) {
+            copyColumn(arch->healths, out);
+        } else if (kind == SAVE_WORKERS) {
+            copyColumn(arch->workers, out);
+        } else if (kind == SAVE_ATTACKS) {
+            copyColumn(arch->attacks, out);
+        } else if (kind == SAVE_FACTIONS) {
+            copyColumn(arch->factions, out);
+        } else if (kind == SAVE_MOVEMENTS) {
+            for (const auto& movement : arch->movements) {
+                SavedMovement saved{static_cast<uint32_t>(movement.pathIndex), static_cast<uint32_t>(movement.path.size()), movement.pathOrder,
+                                    movement.flowField,
+                                    movement.patrolFrom, movement.patrolTo, movement.patrolling};
+                memcpy(out, &saved, sizeof(saved));
+                out += sizeof(saved);
+            }
+        } else if (kind == SAVE_PATH_POINTS) {
+            for (const auto& movement : arch->movements) {
+                copyColumn(movement.path, out);
+                out += movement.path.size() * sizeof(Point);
+            }
+        } else if (kind == SAVE_BUILDINGS) {
+            for (const auto& building : arch->buildings) {
+                uint32_t count = static_cast<uint32_t>(building.produceableUnits.size());
+                memcpy(out, &count, sizeof(count));
+                out += sizeof(count);
+            }
+        } else if (kind == SAVE_PRODUCEABLE) {
+            for (const auto& building : arch->buildings) {
+                for (ComponentType type : building.produceableUnits) *out++ = static_cast<uint8_t>(type);
+            }
+        } else if (kind == SAVE_PRODUCTION) {
+            for (const auto& building : arch->buildings) {
+                memcpy(out, &building.queue, sizeof(ProductionQueue));
+                out += sizeof(ProductionQueue);
+            }
+        } else if (kind == SAVE_TECH) {
+            for (size_t row = 0; row < arch->buildings.size(); row++) {
+                for (const auto& [unit, required] : arch->buildings[row].techRequirements) {
+                    for (ComponentType type : required) {
+                        SavedTech saved{static_cast<uint32_t>(row), static_cast<uint8_t>(unit), static_cast<uint8_t>(type), 0};
+                        memcpy(out, &saved, sizeof(saved));
+                        out += sizeof(saved);
+                    }
+                }
+            }
+        }
+    }
+
+    // Written beside the target and renamed over it, so a failed save never leaves half a file behind
+    bool writeAll(const std::string& path) {
+        std::string temporary = path + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()));
+            if (!file.good()) return false;
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(path.c_str()); // Windows will not rename over an existing file
+            if (std::rename(temporary.c_str(), path.c_str()) != 0) return false;
+        }
+        bytesWritten = image.size();
+        wroteAll = true;
+        return true;
+    }
+
+    // Runs of chunks that differ from the previous image, each written with one seek and one write
+    bool writeChanged(const std::string& path) {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        if (!file) return writeAll(path);
+        bytesWritten = 0;
+        size_t chunks = image.size() / SAVE_CHUNK_BYTES;
+        for (size_t chunk = 0; chunk < chunks;) {
+            auto differs = [&](size_t c) { return memcmp(image.data() + c * SAVE_CHUNK_BYTES, previous.data() + c * SAVE_CHUNK_BYTES, SAVE_CHUNK_BYTES) != 0; };
+            if (!differs(chunk)) {
+                chunk++;
+                continue;
+            }
+            size_t end = chunk + 1;
+            while (end < chunks && differs(end)) end++;
+            file.seekp(static_cast<std::streamoff>(chunk * SAVE_CHUNK_BYTES));
+            file.write(reinterpret_cast<const char*>(image.data() + chunk * SAVE_CHUNK_BYTES), static_cast<std::streamsize>((end - chunk) * SAVE_CHUNK_BYTES));
+            bytesWritten += (end - chunk) * SAVE_CHUNK_BYTES;
+            chunk = end;
+        }
+        file.flush();
+        wroteAll = false;
+        return file.good();
+    }
+};
+
+// Reads a save in one go and checks it block by block, so restore() can copy columns without further checks
+class SaveReader {
+public:
+    int width = 0, height = 0;
+    uint32_t seed = 0;
+    std::string error;
+
+    bool open(const std::string& path) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) return fail("cannot open " + path);
+        data.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+        if (!file) return fail("cannot read " + path);
+        return validate();
+    }
+
+    // Fills a freshly constructed Simulation of width x height
+    void restore(Simulation& sim) const {
+        SavedGlobals globals = element<SavedGlobals>(blocks[0], 0);
+        sim.tick = globals.tick;
+        sim.seedValue = globals.seedValue;
+        sim.minerals = globals.minerals;
+        sim.startMinerals = globals.startMinerals;
+        sim.ai.rng.state = globals.aiRng;
+        sim.ai.cursor = static_cast<size_t>(globals.aiCursor);
+        ECS& ecs = sim.ecs;
+        copyBlock(blocks[1], ecs.records);
+        copyBlock(blocks[2], ecs.freeIndices);
+        copyBlock(blocks[3], sim.ai.aiUnits);
+        copyBlock(blocks[4], sim.ai.nextOrder);
+
+        const SaveBlock* movements = nullptr;
+        const SaveBlock* buildings = nullptr;
+        for (size_t i = SAVE_PRELUDE_BLOCKS; i < blocks.size(); i++) {
+            const SaveBlock& block = blocks[i];
+            if (block.kind == SAVE_IDS) {
+                ecs.archetypeLookup[block.mask] = static_cast<uint32_t>(ecs.archetypes.size());
+                ecs.archetypes.emplace_back();
+                ecs.archetypes.back().mask = block.mask;
+                ecs.archetypes.back().version = 1; // Nonzero, so the first obstacle sync sees restored buildings
+                copyBlock(block, ecs.archetypes.back().ids);
+                if (block.mask & componentBit(RENDER)) ecs.archetypes.back().renders.assign(block.count, RenderComponent{nullptr});
+                ecs.entityCount += block.count;
+                continue;
+            }
+            Archetype& arch = ecs.archetypes.back();
+            if (block.kind == SAVE_POSITIONS) copyBlock(block, arch.positions);
+            else if (block.kind == SAVE_HEALTHS) copyBlock(block, arch.healths);
+            else if (block.kind == SAVE_WORKERS) copyBlock(block, arch.workers);
+            else if (block.kind == SAVE_ATTACKS) copyBlock(block, arch.attacks);
+            else if (block.kind == SAVE_FACTIONS) copyBlock(block, arch.factions);
+            else if (block.kind == SAVE_MOVEMENTS) movements = &block;
+            else if (block.kind == SAVE_BUILDINGS) buildings = &block;
+            else if (block.kind == SAVE_PATH_POINTS) {
+                arch.movements.resize(movements->count);
+                uint64_t point = 0;
+                for (uint64_t row = 0; row < movements->count; row++) {
+                    SavedMovement saved = element<SavedMovement>(*movements, row);
+                    MovementComponent& movement = arch.movements[row];
+                    movement.path.resize(saved.pathLength);
+                    if (saved.pathLength) memcpy(movement.path.data(), data.data() + block.offset + point * sizeof(Point), saved.pathLength * sizeof(Point));
+                    point += saved.pathLength;
+                    movement.pathIndex = saved.pathIndex;
+                    movement.flowField = saved.flowField;
+                    movement.pathOrder = saved.pathOrder;
+                    movement.patrolling = saved.patrolling != 0;
+                    movement.patrolFrom = saved.patrolFrom;
+                    movement.patrolTo = saved.patrolTo;
+                }
+            } else if (block.kind == SAVE_PRODUCEABLE) {
+                arch.buildings.resize(buildings->count);
+                uint64_t unit = 0;
+                for (uint64_t row = 0; row < buildings->count; row++) {
+                    auto& produceable = arch.buildings[row].produceableUnits;
+                    produceable.resize(element<uint32_t>(*buildings, row));
+                    for (auto& type : produceable) type = static_cast<ComponentType>(element<uint8_t>(block, unit++));
+                }
+            } else if (block.kind == SAVE_PRODUCTION) {
+                for (uint64_t row = 0; row < block.count; row++) arch.buildings[row].queue = element<ProductionQueue>(block, row);
+            } else if (block.kind == SAVE_TECH) {
+                for (uint64_t entry = 0; entry < block.count; entry++) {
+                    SavedTech tech = element<SavedTech>(block, entry);
+                    arch.buildings[tech.row].techRequirements[static_cast<ComponentType>(tech.unit)].push_back(static_cast<ComponentType>(tech.requirement));
+                }
+            }
+        }
+        sim.census.rebuild(ecs);
+        sim.production.rebuild(ecs);
+        // Obstacles first: a sync finding new buildings rebuilds every field, and the saved ones are already current
+        sim.syncObstacles();
+        FlowFieldSystem& flow = sim.flowFields;
+        flow.tick = globals.flowTick;
+        flow.fields.resize(blocks[5].count);
+        const size_t tiles = static_cast<size_t>(width) * height;
+        size_t directions = blocks[6].offset;
+        for (size_t index = 0; index < flow.fields.size(); index++) {
+            SavedFlowField saved = element<SavedFlowField>(blocks[5], index);
+            FlowFieldSystem::FlowField& field = flow.fields[index];
+            field.goal = saved.goal;
+            field.lastUsed = saved.lastUsed;
+            field.active = saved.active != 0;
+            if (!field.active) {
+                flow.freeFields.push_back(static_cast<int>(index));
+                continue;
+            }
+            field.direction.assign(data.begin() + directions, data.begin() + directions + tiles);
+            directions += tiles;
+            flow.fieldByGoal[field.goal] = static_cast<int>(index);
+        }
+    }
+
+private:
+    std::vector<uint8_t> data;
+    std::vector<SaveBlock> blocks;
+
+    bool fail(const std::string& message) {
+        error = message;
+        return false;
+    }
+
+    template <typename T> T element(const SaveBlock& block, uint64_t index) const {
+        T value;
+        memcpy(&value, data.data() + block.offset + index * sizeof(T), sizeof(T));
+        return value;
+    }
+
+    bool onMap(const Point& point) const { return point.x >= 0 && point.y >= 0 && point.x < width && point.y < height; }
+
+    template <typename T> void copyBlock(const SaveBlock& block, std::vector<T>& out) const {
+        out.resize(block.count);
+        if (block.count) memcpy(out.data(), data.data() + block.offset, block.count * sizeof(T));
+    }
+
+    bool validate() {
+        SaveHeader header{};
+        if (data.size() < sizeof(header)) return fail("not a save file");
+        memcpy(&header, data.data(), sizeof(header));
+        if (header.magic != SAVE_MAGIC) return fail("not a save file");
+        if (header.version != SAVE_VERSION) return fail("save version " + std::to_string(header.version) + ", expected " + std::to_string(SAVE_VERSION));
+        if (header.width < 1 || header.height < 1 || header.width > MAP_MAX_SIDE || header.height > MAP_MAX_SIDE) return fail("bad map size");
+        if (header.blockCount < SAVE_PRELUDE_BLOCKS || header.blockCount > (data.size() - sizeof(header)) / sizeof(SaveBlock)) return fail("truncated block table");
+        width = header.width;
+        height = header.height;
+        blocks.resize(header.blockCount);
+        memcpy(blocks.data(), data.data() + sizeof(header), blocks.size() * sizeof(SaveBlock));
+        for (const auto& block : blocks) {
+            if (block.kind >= SAVE_BLOCK_KINDS || block.offset > data.size() || block.capacity > data.size() - block.offset ||
+                block.count > block.capacity / SAVE_ELEMENT_BYTES[block.kind]) return fail("block outside the file");
+        }
+        for (size_t i = 0; i < SAVE_PRELUDE_BLOCKS; i++) {
+            if (blocks[i].kind != i) return fail("missing global blocks");
+        }
+        if (blocks[0].count != 1) return fail("missing global blocks");
+        seed = element<SavedGlobals>(blocks[0], 0).seedValue;
+
+        // Flow fields: a direction per tile for each active one; units may only follow active ones
+        const SaveBlock& flowFields = blocks[5];
+        std::vector<bool> activeFields(flowFields.count);
+        uint64_t activeCount = 0;
+        for (uint64_t index = 0; index < flowFields.count; index++) {
+            SavedFlowField field = element<SavedFlowField>(flowFields, index);
+            if (field.active && field.goal >= static_cast<uint64_t>(width) * height) return fail("bad flow field");
+            activeFields[index] = field.active != 0;
+            activeCount += activeFields[index];
+        }
+        if (blocks[6].count != activeCount * width * height) return fail("bad flow field"); // Any direction byte is safe to follow
+
+        // Archetypes: ids, then exactly the columns the mask implies, each with a row per id
+        std::vector<uint64_t> rows;
+        std::unordered_map<ComponentMask, bool> masks;
+        uint64_t entities = 0;
+        for (size_t i = SAVE_PRELUDE_BLOCKS; i < blocks.size();) {
+            const SaveBlock& ids = blocks[i++];
+            if (ids.kind != SAVE_IDS || ids.mask >= componentBit(UNIT) || masks[ids.mask]) return fail("bad archetype");
+            masks[ids.mask] = true;
+            rows.push_back(ids.count);
+            entities += ids.count;
+            uint64_t pathPoints = 0, produceable = 0;
+            for (SaveBlockKind kind : savedColumns(ids.mask)) {
+                if (i >= blocks.size() || blocks[i].kind != kind || blocks[i].mask != ids.mask) return fail("missing column");
+                const SaveBlock& column = blocks[i++];
+                if (kind == SAVE_PATH_POINTS) {
+                    if (column.count != pathPoints) return fail("bad path block");
+                } else if (kind == SAVE_PRODUCEABLE) {
+                    if (column.count != produceable) return fail("bad building block");
+                    for (uint64_t unit = 0; unit < column.count; unit++) {
+                        if (element<uint8_t>(column, unit) > UNIT) return fail("bad building block");
+                    }
+                } else if (kind == SAVE_TECH) {
+                    for (uint64_t entry = 0; entry < column.count; entry++) {
+                        SavedTech tech = element<SavedTech>(column, entry);
+                        if (tech.row >= ids.count || tech.unit > UNIT || tech.requirement > UNIT) return fail("bad building block");
+                    }
+                } else if (column.count != ids.count) {
+                    return fail("column length differs from its archetype");
+                }
+                for (uint64_t row = 0; row < column.count; row++) {
+                    if (kind == SAVE_MOVEMENTS) {
+                        SavedMovement movement = element<SavedMovement>(column, row);
+                        if (movement.flowField >= static_cast<int64_t>(flowFields.count) || (movement.flowField >= 0 && !activeFields[movement.flowField]) ||
+                            movement.pathIndex > movement.pathLength || !onMap(movement.patrolFrom) || !onMap(movement.patrolTo)) {
+                            return fail("bad movement");
+                        }
+                        pathPoints += movement.pathLength;
+                    } else if (kind == SAVE_PATH_POINTS) {
+                        if (!onMap(element<Point>(column, row))) return fail("bad path block");
+                    } else if (kind == SAVE_BUILDINGS) {
+                        produceable += element<uint32_t>(column, row);
+                    } else if (kind == SAVE_PRODUCTION) {
+                        ProductionQueue queue = element<ProductionQueue>(column, row);
+                        if (queue.count > PRODUCTION_QUEUE_SLOTS) return fail("bad production queue");
+                        for (uint32_t slot = 0; slot < queue.count; slot++) {
+                            if (queue.units[slot] < POSITION || queue.units[slot] > UNIT) return fail("bad production queue");
+                        }
+                    } else if (kind == SAVE_POSITIONS) {
+                        PositionComponent pos = element<PositionComponent>(column, row);
+                        if (!onMap({pos.x, pos.y})) return fail("entity off the map");
+                        // Between tiles a unit's fixed-point position is less than a tile from the one it last reached
+                        if (std::abs(static_cast<int64_t>(pos.fx) - pos.x * FIXED_ONE) >= FIXED_ONE || 
+                            std::abs(static_cast<int64_t>(pos.fy) - pos.y * FIXED_ONE) >= FIXED_ONE) {
+                            return fail("entity off its tile");
+                        }
+                    } else if (kind == SAVE_FACTIONS) {
+                        int faction = static_cast<int>(element<Faction>(column, row));
+                        if (faction < 0 || faction >= FACTION_COUNT) return fail("bad faction");
+                    }
+                }
+            }
+        }
+
+        // Every live slot must point at a row holding its own id, one slot per row
+        const SaveBlock& records = blocks[1];
+        std::vector<size_t> idBlocks;
+        for (size_t i = SAVE_PRELUDE_BLOCKS; i < blocks.size(); i++) {
+            if (blocks[i].kind == SAVE_IDS) idBlocks.push_back(i);
+        }
+        uint64_t alive = 0;
+        for (uint64_t index = 0; index < records.count; index++) {
+            ECS::EntityRecord record = element<ECS::EntityRecord>(records, index);
+            if (!record.alive) continue;
+            alive++;
+            if (record.archetype >= rows.size() || record.row >= rows[record.archetype] ||
+                element<EntityID>(blocks[idBlocks[record.archetype]], record.row) != makeEntityID(static_cast<uint32_t>(index), record.generation)) {
+                return fail("entity table does not match the archetypes");
+            }
+        }
+        if (alive != entities) return fail("entity table does not match the archetypes");
+        for (uint64_t i = 0; i < blocks[2].count; i++) {
+            if (element<uint32_t>(blocks[2], i) >= records.count) return fail("bad free list");
+        }
+        return true;
+    }
+};
+
+// Wire Format: little-endian bytes, LEB128 varints, zigzag for signed deltas
+class WireWriter {
+public:
+    std::vector<uint8_t>& out;
+    explicit WireWriter(std::vector<uint8_t>& buffer) : out(buffer) {}
+
+    void u8(uint8_t value) { out.push_back(value); }
+    void u32(uint32_t value) { for (int i = 0; i < 4; i++) out.push_back(static_cast<uint8_t>(value >> (i * 8))); }
+    void varint(uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<uint8_t>(value) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(value));
+    }
+    void svarint(int64_t value) { varint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63)); }
+    void string(const std::string& value) {
+        varint(value.size());
+        out.insert(out.end(), value.begin(), value.end());
+    }
+};
+
+// Reads past the end set ok = false and return zeros, so callers check once at the end
+class WireReader {
+public:
+    const uint8_t* pos;
+    const uint8_t* end;
+    bool ok = true;
+    WireReader(const uint8_t* data, size_t size) : pos(data), end(data + size) {}
+
+    uint8_t u8() {
+        if (pos >= end) { ok = false; return 0; }
+        return *pos++;
+    }
+    uint32_t u32() {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) value |= static_cast<uint32_t>(u8()) << (i * 8);
+        return value;
+    }
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = u8();
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        ok = false;
+        return 0;
+    }
+    int64_t svarint() {
+        uint64_t raw = varint();
+        return static_cast<int64_t>(raw >> 1) ^ -static_cast<int64_t>(raw & 1);
+    }
+    std::string string() {
+        uint64_t size = varint();
+        if (size > static_cast<uint64_t>(end - pos)) { ok = false; return {}; }
+        std::string value(reinterpret_cast<const char*>(pos), size);
+        pos += size;
+        return value;
+    }
+};
+
+// Snapshot Delta Encoding: the replicated view of one entity, and the field bits of its dirty mask
+struct NetEntityState {
+    EntityID id;
+    int32_t x, y, health;
+    uint8_t faction, kind; // kind: 'W' worker, 'B' building, 'R' anything else
+};
+using NetSnapshot = std::vector<NetEntityState>; // Sorted by entity slot index
+
+enum NetField : uint8_t { FIELD_X = 1, FIELD_Y = 2, FIELD_HEALTH = 4, FIELD_FACTION = 8, FIELD_KIND = 16, FIELD_ALL = 31 };
+
+// What a client sees of one entity; false for entities that are not replicated (no position or faction)
+bool replicatedState(const ECS& ecs, EntityID id, NetEntityState& out) {
+    if (!ecs.isAlive(id)) return false;
+    const ECS::EntityRecord& record = ecs.records[entityIndex(id)];
+    const Archetype& arch = ecs.archetypes[record.archetype];
+    if (!(arch.mask & componentBit(POSITION)) || !(arch.mask & componentBit(FACTION))) return false;
+    const PositionComponent& pos = arch.positions[record.row];
+    uint8_t kind = arch.mask & componentBit(WORKER) ? 'W' : arch.mask & componentBit(BUILDING) ? 'B' : 'R';
+    int32_t health = arch.mask & componentBit(HEALTH) ? arch.healths[record.row].health : 0;
+    out = {id, pos.x, pos.y, health, static_cast<uint8_t>(arch.factions[record.row]), kind};
+    return true;
+}
+
+// Entries: [index delta + 1][generation][mask][changed fields], 0-terminated; then removals the same way.
+// Fields are zigzag deltas against the baseline (against zero for entities the baseline lacks).
+void encodeDelta(const NetSnapshot& baseline, const NetSnapshot& current, WireWriter& w) {
+    static const NetEntityState empty{};
+    uint32_t lastIndex = 0;
+    auto writeEntry = [&](const NetEntityState& base, const NetEntityState& now, uint8_t mask) {
+        w.varint(entityIndex(now.id) - lastIndex + 1);
+        w.varint(entityGeneration(now.id));
+        w.u8(mask);
+        if (mask & FIELD_X) w.svarint(static_cast<int64_t>(now.x) - base.x);
+        if (mask & FIELD_Y) w.svarint(static_cast<int64_t>(now.y) - base.y);
+        if (mask & FIELD_HEALTH) w.svarint(static_cast<int64_t>(now.health) - base.health);
+        if (mask & FIELD_FACTION) w.u8(now.faction);
+        if (mask & FIELD_KIND) w.u8(now.kind);
+        lastIndex = entityIndex(now.id);
+    };
+    size_t b = 0;
+    for (const auto& now : current) {
+        while (b < baseline.size() && entityIndex(baseline[b].id) < entityIndex(now.id)) b++;
+        if (b < baseline.size() && baseline[b].id == now.id) {
+            const NetEntityState& base = baseline[b];
+            uint8_t mask = (now.x != base.x ? FIELD_X : 0) | (now.y != base.y ? FIELD_Y : 0) |
+                           (now.health != base.health ? FIELD_HEALTH : 0) | (now.faction != base.faction ? FIELD_FACTION : 0) |
+                           (now.kind != base.kind ? FIELD_KIND : 0);
+            if (mask) writeEntry(base, now, mask);
+        } else {
+            writeEntry(empty, now, FIELD_ALL);
+        }
+    }
+    w.varint(0);
+
+    lastIndex = 0;
+    size_t c = 0;
+    for (const auto& base : baseline) {
+        while (c < current.size() && entityIndex(current[c].id) < entityIndex(base.id)) c++;
+        if (c < current.size() && current[c].id == base.id) continue;
+        w.varint(entityIndex(base.id) - lastIndex + 1);
+        w.varint(entityGeneration(base.id));
+        lastIndex = entityIndex(base.id);
+    }
+    w.varint(0);
+}
+
+// Rebuilds the full snapshot from the baseline plus the delta written by encodeDelta
+bool decodeDelta(const NetSnapshot& baseline, WireReader& r, NetSnapshot& out) {
+    static thread_local NetSnapshot changes;
+    static thread_local std::vector<EntityID> removals;
+    changes.clear();
+    removals.clear();
+    uint32_t lastIndex = 0;
+    size_t b = 0;
+    for (uint64_t step = r.varint(); step != 0 && r.ok; step = r.varint()) {
+        uint32_t index = lastIndex + static_cast<uint32_t>(step - 1);
+        EntityID id = makeEntityID(index, static_cast<uint32_t>(r.varint()));
+        uint8_t mask = r.u8();
+        while (b < baseline.size() && entityIndex(baseline[b].id) < index) b++;
+        NetEntityState state = b < baseline.size() && baseline[b].id == id ? baseline[b] : NetEntityState{};
+        state.id = id;
+        if (mask & FIELD_X) state.x = static_cast<int32_t>(state.x + r.svarint());
+        if (mask & FIELD_Y) state.y = static_cast<int32_t>(state.y + r.svarint());
+        if (mask & FIELD_HEALTH) state.health = static_cast<int32_t>(state.health + r.svarint());
+        if (mask & FIELD_FACTION) state.faction = r.u8();
+        if (mask & FIELD_KIND) state.kind = r.u8();
+        changes.push_back(state);
+        lastIndex = index;
+    }
+    lastIndex = 0;
+    for (uint64_t step = r.varint(); step != 0 && r.ok; step = r.varint()) {
+        uint32_t index = lastIndex + static_cast<uint32_t>(step - 1);
+        removals.push_back(makeEntityID(index, static_cast<uint32_t>(r.varint())));
+        lastIndex = index;
+    }
+    if (!r.ok) return false;
+
+    // Merge by slot index; a change for a slot with a different generation replaces the old occupant
+    out.clear();
+    size_t c = 0, k = 0;
+    for (const auto& base : baseline) {
+        uint32_t index = entityIndex(base.id);
+        while (c < changes.size() && entityIndex(changes[c].id) < index) out.push_back(changes[c++]);
+        while (k < removals.size() && entityIndex(removals[k]) < index) k++;
+        if (c < changes.size() && entityIndex(changes[c].id) == index) {
+            out.push_back(changes[c++]);
+            continue;
+        }
+        if (k < removals.size() && removals[k] == base.id) continue;
+        out.push_back(base);
+    }
+    while (c < changes.size()) out.push_back(changes[c++]);
+    return true;
+}
+
+// Ring of recent snapshots by sequence number, used as delta baselines on both ends
+class SnapshotHistory {
+public:
+    struct Entry { uint32_t sequence = 0; NetSnapshot entities; };
+    std::vector<Entry> entries;
+
+    explicit SnapshotHistory(size_t capacity) : entries(capacity) {}
+
+    NetSnapshot& store(uint32_t sequence) {
+        Entry& entry = entries[sequence % entries.size()];
+        entry.sequence = sequence;
+        return entry.entities;
+    }
+    const NetSnapshot* find(uint32_t sequence) const {
+        const Entry& entry = entries[sequence % entries.size()];
+        return sequence != 0 && entry.sequence == sequence ? &entry.entities : nullptr;
+    }
+};
+
+const size_t SNAPSHOT_HISTORY = 32;
+
+// [timestamp][type u8][unit id][payload of that type]; tile payloads are two zigzag varints, targets an id,
+// PRODUCE the unit type byte
+void writeCommand(WireWriter& w, const Command& cmd) {
+    w.varint(cmd.timestamp);
+    w.u8(cmd.type);
+    w.varint(cmd.id);
+    if (cmd.type == CMD_MOVE || cmd.type == CMD_BUILD || cmd.type == CMD_PATROL) {
+        // The tile payloads share one layout
+        w.svarint(cmd.move.x);
+        w.svarint(cmd.move.y);
+    } else if (cmd.type == CMD_PRODUCE) {
+        w.u8(cmd.produce.unit);
+    } else if (cmd.type == CMD_ATTACK) {
+        w.varint(cmd.attack.target);
+    } else if (cmd.type == CMD_GATHER) {
+        w.varint(cmd.gather.resource);
+    }
+}
+
+// Unknown types fail the reader like a truncated message
+Command readCommand(WireReader& r) {
+    Command cmd{};
+    cmd.timestamp = static_cast<Uint32>(r.varint());
+    uint8_t type = r.u8();
+    cmd.type = type < CMD_TYPES ? static_cast<CommandType>(type) : CMD_STOP;
+    if (type >= CMD_TYPES) r.ok = false;
+    cmd.id = r.varint();
+    if (cmd.type == CMD_MOVE || cmd.type == CMD_BUILD || cmd.type == CMD_PATROL) {
+        cmd.move.x = static_cast<int32_t>(r.svarint());
+        cmd.move.y = static_cast<int32_t>(r.svarint());
+    } else if (cmd.type == CMD_PRODUCE) {
+        cmd.produce.unit = r.u8();
+    } else if (cmd.type == CMD_ATTACK) {
+        cmd.attack.target = r.varint();
+    } else if (cmd.type == CMD_GATHER) {
+        cmd.gather.resource = r.varint();
+    }
+    return cmd;
+}
+
+// Replay Log: a header with the seed and initial EntityConfig set, then records of
+// [kind u8][ticks since previous record varint][payload]. Only ticks that ran commands are written.
+const uint32_t REPLAY_MAGIC = 0x50524353; // "SCRP"
+const uint8_t REPLAY_VERSION = 3; // 2: commands carry a type byte and typed payloads; 3: PRODUCE names a building and unit
+const uint32_t REPLAY_CHECKSUM_INTERVAL = 64; // Ticks between state checksums the player verifies
+const size_t REPLAY_FLUSH_BYTES = 64 * 1024;
+enum ReplayRecord : uint8_t { REPLAY_COMMANDS = 1, REPLAY_CHECKSUM = 2, REPLAY_END = 3 };
+
+class ReplayWriter {
+public:
+    ~ReplayWriter() { close(); }
+
+    bool open(const std::string& path) {
+        file.open(path, std::ios::binary | std::ios::trunc);
+        headerWritten = false;
+        lastTick = 0;
+        return file.is_open();
+    }
+
+    bool isOpen() const { return file.is_open(); }
+
+    // Call after every Simulation::simulate(); the header is taken from the state the first tick started with
+    void recordTick(const Simulation& sim) {
+        if (!file.is_open()) return;
+        WireWriter w(buffer);
+        if (!headerWritten) {
+            writeHeader(w, sim);
+            headerWritten = true;
+        }
+        uint32_t tick = sim.tick - 1;
+        if (!sim.executed.empty()) {
+            beginRecord(w, REPLAY_COMMANDS, tick);
+            w.varint(sim.executed.size());
+            for (const auto& cmd : sim.executed) writeCommand(w, cmd);
+        }
+        if (tick % REPLAY_CHECKSUM_INTERVAL == 0) {
+            beginRecord(w, REPLAY_CHECKSUM, tick);
+            uint64_t checksum = sim.stateChecksum();
+            w.u32(static_cast<uint32_t>(checksum));
+            w.u32(static_cast<uint32_t>(checksum >> 32));
+        }
+        ticks = sim.tick;
+        if (buffer.size() >= REPLAY_FLUSH_BYTES) flush();
+    }
+
+    void close() {
+        if (!file.is_open()) return;
+        if (headerWritten) {
+            WireWriter w(buffer);
+            beginRecord(w, REPLAY_END, ticks);
+        }
+        flush();
+        file.close();
+    }
+
+private:
+    std::ofstream file;
+    std::vector<uint8_t> buffer;
+    bool headerWritten = false;
+    uint32_t lastTick = 0, ticks = 0;
+
+    void writeHeader(WireWriter& w, const Simulation& sim) {
+        w.u32(REPLAY_MAGIC);
+        w.u8(REPLAY_VERSION);
+        w.u32(sim.seedValue);
+        w.varint(sim.pathfinder.width);
+        w.varint(sim.pathfinder.height);
+        w.svarint(sim.startMinerals);
+        w.varint(sim.configs.size());
+        for (const auto& config : sim.configs) {
+            w.u8(config.faction);
+            w.svarint(config.x);
+            w.svarint(config.y);
+            w.svarint(config.health);
+            w.u8((config.isWorker ? 1 : 0) | (config.isBuilding ? 2 : 0));
+            w.varint(config.produceableUnits.size());
+            for (ComponentType type : config.produceableUnits) w.u8(type);
+            w.string(config.textureName);
+        }
+    }
+
+    void beginRecord(WireWriter& w, ReplayRecord kind, uint32_t tick) {
+        w.u8(kind);
+        w.varint(tick - lastTick);
+        lastTick = tick;
+    }
+
+    void flush() {
+        file.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    }
+};
+
+// Replay Player: rebuilds the recorded world and re-simulates it as fast as the CPU allows, with no rendering,
+// checking the recorded checksums on the way. Returns a process exit code.
+int runReplay(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot open replay " << path << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    WireReader r(data.data(), data.size());
+    if (r.u32() != REPLAY_MAGIC || r.u8() != REPLAY_VERSION) {
+        std::cerr << path << " is not a version " << int(REPLAY_VERSION) << " replay" << std::endl;
+        return 1;
+    }
+    uint32_t seed = r.u32();
+    int width = static_cast<int>(r.varint()), height = static_cast<int>(r.varint());
+    int startMinerals = static_cast<int>(r.svarint());
+    std::vector<EntityConfig> configs(r.ok ? std::min<uint64_t>(r.varint(), data.size()) : 0);
+    for (auto& config : configs) {
+        config.faction = static_cast<Faction>(r.u8());
+        config.x = static_cast<int>(r.svarint());
+        config.y = static_cast<int>(r.svarint());
+        config.health = static_cast<int>(r.svarint());
+        uint8_t flags = r.u8();
+        config.isWorker = flags & 1;
+        config.isBuilding = flags & 2;
+        uint64_t produceable = r.varint();
+        for (uint64_t i = 0; i < produceable && r.ok; i++) config.produceableUnits.push_back(static_cast<ComponentType>(r.u8()));
+        config.textureName = r.string();
+    }
+    if (!r.ok || width <= 0 || height <= 0 || width > MAP_MAX_SIDE || height > MAP_MAX_SIDE) {
+        std::cerr << path << ": truncated or corrupt header" << std::endl;
+        return 1;
+    }
+    // Entities are built straight from these, so each must name a faction, sit on the map and train real units
+    for (const auto& config : configs) {
+        bool valid = config.faction >= 0 && config.faction < FACTION_COUNT && 
+                     config.x >= 0 && config.y >= 0 && config.x < width && config.y < height;
+        for (ComponentType unit : config.produceableUnits) valid &= unit >= POSITION && unit <= UNIT;
+        if (!valid) {
+            std::cerr << path << ": corrupt entity in header" << std::endl;
+            return 1;
+        }
+    }
+
+    Simulation sim(width, height);
+    sim.setDeterministic(true);
+    sim.seed(seed);
+    sim.minerals = startMinerals;
+    sim.setupEntities(configs);
+
+    size_t commandCount = 0, checksumsVerified = 0;
+    uint32_t recordTick = 0;
+    bool ended = false;
+    auto start = std::chrono::steady_clock::now();
+    while (r.ok && r.pos < r.end && !ended) {
+        uint8_t kind = r.u8();
+        recordTick += static_cast<uint32_t>(r.varint());
+        if (!r.ok) break;
+        if (kind == REPLAY_COMMANDS) {
+            // Commands recorded for tick t run in tick t, so catch up to it first
+            while (sim.tick < recordTick) sim.simulate();
+            uint64_t count = r.varint();
+            for (uint64_t i = 0; i < count && r.ok; i++) {
+                Command cmd = readCommand(r);
+                if (r.ok && !sim.queueCommand(cmd)) r.ok = false; // More than a tick can hold: not a log we wrote
+            }
+            if (!r.ok) break; // Cut off mid-record
+            commandCount += count;
+            sim.simulate();
+        } else if (kind == REPLAY_CHECKSUM) {
+            uint64_t expected = r.u32();
+            expected |= static_cast<uint64_t>(r.u32()) << 32;
+            while (sim.tick <= recordTick) sim.simulate();
+            if (!r.ok) break;
+            if (sim.stateChecksum() != expected) {
+                std::cerr << "Replay diverged at tick " << recordTick << std::endl;
+                return 2;
+            }
+            checksumsVerified++;
+        } else if (kind == REPLAY_END) {
+            while (sim.tick < recordTick) sim.simulate();
+            ended = true;
+        } else {
+            r.ok = false;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!ended) std::cerr << path << ": log ends early (truncated or still being written), replayed what was there" << std::endl;
+
+    double gameSeconds = sim.tick * SIM_TICK_MS / 1000.0;
+    printf("Replayed %u ticks (%.0f s of game time, %zu entities at start, %zu commands) in %.2f s: %.0f ticks/s, %.0fx real time\n",
+           sim.tick, gameSeconds, configs.size(), commandCount, seconds, sim.tick / std::max(seconds, 1e-9),
+           gameSeconds / std::max(seconds, 1e-9));
+    printf("Checksums verified: %zu, final state %016" PRIx64 "\n", checksumsVerified, sim.stateChecksum());
+    return 0;
+}
+
+// One peer's commands for one lockstep tick, plus the checksum of the newest tick that peer simulated
+struct TickMessage {
+    uint32_t tick = 0;
+    bool hasChecksum = false;
+    uint32_t checksumTick = 0;
+    uint64_t checksum = 0;
+    std::vector<Command> commands;
+};
+
+// Deterministic Lockstep: both peers run the full simulation and exchange only commands. A tick runs once
+// both peers' commands for it are known; local commands are scheduled INPUT_DELAY_TICKS ahead so the
+// remote batch normally arrives before it is needed. Player 0 (the host) applies first on both machines.
+class LockstepSession {
+public:
+    struct TickInputs {
+        bool received[2] = {false, false};
+        std::vector<Command> commands[2];
+    };
+
+    bool started = false;
+    int localPlayer = 0;
+    uint32_t tick = 0;        // Next tick to simulate
+    uint32_t sealedUntil = 0; // Local commands have been sent for every tick below this
+    bool desynced = false;
+    uint32_t desyncTick = 0;
+    bool protocolError = false;
+
+    void start(int player) {
+        started = true;
+        localPlayer = player;
+        tick = 0;
+        sealedUntil = INPUT_DELAY_TICKS;
+        for (uint32_t t = 0; t < INPUT_DELAY_TICKS; t++) inputs[t].received[0] = inputs[t].received[1] = true;
+    }
+
+    void queueLocal(const Command& cmd) { localBatch.push_back(cmd); }
+
+    // Closes the local batch for tick + INPUT_DELAY_TICKS; false if that tick was already sent
+    bool sealLocal(TickMessage& msg) {
+        uint32_t target = tick + INPUT_DELAY_TICKS;
+        if (target < sealedUntil) return false;
+        for (auto& cmd : localBatch) cmd.timestamp = target;
+        msg.tick = target;
+        msg.commands.swap(localBatch);
+        localBatch.clear();
+        msg.hasChecksum = tick > 0;
+        msg.checksumTick = tick - 1;
+        msg.checksum = msg.hasChecksum ? localChecksums[tick - 1] : 0;
+        inputs[target].received[localPlayer] = true;
+        inputs[target].commands[localPlayer] = msg.commands;
+        sealedUntil = target + 1;
+        return true;
+    }
+
+    // A peer never gets more than one input delay past the last tick we sent, so anything further ahead is a
+    // protocol error and is dropped instead of being buffered
+    void receiveRemote(TickMessage& msg) {
+        int remote = 1 - localPlayer;
+        if (msg.tick > tick + INPUT_WINDOW || (msg.hasChecksum && msg.checksumTick > tick + INPUT_WINDOW)) {
+            if (!protocolError) std::cerr << "Lockstep message for tick " << msg.tick << " is too far ahead of tick " << tick << std::endl;
+            protocolError = true;
+            return;
+        }
+        if (msg.tick >= tick) {
+            TickInputs& in = inputs[msg.tick];
+            in.received[remote] = true;
+            in.commands[remote].swap(msg.commands);
+        }
+        if (msg.hasChecksum) {
+            auto local = localChecksums.find(msg.checksumTick);
+            if (local != localChecksums.end()) compare(msg.checksumTick, local->second, msg.checksum);
+            else if (msg.checksumTick >= tick) remoteChecksums[msg.checksumTick] = msg.checksum;
+        }
+    }
+
+    bool ready() const {
+        auto it = inputs.find(tick);
+        return it != inputs.end() && it->second.received[0] && it->second.received[1];
+    }
+
+    void takeCommands(Simulation& sim) {
+        auto it = inputs.find(tick);
+        for (int player = 0; player < 2; player++) {
+            for (const auto& cmd : it->second.commands[player]) sim.queueCommand(cmd);
+        }
+        inputs.erase(it);
+    }
+
+    // Records the checksum of the tick just simulated and advances to the next one
+    void finishTick(uint64_t checksum) {
+        localChecksums[tick] = checksum;
+        auto remote = remoteChecksums.find(tick);
+        if (remote != remoteChecksums.end()) {
+            compare(tick, checksum, remote->second);
+            remoteChecksums.erase(remote);
+        }
+        if (tick >= CHECKSUM_WINDOW) localChecksums.erase(tick - CHECKSUM_WINDOW);
+        tick++;
+    }
+
+private:
+    static const uint32_t CHECKSUM_WINDOW = 64;
+    // Our sealed inputs reach tick + INPUT_DELAY_TICKS, the peer can simulate through them and then seal its own
+    // input delay ahead of that
+    static const uint32_t INPUT_WINDOW = 2 * INPUT_DELAY_TICKS + 1;
+    std::map<uint32_t, TickInputs> inputs;
+    std::vector<Command> localBatch;
+    std::map<uint32_t, uint64_t> localChecksums, remoteChecksums;
+
+    void compare(uint32_t at, uint64_t local, uint64_t remote) {
+        if (local == remote || desynced) return;
+        desynced = true;
+        desyncTick = at;
+        std::cerr << "Lockstep desync at tick " << at << std::endl;
+    }
+};
+
+// UDP Transport: datagrams are [u16 protocol][u32 sequence][u32 ack][u32 ack bits][entries...]. Every datagram
+// acks the newest sequence received plus the 32 before it, so acks survive individual losses. Reliable messages
+// are resent until a datagram carrying them is acked and are delivered in order; unreliable messages are sent
+// once, split into fragments if needed, and only the newest per slot is delivered.
+const uint16_t PROTOCOL_ID = 0x5343;
+const Uint16 NET_PORT = 12345;
+const size_t PACKET_MTU = 1200;
+const size_t PACKET_HEADER = 14;
+const size_t MESSAGE_CHUNK = 1024;  // Largest reliable chunk or unreliable fragment in one entry
+const size_t SENT_WINDOW = 256;     // Datagrams remembered for ack and RTT bookkeeping
+const uint32_t RELIABLE_WINDOW = 1024; // Reliable chunks sent past the oldest unacked one; receivers buffer no further
+const uint32_t MAX_FRAGMENTS = 4096;
+const size_t ASSEMBLY_BUDGET = 8 << 20;     // Bytes of unreliable fragments buffered across all slots
+const Uint32 ASSEMBLY_TIMEOUT_MS = 1000;    // Incomplete unreliable messages are dropped after this
+const Uint32 KEEPALIVE_MS = 100;
+const int MAX_PACKETS_PER_FLUSH = 64;
+
+enum TransportEntry : uint8_t { ENTRY_RELIABLE = 1, ENTRY_FRAGMENT = 2 };
+
+class ReliableTransport {
+public:
+    float rttMs = 0.0f;
+    size_t packetsSent = 0, packetsReceived = 0, packetsAcked = 0, packetsLost = 0;
+
+    // Share of datagrams that left the ack window without being acked
+    float lossRatio() const { return packetsAcked + packetsLost ? static_cast<float>(packetsLost) / (packetsAcked + packetsLost) : 0.0f; }
+
+    static bool accepts(const uint8_t* data, size_t size) {
+        return size >= PACKET_HEADER && (data[0] | data[1] << 8) == PROTOCOL_ID;
+    }
+
+    // Large messages are split into chunks that are reassembled before delivery
+    void sendReliable(const std::vector<uint8_t>& message) {
+        size_t offset = 0;
+        do {
+            size_t size = std::min(MESSAGE_CHUNK, message.size() - offset);
+            reliable.push_back({nextReliableId++, std::vector<uint8_t>(message.begin() + offset, message.begin() + offset + size), 
+                                offset + size == message.size(), 0, false});
+            offset += size;
+        } while (offset < message.size());
+    }
+
+    // Replaces any message of the same slot that has not been flushed yet
+    void sendUnreliable(uint8_t slot, const std::vector<uint8_t>& message) {
+        Outgoing& out = unreliable[slot];
+        out.bytes = message;
+        out.pending = true;
+    }
+
+    // Builds datagrams for due reliable resends, pending unreliable messages and acks
+    template <typename Send>
+    void flush(Uint32 now, Send send) {
+        std::vector<uint8_t>& packet = scratch;
+        int packets = 0;
+        SentPacket* open = nullptr;
+        auto finish = [&]() {
+            if (!open) return;
+            send(packet);
+            open = nullptr;
+            packets++;
+        };
+        auto reserve = [&](size_t bytes) {
+            if (open && packet.size() + bytes > PACKET_MTU) finish();
+            if (!open) open = &begin(packet, now);
+        };
+
+        Uint32 resendDelay = static_cast<Uint32>(rttMs * 1.25f) + 20;
+        for (auto& message : reliable) {
+            if (packets >= MAX_PACKETS_PER_FLUSH || message.id - reliable.front().id >= RELIABLE_WINDOW) break;
+            if (message.acked || (message.lastSent && now - message.lastSent < resendDelay)) continue;
+            reserve(16 + message.bytes.size());
+            WireWriter w(packet);
+            w.u8(ENTRY_RELIABLE);
+            w.varint(message.id);
+            w.u8(message.last);
+            w.varint(message.bytes.size());
+            packet.insert(packet.end(), message.bytes.begin(), message.bytes.end());
+            message.lastSent = now;
+            open->reliableIds.push_back(message.id);
+        }
+        for (int slot = 0; slot < 256; slot++) {
+            Outgoing& out = unreliable[slot];
+            if (!out.pending) continue;
+            out.pending = false;
+            uint32_t stream = nextStream++;
+            uint32_t count = static_cast<uint32_t>(std::max<size_t>(1, (out.bytes.size() + MESSAGE_CHUNK - 1) / MESSAGE_CHUNK));
+            for (uint32_t index = 0; index < count; index++) {
+                size_t offset = index * MESSAGE_CHUNK, size = std::min(MESSAGE_CHUNK, out.bytes.size() - offset);
+                reserve(24 + size);
+                writeFragmentHeader(packet, static_cast<uint8_t>(slot), stream, index, count, size);
+                packet.insert(packet.end(), out.bytes.begin() + offset, out.bytes.begin() + offset + size);
+            }
+        }
+        if (!open && packets == 0 && (needAck || now - lastSend >= KEEPALIVE_MS)) open = &begin(packet, now);
+        finish();
+        if (packets) {
+            needAck = false;
+            lastSend = now;
+        }
+    }
+
+    // Fragments a message shared between clients without copying it: emit gets this client's header bytes
+    // and the slice of the shared buffer that completes the datagram
+    template <typename Emit>
+    void sendShared(uint8_t slot, const std::vector<uint8_t>& message, Uint32 now, Emit emit) {
+        unreliable[slot].pending = false;
+        uint32_t stream = nextStream++;
+        uint32_t count = static_cast<uint32_t>(std::max<size_t>(1, (message.size() + MESSAGE_CHUNK - 1) / MESSAGE_CHUNK));
+        for (uint32_t index = 0; index < count; index++) {
+            size_t offset = index * MESSAGE_CHUNK, size = std::min(MESSAGE_CHUNK, message.size() - offset);
+            std::vector<uint8_t> head;
+            begin(head, now);
+            writeFragmentHeader(head, slot, stream, index, count, size);
+            emit(std::move(head), offset, size);
+        }
+        needAck = false;
+        lastSend = now;
+    }
+
+    // Processes one datagram; delivered messages are appended to inbox whole, in order for reliable ones
+    bool receive(const uint8_t* data, size_t size, Uint32 now, std::vector<uint8_t>& inbox) {
+        if (!accepts(data, size)) return false;
+        WireReader r(data + 2, size - 2);
+        uint32_t seq = r.u32(), ack = r.u32(), ackBits = r.u32();
+        packetsReceived++;
+        recordReceived(seq);
+        processAcks(ack, ackBits, now);
+        expireAssemblies(now);
+
+        while (r.ok && r.pos < r.end) {
+            uint8_t kind = r.u8();
+            if (kind == ENTRY_RELIABLE) {
+                uint32_t id = static_cast<uint32_t>(r.varint());
+                bool last = r.u8() != 0;
+                uint64_t length = r.varint();
+                if (length > static_cast<uint64_t>(r.end - r.pos)) return false;
+                // Everything below the sender's oldest unacked chunk has arrived, so a peer that keeps to its send
+                // window never lands past ours
+                if (id >= nextExpectedId && id - nextExpectedId < RELIABLE_WINDOW && !inboundReliable.count(id)) {
+                    inboundReliable[id] = {std::vector<uint8_t>(r.pos, r.pos + length), last};
+                }
+                r.pos += length;
+            } else if (kind == ENTRY_FRAGMENT) {
+                uint8_t slot = r.u8();
+                uint32_t stream = static_cast<uint32_t>(r.varint());
+                uint32_t index = static_cast<uint32_t>(r.varint()), count = static_cast<uint32_t>(r.varint());
+                uint64_t length = r.varint();
+                if (!r.ok || length > static_cast<uint64_t>(r.end - r.pos) || index >= count || count > MAX_FRAGMENTS) return false;
+                receiveFragment(slot, stream, index, count, r.pos, static_cast<size_t>(length), now, inbox);
+                r.pos += length;
+            } else {
+                return false;
+            }
+        }
+        // Release every reliable chunk that is now contiguous, joining chunks of one message
+        for (auto it = inboundReliable.find(nextExpectedId); it != inboundReliable.end(); it = inboundReliable.find(nextExpectedId)) {
+            joined.insert(joined.end(), it->second.bytes.begin(), it->second.bytes.end());
+            if (it->second.last) {
+                inbox.insert(inbox.end(), joined.begin(), joined.end());
+                joined.clear();
+            }
+            inboundReliable.erase(it);
+            nextExpectedId++;
+        }
+        return r.ok;
+    }
+
+private:
+    struct Reliable { uint32_t id; std::vector<uint8_t> bytes; bool last; Uint32 lastSent; bool acked; };
+    struct Outgoing { std::vector<uint8_t> bytes; bool pending = false; };
+    struct SentPacket { uint32_t sequence = 0; Uint32 sentAt = 0; bool acked = false; std::vector<uint32_t> reliableIds; };
+    struct Chunk { std::vector<uint8_t> bytes; bool last; };
+    struct Assembly {
+        uint32_t stream = 0, count = 0, received = 0;
+        bool delivered = true;
+        Uint32 startedAt = 0;
+        size_t bytes = 0;
+        std::vector<std::vector<uint8_t>> parts;
+        std::vector<bool> have;
+    };
+
+    std::vector<uint8_t> scratch, joined;
+    uint32_t sequence = 1;            // Next outgoing datagram
+    uint32_t remoteSequence = 0, receivedBits = 0;
+    uint32_t lossChecked = 1;         // Datagrams below this have been counted as acked or lost
+    bool needAck = false;
+    Uint32 lastSend = 0;
+    SentPacket sent[SENT_WINDOW];
+    std::deque<Reliable> reliable;
+    uint32_t nextReliableId = 0, nextExpectedId = 0;
+    std::map<uint32_t, Chunk> inboundReliable;
+    Outgoing unreliable[256];
+    uint32_t nextStream = 1;
+    Assembly assemblies[256];
+    size_t assemblyBytes = 0;
+    Uint32 lastExpiry = 0;
+
+    SentPacket& begin(std::vector<uint8_t>& out, Uint32 now) {
+        out.clear();
+        WireWriter w(out);
+        w.u8(PROTOCOL_ID & 0xFF);
+        w.u8(PROTOCOL_ID >> 8);
+        w.u32(sequence);
+        w.u32(remoteSequence);
+        w.u32(receivedBits);
+        SentPacket& record = sent[sequence % SENT_WINDOW];
+        if (record.sequence >= lossChecked && !record.acked) packetsLost++; // Evicted before its ack window closed
+        record.sequence = sequence++;
+        record.sentAt = now;
+        record.acked = false;
+        record.reliableIds.clear();
+        packetsSent++;
+        return record;
+    }
+
+    static void writeFragmentHeader(std::vector<uint8_t>& out, uint8_t slot, uint32_t stream, uint32_t index, uint32_t count, size_t size) {
+        WireWriter w(out);
+        w.u8(ENTRY_FRAGMENT);
+        w.u8(slot);
+        w.varint(stream);
+        w.varint(index);
+        w.varint(count);
+        w.varint(size);
+    }
+
+    void recordReceived(uint32_t seq) {
+        needAck = true;
+        if (seq > remoteSequence) {
+            uint32_t shift = seq - remoteSequence;
+            receivedBits = shift > 32 ? 0 : shift == 32 ? 1u << 31 : (receivedBits << shift) | (remoteSequence ? 1u << (shift - 1) : 0);
+            remoteSequence = seq;
+        } else if (seq < remoteSequence && remoteSequence - seq <= 32) {
+            receivedBits |= 1u << (remoteSequence - seq - 1);
+        }
+    }
+
+    void processAcks(uint32_t ack, uint32_t ackBits, Uint32 now) {
+        if (ack == 0) return;
+        for (uint32_t i = 0; i <= 32; i++) {
+            if (i > 0 && !(ackBits & (1u << (i - 1)))) continue;
+            if (ack < i) break;
+            SentPacket& record = sent[(ack - i) % SENT_WINDOW];
+            if (record.sequence != ack - i || record.acked) continue;
+            record.acked = true;
+            packetsAcked++;
+            float sample = static_cast<float>(now - record.sentAt);
+            rttMs = rttMs == 0.0f ? sample : rttMs + (sample - rttMs) * 0.1f;
+            for (uint32_t id : record.reliableIds) {
+                if (!reliable.empty() && id >= reliable.front().id) reliable[id - reliable.front().id].acked = true;
+            }
+        }
+        while (!reliable.empty() && reliable.front().acked) reliable.pop_front();
+        // Datagrams that fell out of the ack window unacked are lost
+        for (; lossChecked + 32 < ack && lossChecked < sequence; lossChecked++) {
+            const SentPacket& record = sent[lossChecked % SENT_WINDOW];
+            if (record.sequence == lossChecked && !record.acked) packetsLost++;
+        }
+    }
+
+    void receiveFragment(uint8_t slot, uint32_t stream, uint32_t index, uint32_t count, const uint8_t* bytes, size_t size, 
+                         Uint32 now, std::vector<uint8_t>& inbox) {
+        Assembly& assembly = assemblies[slot];
+        if (stream < assembly.stream || (stream == assembly.stream && assembly.delivered)) return; // Older or done
+        if (stream > assembly.stream) {
+            release(assembly);
+            assembly.stream = stream;
+            assembly.count = count;
+            assembly.received = 0;
+            assembly.delivered = false;
+            assembly.startedAt = now;
+            assembly.parts.resize(count);
+            assembly.have.assign(count, false);
+        }
+        if (count != assembly.count || assembly.have[index] || assemblyBytes + size > ASSEMBLY_BUDGET) return;
+        assembly.parts[index].assign(bytes, bytes + size);
+        assembly.have[index] = true;
+        assembly.bytes += size;
+        assemblyBytes += size;
+        if (++assembly.received < assembly.count) return;
+        for (const auto& part : assembly.parts) inbox.insert(inbox.end(), part.begin(), part.end());
+        assembly.delivered = true;
+        release(assembly);
+    }
+
+    // Frees the fragments an assembly holds so they no longer count against the budget
+    void release(Assembly& assembly) {
+        assemblyBytes -= assembly.bytes;
+        assembly.bytes = 0;
+        assembly.parts.clear();
+    }
+
+    void expireAssemblies(Uint32 now) {
+        if (!assemblyBytes || now - lastExpiry < ASSEMBLY_TIMEOUT_MS / 4) return;
+        lastExpiry = now;
+        for (auto& assembly : assemblies) {
+            if (assembly.delivered || now - assembly.startedAt < ASSEMBLY_TIMEOUT_MS) continue;
+            release(assembly);
+            assembly.delivered = true; // Late fragments of this stream are ignored
+        }
+    }
+};
+
+// One queued datagram: this client's own head bytes, optionally followed by a slice of a buffer shared
+// between clients, so a snapshot is serialized once however many clients receive it
+struct OutgoingDatagram {
+    std::vector<uint8_t> head;
+    std::shared_ptr<const std::vector<uint8_t>> body;
+    size_t offset = 0, size = 0;
+    bool droppable = false; // Snapshot fragments may be discarded under backpressure
+};
+
+// Loss/latency simulator for outgoing datagrams, so bad links can be reproduced over localhost
+class LinkSimulator {
+public:
+    float loss = 0.0f; // Drop probability, 0..1
+    Uint32 latencyMs = 0, jitterMs = 0;
+    size_t dropped = 0;
+    SimRandom rng{0x5EED};
+
+    void send(OutgoingDatagram&& datagram, Uint32 now) {
+        if (loss > 0.0f && rng.below(10000) < static_cast<uint32_t>(loss * 10000)) {
+            dropped++;
+            return;
+        }
+        Uint32 delay = latencyMs + (jitterMs ? rng.below(jitterMs + 1) : 0);
+        queue.push_back({now + delay, std::move(datagram)});
+    }
+
+    // Hands over every datagram whose delay has passed; jitter can reorder them, as on a real link
+    template <typename Deliver>
+    void release(Uint32 now, Deliver deliver) {
+        size_t kept = 0;
+        for (size_t i = 0; i < queue.size(); i++) {
+            if (static_cast<int32_t>(now - queue[i].deliverAt) >= 0) deliver(queue[i].datagram);
+            else if (kept != i) queue[kept++] = std::move(queue[i]);
+            else kept++;
+        }
+        queue.resize(kept);
+    }
+
+private:
+    struct Delayed { Uint32 deliverAt; OutgoingDatagram datagram; };
+    std::vector<Delayed> queue;
+};
+
+#ifndef STARCRAFT_HEADLESS
+// Non-blocking UDP socket. On Linux it is driven by epoll and sends with sendmsg gather writes, so a shared
+// snapshot slice goes out without being copied; elsewhere it falls back to SDL_net.
+class DatagramSocket {
+public:
+    enum SendResult { SENT, WOULD_BLOCK, FAILED };
+
+    DatagramSocket() = default;
+    DatagramSocket(const DatagramSocket&) = delete;
+    DatagramSocket& operator=(const DatagramSocket&) = delete;
+    ~DatagramSocket() { close(); }
+
+#ifdef __linux__
+    bool open(Uint16 port) {
+        fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) return false;
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        epollFd = epoll_create1(0);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || epollFd < 0 || 
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    void wait(int timeoutMs, bool& readable, bool& writable) {
+        epoll_event event{};
+        int count = epoll_wait(epollFd, &event, 1, timeoutMs);
+        readable = count > 0 && (event.events & EPOLLIN);
+        writable = count > 0 && (event.events & EPOLLOUT);
+    }
+
+    // EPOLLOUT is only watched while some client has datagrams the kernel refused
+    void watchWritable(bool on) {
+        if (on == watchingWritable) return;
+        epoll_event event{};
+        event.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+        watchingWritable = on;
+    }
+
+    bool receive(uint8_t* data, size_t capacity, size_t& size, IPaddress& from) {
+        sockaddr_in address{};
+        socklen_t length = sizeof(address);
+        ssize_t received = recvfrom(fd, data, capacity, 0, reinterpret_cast<sockaddr*>(&address), &length);
+        if (received < 0) return false;
+        size = static_cast<size_t>(received);
+        from.host = address.sin_addr.s_addr;
+        from.port = address.sin_port;
+        return true;
+    }
+
+    SendResult send(const IPaddress& to, const uint8_t* head, size_t headSize, const uint8_t* body, size_t bodySize) {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = to.host;
+        address.sin_port = to.port;
+        iovec parts[2] = {{const_cast<uint8_t*>(head), headSize}, {const_cast<uint8_t*>(body), bodySize}};
+        msghdr message{};
+        message.msg_name = &address;
+        message.msg_namelen = sizeof(address);
+        message.msg_iov = parts;
+        message.msg_iovlen = bodySize ? 2 : 1;
+        if (sendmsg(fd, &message, 0) >= 0) return SENT;
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ? WOULD_BLOCK : FAILED;
+    }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        if (epollFd >= 0) ::close(epollFd);
+        fd = epollFd = -1;
+    }
+
+private:
+    int fd = -1, epollFd = -1;
+    bool watchingWritable = false;
+#else
+    bool open(Uint16 port) {
+        socket = SDLNet_UDP_Open(port);
+        packet = socket ? SDLNet_AllocPacket(static_cast<int>(PACKET_MTU)) : nullptr;
+        return socket != nullptr;
+    }
+
+    bool isOpen() const { return socket != nullptr; }
+
+    void wait(int, bool& readable, bool& writable) { readable = writable = true; }
+
+    void watchWritable(bool) {}
+
+    bool receive(uint8_t* data, size_t capacity, size_t& size, IPaddress& from) {
+        if (SDLNet_UDP_Recv(socket, packet) <= 0) return false;
+        size = std::min(capacity, static_cast<size_t>(packet->len));
+        memcpy(data, packet->data, size);
+        from = packet->address;
+        return true;
+    }
+
+    SendResult send(const IPaddress& to, const uint8_t* head, size_t headSize, const uint8_t* body, size_t bodySize) {
+        memcpy(packet->data, head, headSize);
+        if (bodySize) memcpy(packet->data + headSize, body, bodySize);
+        packet->len = static_cast<int>(headSize + bodySize);
+        packet->address = to;
+        return SDLNet_UDP_Send(socket, -1, packet) ? SENT : FAILED;
+    }
+
+    void close() {
+        if (socket) SDLNet_UDP_Close(socket);
+        if (packet) SDLNet_FreePacket(packet);
+        socket = nullptr;
+        packet = nullptr;
+    }
+
+private:
+    UDPsocket socket = nullptr;
+    UDPpacket* packet = nullptr;
+#endif
+};
+
+const int MAX_PLAYERS = 8;          // Including the host
+const size_t MAX_CLIENTS = 64;      // Players plus spectators
+const size_t SEND_QUEUE_LIMIT = 256; // Queued datagrams per client before snapshots are dropped
+const Uint32 CLIENT_TIMEOUT_MS = 5000;
+const int INTEREST_CELL_SIZE = 8;           // Tiles per interest cell side
+const int INTEREST_CAMERA_MARGIN = 1;       // Cells subscribed beyond each edge of a client's camera
+const int INTEREST_UNIT_RADIUS = 1;         // Cells subscribed around each cell holding a player's units or buildings
+const int INTEREST_NEAR_CELLS = 2;          // Entities this close to the camera cells update every other snapshot
+const uint32_t INTEREST_FAR_INTERVAL = 4;   // Snapshots between updates of entities farther away
+const size_t INTEREST_MAX_ENTITIES = 1024;  // Entities in one snapshot at most; the nearest are kept
+
+// Interest Management: the host splits the map into fixed INTEREST_CELL_SIZE cells. A client subscribes to the
+// cells under its camera and, for a player, those around its faction's units and buildings; each subscription
+// keeps the entities in its cells, updated from the cell changes the grid reports each tick, so building a
+// snapshot only touches relevant entities and costs the same however large the map or army grows.
+class InterestManager {
+public:
+    // Clients with the same view (a faction or VIEW_ALL) and camera cells share one subscription and its history
+    struct Subscription {
+        int view;
+        TileRect camera;                                // In cells, margin included
+        std::unordered_map<int, uint32_t> cellRefs;     // Subscribed cell -> camera and own cells covering it
+        std::vector<EntityID> relevant;                 // Entities in subscribed cells
+        std::unordered_map<EntityID, uint32_t> slotOf;  // Index of each in relevant
+        SnapshotHistory sent{SNAPSHOT_HISTORY};
+        int members = 0;
+    };
+
+    std::vector<std::unique_ptr<Subscription>> subscriptions;
+
+    // Moves entities between cells and the relevant sets that cover them; the grid is sized on first use
+    void update(const ECS& ecs, int mapWidth, int mapHeight) {
+        if (!grid) {
+            grid = std::make_unique<SpatialGrid>(mapWidth, mapHeight, INTEREST_CELL_SIZE);
+            subscribers.resize(grid->cells.size());
+            for (auto& owned : ownedIn) owned.assign(grid->cells.size(), 0);
+        }
+        moves.clear();
+        grid->update(ecs, &moves);
+        for (const auto& move : moves) {
+            if (move.from >= 0) {
+                for (Subscription* sub : subscribers[move.from]) {
+                    if (move.to < 0 || !sub->cellRefs.count(move.to)) removeRelevant(*sub, move.id);
+                }
+            }
+            if (move.to >= 0) {
+                for (Subscription* sub : subscribers[move.to]) {
+                    if (move.from < 0 || !sub->cellRefs.count(move.from)) addRelevant(*sub, move.id);
+                }
+            }
+        }
+        // Then the cells around each faction's forces; covering the new cell before uncovering the old one
+        // keeps cells both cover subscribed throughout
+        for (const auto& move : moves) {
+            uint32_t index = entityIndex(move.id);
+            if (index >= ownerOf.size()) ownerOf.resize(index + 1, -1);
+            if (move.from < 0) ownerOf[index] = ownerIn(ecs, move.id);
+            int owner = ownerOf[index];
+            if (owner < 0) continue;
+            if (move.to >= 0 && ownedIn[owner][move.to]++ == 0) coverAround(owner, move.to, true);
+            if (move.from >= 0 && --ownedIn[owner][move.from] == 0) coverAround(owner, move.from, false);
+            if (move.to < 0) ownerOf[index] = -1;
+        }
+    }
+
+    // The subscription for this view and camera (in tiles), shared with any client that already has it
+    Subscription* join(int view, const TileRect& cameraTiles) {
+        TileRect camera = cameraCells(cameraTiles);
+        for (auto& sub : subscriptions) {
+            if (sub->view == view && sameRect(sub->camera, camera)) {
+                sub->members++;
+                return sub.get();
+            }
+        }
+        subscriptions.push_back(std::make_unique<Subscription>());
+        Subscription& sub = *subscriptions.back();
+        sub.view = view;
+        sub.camera = camera;
+        sub.members = 1;
+        coverCells(sub, camera, true);
+        if (view < FACTION_COUNT) {
+            for (int cell = 0; cell < static_cast<int>(ownedIn[view].size()); cell++) {
+                if (ownedIn[view][cell] > 0) cover(sub, cell, true);
+            }
+        }
+        return &sub;
+    }
+
+    // A client's camera moved: a subscription of its own follows it, keeping its relevant set and history (so
+    // the client keeps getting deltas); a shared one is left for another
+    Subscription* moveCamera(Subscription* sub, const TileRect& cameraTiles) {
+        TileRect camera = cameraCells(cameraTiles);
+        if (sameRect(sub->camera, camera)) return sub;
+        if (sub->members > 1) {
+            leave(sub);
+            return join(sub->view, cameraTiles);
+        }
+        coverCells(*sub, camera, true);
+        coverCells(*sub, sub->camera, false);
+        sub->camera = camera;
+        return sub;
+    }
+
+    void leave(Subscription* sub) {
+        if (--sub->members > 0) return;
+        for (const auto& [cell, refs] : sub->cellRefs) unlink(*sub, cell);
+        subscriptions.erase(std::find_if(subscriptions.begin(), subscriptions.end(), 
+                                         [&](const std::unique_ptr<Subscription>& s) { return s.get() == sub; }));
+    }
+
+    // The subscription's snapshot for this sequence, sorted by slot index: relevant entities its view may see,
+    // up to INTEREST_MAX_ENTITIES nearest the camera. Those outside the camera cells refresh every other or every
+    // INTEREST_FAR_INTERVAL snapshots (staggered by slot) and otherwise repeat the previous snapshot's state, which
+    // encodes to nothing
+    void build(const Subscription& sub, const ECS& ecs, const VisibilityMap& visibility, uint32_t sequence, NetSnapshot& out) {
+        const NetSnapshot* previous = sub.sent.find(sequence - 1);
+        ranked.clear();
+        auto consider = [&](EntityID id) {
+            NetEntityState state;
+            if (!replicatedState(ecs, id, state)) return;
+            if (sub.view < FACTION_COUNT && state.faction != sub.view && 
+                !visibility.isVisible(static_cast<Faction>(sub.view), state.x, state.y)) return;
+            int cx = state.x / INTEREST_CELL_SIZE, cy = state.y / INTEREST_CELL_SIZE;
+            int distance = std::max({sub.camera.minX - cx, cx - sub.camera.maxX, sub.camera.minY - cy, cy - sub.camera.maxY, 0});
+            uint32_t interval = distance == 0 ? 1 : distance <= INTEREST_NEAR_CELLS ? 2 : INTEREST_FAR_INTERVAL;
+            if (previous && (sequence + entityIndex(id)) % interval != 0) {
+                auto it = std::lower_bound(previous->begin(), previous->end(), entityIndex(id), 
+                                           [](const NetEntityState& s, uint32_t index) { return entityIndex(s.id) < index; });
+                if (it != previous->end() && it->id == id) state = *it;
+            }
+            ranked.push_back({distance, state});
+        };
+        if (sub.relevant.size() <= INTEREST_MAX_ENTITIES) {
+            for (EntityID id : sub.relevant) consider(id);
+        } else {
+            // Forces spread over the map: walk subscribed cells in rings out from the camera and stop after the
+            // ring that fills the snapshot, so the cost follows the snapshot size rather than the army's
+            auto visit = [&](int cx, int cy) {
+                int cell = cy * grid->cols + cx;
+                if (!sub.cellRefs.count(cell)) return;
+                for (const auto& entry : grid->cells[cell]) consider(entry.id);
+            };
+            for (int ring = 0; ranked.size() < INTEREST_MAX_ENTITIES; ring++) {
+                TileRect area{sub.camera.minX - ring, sub.camera.minY - ring, sub.camera.maxX + ring, sub.camera.maxY + ring};
+                if (area.minX < 0 && area.minY < 0 && area.maxX >= grid->cols && area.maxY >= grid->rows) break;
+                for (int cy = std::max(0, area.minY); cy <= std::min(grid->rows - 1, area.maxY); cy++) {
+                    if (ring == 0 || cy == area.minY || cy == area.maxY) {
+                        for (int cx = std::max(0, area.minX); cx <= std::min(grid->cols - 1, area.maxX); cx++) visit(cx, cy);
+                    } else {
+                        if (area.minX >= 0) visit(area.minX, cy);
+                        if (area.maxX < grid->cols) visit(area.maxX, cy);
+                    }
+                }
+            }
+        }
+        if (ranked.size() > INTEREST_MAX_ENTITIES) {
+            std::nth_element(ranked.begin(), ranked.begin() + INTEREST_MAX_ENTITIES, ranked.end(), 
+                             [](const Ranked& a, const Ranked& b) { return a.distance < b.distance; });
+            ranked.resize(INTEREST_MAX_ENTITIES);
+        }
+        out.clear();
+        for (const auto& entry : ranked) out.push_back(entry.state);
+        std::sort(out.begin(), out.end(), [](const NetEntityState& a, const NetEntityState& b) { return entityIndex(a.id) < entityIndex(b.id); });
+    }
+
+private:
+    struct Ranked { int distance; NetEntityState state; };
+
+    std::unique_ptr<SpatialGrid> grid;
+    std::vector<std::vector<Subscription*>> subscribers; // Per cell
+    std::vector<uint32_t> ownedIn[FACTION_COUNT];         // Per cell: the faction's units and buildings in it
+    std::vector<int8_t> ownerOf;                         // Per slot: faction counted in ownedIn, -1 for none
+    std::vector<SpatialGrid::CellMove> moves;
+    std::vector<Ranked> ranked;
+
+    static bool sameRect(const TileRect& a, const TileRect& b) {
+        return a.minX == b.minX && a.minY == b.minY && a.maxX == b.maxX && a.maxY == b.maxY;
+    }
+
+    TileRect cameraCells(const TileRect& tiles) const {
+        return {std::max(0, tiles.minX / INTEREST_CELL_SIZE - INTEREST_CAMERA_MARGIN), 
+                std::max(0, tiles.minY / INTEREST_CELL_SIZE - INTEREST_CAMERA_MARGIN),
+                std::min(grid->cols - 1, tiles.maxX / INTEREST_CELL_SIZE + INTEREST_CAMERA_MARGIN), 
+                std::min(grid->rows - 1, tiles.maxY / INTEREST_CELL_SIZE + INTEREST_CAMERA_MARGIN)};
+    }
+
+    // Units and buildings pull in the cells around them; resources and other neutral entities do not
+    static int ownerIn(const ECS& ecs, EntityID id) {
+        ComponentMask mask = ecs.maskOf(id);
+        if (!(mask & componentBit(FACTION)) || !(mask & (componentBit(MOVEMENT) | componentBit(BUILDING)))) return -1;
+        return *ecs.get<Faction>(id);
+    }
+
+    void coverCells(Subscription& sub, const TileRect& camera, bool add) {
+        for (int cy = camera.minY; cy <= camera.maxY; cy++) {
+            for (int cx = camera.minX; cx <= camera.maxX; cx++) {
+                if (add) subscribe(sub, cy * grid->cols + cx);
+                else unsubscribe(sub, cy * grid->cols + cx);
+            }
+        }
+    }
+
+    void coverAround(int faction, int cell, bool add) {
+        for (auto& sub : subscriptions) {
+            if (sub->view == faction) cover(*sub, cell, add);
+        }
+    }
+
+    void cover(Subscription& sub, int cell, bool add) {
+        int cx = cell % grid->cols, cy = cell / grid->cols;
+        TileRect around{std::max(0, cx - INTEREST_UNIT_RADIUS), std::max(0, cy - INTEREST_UNIT_RADIUS), 
+                        std::min(grid->cols - 1, cx + INTEREST_UNIT_RADIUS), std::min(grid->rows - 1, cy + INTEREST_UNIT_RADIUS)};
+        coverCells(sub, around, add);
+    }
+
+    void subscribe(Subscription& sub, int cell) {
+        if (sub.cellRefs[cell]++ > 0) return;
+        subscribers[cell].push_back(&sub);
+        for (const auto& entry : grid->cells[cell]) addRelevant(sub, entry.id);
+    }
+
+    void unsubscribe(Subscription& sub, int cell) {
+        auto it = sub.cellRefs.find(cell);
+        if (it == sub.cellRefs.end() || --it->second > 0) return;
+        sub.cellRefs.erase(it);
+        unlink(sub, cell);
+        for (const auto& entry : grid->cells[cell]) removeRelevant(sub, entry.id);
+    }
+
+    void unlink(Subscription& sub, int cell) {
+        auto& list = subscribers[cell];
+        list.erase(std::find(list.begin(), list.end(), &sub));
+    }
+
+    // Both tolerate repeats: a cell can be subscribed in the same tick an entity moves into it
+    static void addRelevant(Subscription& sub, EntityID id) {
+        if (!sub.slotOf.emplace(id, static_cast<uint32_t>(sub.relevant.size())).second) return;
+        sub.relevant.push_back(id);
+    }
+
+    static void removeRelevant(Subscription& sub, EntityID id) {
+        auto it = sub.slotOf.find(id);
+        if (it == sub.slotOf.end()) return;
+        uint32_t slot = it->second;
+        sub.slotOf.erase(it);
+        if (slot != sub.relevant.size() - 1) {
+            sub.relevant[slot] = sub.relevant.back();
+            sub.slotOf[sub.relevant[slot]] = slot;
+        }
+        sub.relevant.pop_back();
+    }
+};
+
+// One end of a connection: the host keeps one per client, a client keeps one for the host
+struct RemoteClient {
+    IPaddress address{};
+    ReliableTransport transport;
+    LinkSimulator link;
+    std::vector<uint8_t> inbox;
+    std::deque<OutgoingDatagram> queue; // Waiting for the socket to accept them
+    uint32_t ackedSequence = 0;
+    bool greeted = false, spectator = false;
+    int player = -1; // 1..MAX_PLAYERS-1 for players; the host is player 0
+    Uint32 lastHeard = 0;
+    TileRect camera{0, 0, SCREEN_WIDTH / TILE_SIZE - 1, SCREEN_HEIGHT / TILE_SIZE - 1}; // Host: tiles the client shows
+    bool cameraMoved = false;
+    InterestManager::Subscription* interest = nullptr;
+    uint32_t subscribedSequence = 0; // First snapshot of its current subscription; older acks are no baseline
+};
+
+// Network: messages are length-prefixed frames [u32 payload length][u8 type][payload] carried by the UDP
+// transport; snapshots and snapshot acks go unreliable (newest wins), everything else reliable and ordered
+enum MessageType : uint8_t { MSG_COMMAND = 1, MSG_SNAPSHOT = 2, MSG_ACK = 3, MSG_START = 4, MSG_TICK = 5, MSG_HELLO = 6,
+                          MSG_WELCOME = 7, MSG_VIEW = 8 };
+
+class Network {
+public:
+    DatagramSocket socket;
+    bool isServer = false;
+    bool spectate = false;                            // Client: join as a spectator
+    std::vector<std::unique_ptr<RemoteClient>> peers; // Host: every client; client: just the host
+    LinkSimulator link;                               // Loss/latency settings copied to every new peer
+    CommandRing commandQueue;                         // Commands from peers, drained into the simulation each frame
+    size_t commandsDropped = 0;
+    std::queue<TickMessage> tickMessages;
+    bool startReceived = false;
+    uint32_t startSeed = 0;
+
+    int localPlayer = 0;                              // Client: slot the host gave us, -1 for a spectator
+
+    // Host: players see their faction's entities and those on tiles it sees, spectators everything, both only
+    // around their camera and forces
+    static const int VIEW_ALL = FACTION_COUNT;
+    std::vector<uint8_t> outbox;
+    InterestManager interest;
+    SnapshotHistory received{SNAPSHOT_HISTORY * 2}; // Client: decoded snapshots, outlives the host's window
+    NetSnapshot view, applied;
+    uint32_t sequence = 0;
+    size_t bytesSent = 0, snapshotsDropped = 0;
+
+    Network() {
+        if (SDLNet_Init() < 0) std::cerr << "SDLNet_Init failed: " << SDLNet_GetError() << std::endl;
+    }
+
+    void initServer() {
+        if (!socket.open(NET_PORT)) std::cerr << "Could not open UDP port " << NET_PORT << std::endl;
+        isServer = true;
+    }
+
+    void initClient(const char* host) {
+        IPaddress address;
+        if (SDLNet_ResolveHost(&address, host, NET_PORT) != 0 || !socket.open(0)) return;
+        RemoteClient& server = addPeer(address, SDL_GetTicks());
+        server.greeted = true;
+        WireWriter w = beginFrame(MSG_HELLO);
+        w.u8(spectate);
+        sendFrame(server);
+    }
+
+    // Host: some player has joined; client: datagrams have arrived from the host
+    bool connected() const {
+        for (const auto& peer : peers) {
+            if (peer->greeted && !peer->spectator && peer->transport.packetsReceived > 0) return true;
         }
+        return false;
     }
-    EntityID id; // Added to store owning entity ID
-};
-struct BuildingComponent { std::vector<ComponentType> produceableUnits; std::map<ComponentType, std::vector<ComponentType>> techRequirements; };
 
-using EntityID = size_t;
+    // The peer lockstep exchanges ticks with: the first player slot on the host, the host on a client
+    RemoteClient* lockstepPeer() {
+        for (auto& peer : peers) {
+            if (peer->greeted && (!isServer || peer->player == 1)) return peer.get();
+        }
+        return nullptr;
+    }
 
-// Command for Multiplayer
-struct Command {
-    Uint32 timestamp;
-    std::string type;
-    EntityID id;
-    int x, y;
-};
+    // Peer whose link stats are shown on screen
+    const RemoteClient* primaryPeer() const {
+        for (const auto& peer : peers) {
+            if (peer->greeted && !peer->spectator) return peer.get();
+        }
+        return nullptr;
+    }
 
-// ECS System
-class ECS {
-public:
-    std::unordered_map<EntityID, PositionComponent> positions;
-    std::unordered_map<EntityID, RenderComponent> renders;
-    std::unordered_map<EntityID, HealthComponent> healths;
-    std::unordered_map<EntityID, MovementComponent> movements;
-    std::unordered_map<EntityID, WorkerComponent> workers;
-    std::unordered_map<EntityID, AttackComponent> attacks;
-    std::unordered_map<EntityID, BuildingComponent> buildings;
-    std::unordered_map<EntityID, Faction> factions;
-    std::vector<EntityID> entities;
-    EntityID nextID = 0;
-
-    EntityID createEntity() {
-        EntityID id = nextID++;
-        entities.push_back(id);
-        return id;
+    // Sends everything queued this frame: reliable resends, the newest unreliable messages and acks
+    void flush() {
+        if (!socket.isOpen()) return;
+        Uint32 now = SDL_GetTicks();
+        for (auto& peer : peers) {
+            RemoteClient& client = *peer;
+            client.transport.flush(now, [&](const std::vector<uint8_t>& datagram) { client.link.send({datagram, nullptr, 0, 0, false}, now); });
+            client.link.release(now, [&](OutgoingDatagram& datagram) { client.queue.push_back(std::move(datagram)); });
+        }
+        drainQueues();
     }
 
-    void destroyEntity(EntityID id) {
-        positions.erase(id);
-        renders.erase(id);
-        healths.erase(id);
-        movements.erase(id);
-        workers.erase(id);
-        attacks.erase(id);
-        buildings.erase(id);
-        factions.erase(id);
-        entities.erase(std::remove(entities.begin(), entities.end(), id), entities.end());
-    }
-
-    ~ECS() {
-        entities.clear();
-        positions.clear();
-        renders.clear();
-        healths.clear();
-        movements.clear();
-        workers.clear();
-        attacks.clear();
-        buildings.clear();
-        factions.clear();
+    // Commands go to every player; spectators only watch
+    void sendCommand(const Command& cmd) {
+        for (auto& peer : peers) {
+            if (peer->spectator || !peer->greeted) continue;
+            WireWriter w = beginFrame(MSG_COMMAND);
+            writeCommand(w, cmd);
+            sendFrame(*peer);
+        }
     }
-};
 
-// Entity Configuration for Scalability
-struct EntityConfig {
-    Faction faction;
-    int x, y;
-    int health;
-    bool isWorker;
-    bool isBuilding;
-    std::vector<ComponentType> produceableUnits;
-    std::string textureName;
-};
+    // Lockstep: the host hands the client the shared seed, then both sides exchange only tick messages
+    void sendStart(uint32_t seed) {
+        RemoteClient* peer = lockstepPeer();
+        if (!peer) return;
+        WireWriter w = beginFrame(MSG_START);
+        w.u32(seed);
+        sendFrame(*peer);
+    }
 
-// Spatial Grid with Quadtree-like Optimization
-class SpatialGrid {
-public:
-    std::vector<std::vector<std::vector<EntityID>>> grid;
-    int cellSize;
+    void sendTick(const TickMessage& msg) {
+        RemoteClient* peer = lockstepPeer();
+        if (!peer) return;
+        WireWriter w = beginFrame(MSG_TICK);
+        w.varint(msg.tick);
+        w.u8(msg.hasChecksum);
+        w.varint(msg.checksumTick);
+        w.varint(msg.checksum);
+        w.varint(msg.commands.size());
+        for (const auto& cmd : msg.commands) writeCommand(w, cmd);
+        sendFrame(*peer);
+    }
 
-    SpatialGrid(int mapWidth, int mapHeight) {
-        cellSize = std::max(GRID_CELL_SIZE, std::max(mapWidth, mapHeight) / 10);
-        grid.resize((mapHeight + cellSize - 1) / cellSize, std::vector<std::vector<EntityID>>((mapWidth + cellSize - 1) / cellSize));
+    // Client: tells the host which tiles the camera shows, so snapshots carry what is around them
+    void sendView(const TileRect& tiles) {
+        for (auto& peer : peers) {
+            if (isServer || !peer->greeted) continue;
+            WireWriter w = beginFrame(MSG_VIEW);
+            w.svarint(tiles.minX);
+            w.svarint(tiles.minY);
+            w.svarint(tiles.maxX);
+            w.svarint(tiles.maxY);
+            sendFrame(*peer);
+        }
     }
 
-    void update(const ECS& ecs) {
-        for (auto& row : grid) for (auto& cell : row) cell.clear();
-        for (auto id : ecs.entities) {
-            if (ecs.positions.count(id)) {
-                int gx = ecs.positions.at(id).x / cellSize;
-                int gy = ecs.positions.at(id).y / cellSize;
-                if (gx >= 0 && gx < static_cast<int>(grid[0].size()) && gy >= 0 && gy < static_cast<int>(grid.size())) {
-                    grid[gy][gx].push_back(id);
-                    std::sort(grid[gy][gx].begin(), grid[gy][gx].end(), [&](EntityID a, EntityID b) {
-                        return ecs.positions[a].x + ecs.positions[a].y * MAP_WIDTH < 
-                               ecs.positions[b].x + ecs.positions[b].y * MAP_WIDTH;
-                    });
+    // Each client gets a delta against the newest snapshot of its subscription it acknowledged, or a full
+    // snapshot if that is too old. A subscription holds the entities around the client's camera and its faction's
+    // forces (see InterestManager); a player's also leaves out enemies in the fog, so those are never sent (and
+    // vanish client-side when they leave sight). Clients of one subscription that acked the same snapshot share
+    // one encoded buffer, so N spectators watching the same spot cost one serialization sent N times.
+    void sendState(const ECS& ecs, const VisibilityMap& visibility) {
+        if (peers.empty()) return;
+        Uint32 now = SDL_GetTicks();
+        sequence++;
+        interest.update(ecs, visibility.width, visibility.height);
+        for (auto& peer : peers) {
+            RemoteClient& client = *peer;
+            if (!client.greeted || (client.interest && !client.cameraMoved)) continue;
+            InterestManager::Subscription* sub = client.interest ? interest.moveCamera(client.interest, client.camera) 
+                                                                 : interest.join(viewOf(client), client.camera);
+            if (sub != client.interest) client.subscribedSequence = sequence;
+            client.interest = sub;
+            client.cameraMoved = false;
+        }
+
+        static const NetSnapshot none;
+        for (auto& sub : interest.subscriptions) {
+            interest.build(*sub, ecs, visibility, sequence, view);
+            encodedByBaseline.clear();
+            for (auto& peer : peers) {
+                RemoteClient& client = *peer;
+                if (client.interest != sub.get()) continue;
+                const NetSnapshot* baseline = client.ackedSequence >= client.subscribedSequence ? sub->sent.find(client.ackedSequence) : nullptr;
+                uint32_t baseSeq = baseline ? client.ackedSequence : 0;
+                std::shared_ptr<const std::vector<uint8_t>> encoded;
+                for (const auto& entry : encodedByBaseline) {
+                    if (entry.baseSeq == baseSeq) encoded = entry.encoded;
                 }
+                if (!encoded) {
+                    auto buffer = std::make_shared<std::vector<uint8_t>>();
+                    WireWriter w = beginFrame(MSG_SNAPSHOT, *buffer);
+                    w.varint(sequence);
+                    w.varint(baseSeq);
+                    encodeDelta(baseline ? *baseline : none, view, w);
+                    finishFrame(*buffer);
+                    encoded = buffer;
+                    encodedByBaseline.push_back({baseSeq, encoded});
+                }
+                queueSnapshot(client, encoded, now);
             }
+            sub->sent.store(sequence).swap(view);
         }
     }
 
-    std::vector<EntityID> getEntitiesAt(int x, int y) {
-        int gx = x / cellSize;
-        int gy = y / cellSize;
-        if (gx >= 0 && gx < static_cast<int>(grid[0].size()) && gy >= 0 && gy < static_cast<int>(grid.size()))
-            return grid[gy][gx];
-        return {};
+    void receiveData(ECS& ecs, SDL_Texture* terranUnitTex, SDL_Texture* zergUnitTex, SDL_Texture* protossUnitTex, 
+                     SDL_Texture* resTex, SDL_Texture* terranCCTex, SDL_Texture* terranBarracksTex, 
+                     SDL_Texture* zergHatcheryTex, SDL_Texture* zergSpawningPoolTex, SDL_Texture* protossNexusTex, 
+                     SDL_Texture* protossGatewayTex) {
+        if (!socket.isOpen()) return;
+        Uint32 now = SDL_GetTicks();
+        bool readable, writable;
+        socket.wait(0, readable, writable);
+        if (writable) drainQueues();
+        if (readable) {
+            uint8_t datagram[PACKET_MTU];
+            size_t size;
+            IPaddress from;
+            while (socket.receive(datagram, sizeof(datagram), size, from)) {
+                RemoteClient* peer = findPeer(from);
+                if (!peer && isServer && peers.size() < MAX_CLIENTS && ReliableTransport::accepts(datagram, size)) peer = &addPeer(from, now);
+                if (!peer) continue;
+                if (peer->transport.receive(datagram, size, now, peer->inbox)) peer->lastHeard = now;
+            }
+        }
+
+        for (auto& peer : peers) {
+            handleFrames(*peer, ecs, terranUnitTex, zergUnitTex, protossUnitTex, resTex, terranCCTex, terranBarracksTex, 
+                         zergHatcheryTex, zergSpawningPoolTex);
+        }
+        if (isServer) {
+            auto timedOut = [&](const std::unique_ptr<RemoteClient>& peer) { return now - peer->lastHeard > CLIENT_TIMEOUT_MS; };
+            for (auto& peer : peers) {
+                if (timedOut(peer) && peer->interest) interest.leave(peer->interest);
+            }
+            peers.erase(std::remove_if(peers.begin(), peers.end(), timedOut), peers.end());
+        }
     }
-};
 
-// A* Pathfinding
-std::vector<Point> findPath(int startX, int startY, int endX, int endY, 
-                            const int (&map)[MAP_HEIGHT][MAP_WIDTH], const ECS& ecs) {
-    std::vector<Point> path;
-    std::map<Point, Point> cameFrom;
-    std::map<Point, int> costSoFar;
-    auto heuristic = [](Point a, Point b) { return abs(a.x - b.x) + abs(a.y - b.y); };
+    ~Network() {
+        socket.close();
+        SDLNet_Quit();
+    }
 
-    Point start = {startX, startY};
-    Point goal = {endX, endY};
-    std::priority_queue<std::pair<int, Point>, std::vector<std::pair<int, Point>>, std::greater<>> frontier;
-    frontier.push({0, start});
-    cameFrom[start] = start;
-    costSoFar[start] = 0;
+private:
+    struct EncodedSnapshot { uint32_t baseSeq; std::shared_ptr<const std::vector<uint8_t>> encoded; };
+    std::vector<EncodedSnapshot> encodedByBaseline;
 
-    while (!frontier.empty()) {
-        Point current = frontier.top().second;
-        frontier.pop();
+    static int viewOf(const RemoteClient& client) { return client.spectator ? VIEW_ALL : playerFaction(client.player); }
 
-        if (current == goal) break;
+    RemoteClient* findPeer(const IPaddress& address) {
+        for (auto& peer : peers) {
+            if (peer->address.host == address.host && peer->address.port == address.port) return peer.get();
+        }
+        return nullptr;
+    }
 
-        for (int dx = -1; dx <= 1; dx++) {
-            for (int dy = -1; dy <= 1; dy++) {
-                if (dx == 0 && dy == 0) continue;
-                Point next = {current.x + dx, current.y + dy};
-                if (next.x < 0 || next.x >= MAP_WIDTH || next.y < 0 || next.y >= MAP_HEIGHT) continue;
-
-                bool isObstacle = false;
-                for (auto id : ecs.entities) {
-                    if (ecs.buildings.count(id) && ecs.positions.at(id).x == next.x && ecs.positions.at(id).y == next.y) {
-                        isObstacle = true;
-                        break;
-                    }
-                }
-                if (isObstacle) continue;
+    RemoteClient& addPeer(const IPaddress& address, Uint32 now) {
+        auto peer = std::make_unique<RemoteClient>();
+        peer->address = address;
+        peer->lastHeard = now;
+        peer->link.loss = link.loss;
+        peer->link.latencyMs = link.latencyMs;
+        peer->link.jitterMs = link.jitterMs;
+        peer->link.rng = SimRandom(link.rng.state + peers.size());
+        peers.push_back(std::move(peer));
+        return *peers.back();
+    }
 
-                int newCost = costSoFar[current] + 1;
-                if (costSoFar.find(next) == costSoFar.end() || newCost < costSoFar[next]) {
-                    costSoFar[next] = newCost;
-                    int priority = newCost + heuristic(next, goal);
-                    frontier.push({priority, next});
-                    cameFrom[next] = current;
+    // Hands queued datagrams to the socket until it refuses one; epoll reports when it can take more
+    void drainQueues() {
+        bool blocked = false;
+        for (auto& peer : peers) {
+            while (!peer->queue.empty()) {
+                const OutgoingDatagram& datagram = peer->queue.front();
+                const uint8_t* body = datagram.body ? datagram.body->data() + datagram.offset : nullptr;
+                DatagramSocket::SendResult result = socket.send(peer->address, datagram.head.data(), datagram.head.size(), body, datagram.size);
+                if (result == DatagramSocket::WOULD_BLOCK) {
+                    blocked = true;
+                    break;
                 }
+                if (result == DatagramSocket::SENT) bytesSent += datagram.head.size() + datagram.size;
+                peer->queue.pop_front();
             }
         }
+        socket.watchWritable(blocked);
     }
 
-    Point current = goal;
-    while (!(current == start)) {
-        if (cameFrom.find(current) == cameFrom.end()) break; // Path not found
-        path.push_back(current);
-        current = cameFrom[current];
+    // Newest wins: fragments of older snapshots still queued are obsolete, and a client whose queue stays
+    // full skips snapshots instead of holding up the simulation
+    void queueSnapshot(RemoteClient& client, const std::shared_ptr<const std::vector<uint8_t>>& encoded, Uint32 now) {
+        client.queue.erase(std::remove_if(client.queue.begin(), client.queue.end(), 
+                                          [](const OutgoingDatagram& datagram) { return datagram.droppable; }), client.queue.end());
+        if (client.queue.size() >= SEND_QUEUE_LIMIT) {
+            snapshotsDropped++;
+            return;
+        }
+        client.transport.sendShared(MSG_SNAPSHOT, *encoded, now, [&](std::vector<uint8_t>&& head, size_t offset, size_t size) {
+            client.link.send({std::move(head), encoded, offset, size, true}, now);
+        });
+        client.link.release(now, [&](OutgoingDatagram& datagram) { client.queue.push_back(std::move(datagram)); });
     }
-    std::reverse(path.begin(), path.end());
-    return path;
-}
 
-// AI Controller
-class AIController {
-public:
-    std::vector<EntityID> aiUnits;
+    void handleFrames(RemoteClient& peer, ECS& ecs, SDL_Texture* terranUnitTex, SDL_Texture* zergUnitTex, 
+                      SDL_Texture* protossUnitTex, SDL_Texture* resTex, SDL_Texture* terranCCTex, 
+                      SDL_Texture* terranBarracksTex, SDL_Texture* zergHatcheryTex, SDL_Texture* zergSpawningPoolTex) {
+        std::vector<uint8_t>& inbox = peer.inbox;
+        size_t offset = 0;
+        while (inbox.size() - offset >= 5) {
+            WireReader header(inbox.data() + offset, 4);
+            uint32_t length = header.u32();
+            if (inbox.size() - offset - 4 < length) break; // Frame not complete yet
+            if (length == 0) { offset += 4; continue; }
+            WireReader r(inbox.data() + offset + 5, length - 1);
+            MessageType type = static_cast<MessageType>(inbox[offset + 4]);
+            offset += 4 + length;
 
-    void update(ECS& ecs, const int (&map)[MAP_HEIGHT][MAP_WIDTH], int& minerals) {
-        if (rand() % 100 < 10) {
-            if (!aiUnits.empty()) {
-                EntityID workerID = aiUnits[rand() % aiUnits.size()];
-                if (ecs.workers.count(workerID) && !ecs.workers[workerID].isCarrying && ecs.workers[workerID].targetResource == 0) {
-                    for (auto id : ecs.entities) {
-                        if (!ecs.workers.count(id) && !ecs.buildings.count(id) && ecs.healths[id].health == 100) {
-                            ecs.workers[workerID].targetResource = id;
-                            ecs.movements[workerID].path = findPath(ecs.positions[workerID].x, ecs.positions[workerID].y, 
-                                                                    ecs.positions[id].x, ecs.positions[id].y, map, ecs);
-                            break;
-                        }
-                    }
-                }
+            if (type == MSG_HELLO && isServer && !peer.greeted) {
+                greet(peer, r.u8() != 0);
+            } else if (!peer.greeted) {
+                continue; // Nothing but the hello counts until the client has a role
+            } else if (type == MSG_SNAPSHOT && !isServer) {
+                uint32_t seq = static_cast<uint32_t>(r.varint());
+                uint32_t baseSeq = static_cast<uint32_t>(r.varint());
+                static const NetSnapshot none;
+                const NetSnapshot* baseline = baseSeq ? received.find(baseSeq) : &none;
+                if (!baseline) continue; // Baseline already evicted; the next full snapshot resyncs
+                NetSnapshot decoded;
+                if (!decodeDelta(*baseline, r, decoded)) continue;
+                applySnapshot(ecs, decoded, terranUnitTex, zergUnitTex, protossUnitTex, resTex, terranCCTex, 
+                              terranBarracksTex, zergHatcheryTex, zergSpawningPoolTex);
+                received.store(seq).swap(decoded);
+                WireWriter w = beginFrame(MSG_ACK);
+                w.varint(seq);
+                sendFrame(peer);
+            } else if (type == MSG_VIEW && isServer) {
+                // At most a screen's worth of tiles, so no client can subscribe to the whole map
+                TileRect camera;
+                camera.minX = static_cast<int>(r.svarint());
+                camera.minY = static_cast<int>(r.svarint());
+                camera.maxX = std::min(static_cast<int>(r.svarint()), camera.minX + SCREEN_WIDTH / TILE_SIZE - 1);
+                camera.maxY = std::min(static_cast<int>(r.svarint()), camera.minY + SCREEN_HEIGHT / TILE_SIZE - 1);
+                if (!r.ok || camera.minX < 0 || camera.minY < 0 || camera.maxX < camera.minX || camera.maxY < camera.minY) continue;
+                peer.camera = camera;
+                peer.cameraMoved = true;
+            } else if (type == MSG_ACK) {
+                peer.ackedSequence = std::max(peer.ackedSequence, static_cast<uint32_t>(r.varint()));
+            } else if (type == MSG_COMMAND && !peer.spectator) {
+                Command cmd = readCommand(r);
+                if (r.ok && !commandQueue.push(cmd)) commandsDropped++;
+            } else if (type == MSG_WELCOME && !isServer) {
+                int player = static_cast<int>(r.svarint());
+                if (r.ok) localPlayer = player;
+            } else if (type == MSG_START && !isServer) {
+                startSeed = r.u32();
+                startReceived = r.ok;
+            } else if (type == MSG_TICK && &peer == lockstepPeer()) {
+                TickMessage msg;
+                msg.tick = static_cast<uint32_t>(r.varint());
+                msg.hasChecksum = r.u8() != 0;
+                msg.checksumTick = static_cast<uint32_t>(r.varint());
+                msg.checksum = r.varint();
+                uint64_t count = r.varint();
+                for (uint64_t i = 0; i < count && r.ok; i++) msg.commands.push_back(readCommand(r));
+                if (r.ok) tickMessages.push(std::move(msg));
             }
         }
-        for (auto id : aiUnits) {
-            if (ecs.attacks.count(id) && rand() % 100 < 5) {
-                for (auto target : ecs.entities) {
-                    if (ecs.factions[id] != ecs.factions[target] && ecs.attacks.count(target)) {
-                        ecs.attacks[id].damage = ecs.factions[id] == PROTOSS ? 8 : 6;
-                        ecs.attacks[id].id = id; // Set owning ID
-                        ecs.attacks[id].attack(ecs, target);
-                    }
+        inbox.erase(inbox.begin(), inbox.begin() + offset);
+    }
+
+    // Gives the client a free player slot, or makes it a spectator when it asked to or the match is full, and
+    // tells it which (its slot decides the faction whose fog it sees)
+    void greet(RemoteClient& peer, bool wantsSpectator) {
+        peer.greeted = true;
+        peer.spectator = true;
+        for (int slot = 1; slot < MAX_PLAYERS && !wantsSpectator; slot++) {
+            bool taken = false;
+            for (const auto& other : peers) taken |= other->player == slot;
+            if (taken) continue;
+            peer.player = slot;
+            peer.spectator = false;
+            break;
+        }
+        WireWriter w = beginFrame(MSG_WELCOME);
+        w.svarint(peer.spectator ? -1 : peer.player);
+        sendFrame(peer);
+    }
+
+    WireWriter beginFrame(MessageType type) { return beginFrame(type, outbox); }
+
+    WireWriter beginFrame(MessageType type, std::vector<uint8_t>& buffer) {
+        buffer.clear();
+        buffer.resize(4);
+        buffer.push_back(type);
+        return WireWriter(buffer);
+    }
+
+    static void finishFrame(std::vector<uint8_t>& buffer) {
+        uint32_t length = static_cast<uint32_t>(buffer.size() - 4);
+        for (int i = 0; i < 4; i++) buffer[i] = static_cast<uint8_t>(length >> (i * 8));
+    }
+
+    void sendFrame(RemoteClient& peer) {
+        finishFrame(outbox);
+        MessageType type = static_cast<MessageType>(outbox[4]);
+        if (type == MSG_SNAPSHOT || type == MSG_ACK) peer.transport.sendUnreliable(type, outbox);
+        else peer.transport.sendReliable(outbox);
+    }
+
+    // Diffs the decoded snapshot against what the ECS already shows and applies only the differences
+    void applySnapshot(ECS& ecs, const NetSnapshot& next, SDL_Texture* terranUnitTex, SDL_Texture* zergUnitTex, 
+                       SDL_Texture* protossUnitTex, SDL_Texture* resTex, SDL_Texture* terranCCTex, 
+                       SDL_Texture* terranBarracksTex, SDL_Texture* zergHatcheryTex, SDL_Texture* zergSpawningPoolTex) {
+        size_t a = 0;
+        for (const auto& state : next) {
+            while (a < applied.size() && entityIndex(applied[a].id) < entityIndex(state.id)) ecs.queueDestroy(applied[a++].id);
+            const NetEntityState* old = a < applied.size() && applied[a].id == state.id ? &applied[a] : nullptr;
+            if (a < applied.size() && entityIndex(applied[a].id) == entityIndex(state.id)) {
+                if (!old) ecs.queueDestroy(applied[a].id);
+                a++;
+            }
+            if (old && old->x == state.x && old->y == state.y && old->health == state.health && old->faction == state.faction) continue;
+
+            EntityID id = state.id;
+            Faction faction = static_cast<Faction>(state.faction);
+            if (!ecs.has<PositionComponent>(id)) {
+                if (state.kind == 'W') {
+                    ecs.createEntityWithID(id, WORKER_ARCHETYPE);
+                    ecs.at<AttackComponent>(id) = {faction == PROTOSS ? 8 : 6, 1};
+                    ecs.at<RenderComponent>(id) = {faction == TERRAN ? terranUnitTex : faction == ZERG ? zergUnitTex : protossUnitTex};
+                } else if (state.kind == 'B') {
+                    ecs.createEntityWithID(id, BUILDING_ARCHETYPE);
+                    ecs.at<RenderComponent>(id) = {faction == TERRAN && state.x == 5 ? terranCCTex : faction == TERRAN ? terranBarracksTex : 
+                                                   faction == ZERG && state.x == 15 ? zergHatcheryTex : zergSpawningPoolTex};
+                } else {
+                    ecs.createEntityWithID(id, RESOURCE_ARCHETYPE);
+                    ecs.at<RenderComponent>(id) = {resTex};
                 }
             }
+            ecs.at<PositionComponent>(id) = tilePosition(state.x, state.y);
+            ecs.at<HealthComponent>(id) = {state.health};
+            ecs.at<Faction>(id) = faction;
         }
+        while (a < applied.size()) ecs.queueDestroy(applied[a++].id);
+        ecs.flushDestroyed();
+        applied = next;
     }
 };
 
-// Network
-class Network {
+// Terrain Cache: the map is pre-rendered into chunk textures of TERRAIN_CHUNK_TILES square, redrawn only when
+// one of their tiles changes or the renderer drops its targets, so the ground costs one copy per visible chunk.
+// Chunks are created when first seen; past TERRAIN_CACHED_CHUNKS, those away from the view are freed, so a large
+// map never holds more than a screenful or so. Without render-target support it falls back to drawing tiles one by one.
+class TerrainCache {
 public:
-    TCPsocket server = nullptr, client = nullptr;
-    SDLNet_SocketSet set = nullptr;
-    bool isServer = false;
-    std::queue<Command> commandQueue;
+    ~TerrainCache() { destroy(); }
 
-    Network() {
-        if (SDLNet_Init() < 0) std::cerr << "SDLNet_Init failed: " << SDLNet_GetError() << std::endl;
-        set = SDLNet_AllocSocketSet(2);
+    void reset(int mapWidth, int mapHeight) {
+        destroy();
+        width = mapWidth;
+        height = mapHeight;
+        cols = (width + TERRAIN_CHUNK_TILES - 1) / TERRAIN_CHUNK_TILES;
+        rows = (height + TERRAIN_CHUNK_TILES - 1) / TERRAIN_CHUNK_TILES;
+        chunks.assign(cols * rows, Chunk{});
     }
 
-    void initServer() {
-        IPaddress ip;
-        if (SDLNet_ResolveHost(&ip, nullptr, 12345) == 0) {
-            server = SDLNet_TCP_Open(&ip);
-            if (server) SDLNet_TCP_AddSocket(set, server);
-            isServer = true;
-        }
+    void invalidateTile(int x, int y) {
+        if (x >= 0 && y >= 0 && x < width && y < height) chunks[y / TERRAIN_CHUNK_TILES * cols + x / TERRAIN_CHUNK_TILES].dirty = true;
     }
+    void invalidateAll() { for (auto& chunk : chunks) chunk.dirty = true; }
 
-    void initClient(const char* host) {
-        IPaddress ip;
-        if (SDLNet_ResolveHost(&ip, host, 12345) == 0) {
-            client = SDLNet_TCP_Open(&ip);
-            if (client) SDLNet_TCP_AddSocket(set, client);
+    // tileAt(x, y) gives the terrain index of a tile; returns the number of draw calls issued
+    template <typename TileAt>
+    int draw(SDL_Renderer* renderer, SDL_Texture* const* tileTextures, TileAt tileAt, const SDL_Rect& view) {
+        int calls = 0;
+        int cx0 = std::max(0, view.x / (TERRAIN_CHUNK_TILES * TILE_SIZE));
+        int cy0 = std::max(0, view.y / (TERRAIN_CHUNK_TILES * TILE_SIZE));
+        int cx1 = std::min(cols - 1, (view.x + view.w - 1) / (TERRAIN_CHUNK_TILES * TILE_SIZE));
+        int cy1 = std::min(rows - 1, (view.y + view.h - 1) / (TERRAIN_CHUNK_TILES * TILE_SIZE));
+        bool targets = SDL_RenderTargetSupported(renderer);
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                Chunk& chunk = chunks[cy * cols + cx];
+                int x0 = cx * TERRAIN_CHUNK_TILES, y0 = cy * TERRAIN_CHUNK_TILES;
+                int tilesX = std::min(TERRAIN_CHUNK_TILES, width - x0), tilesY = std::min(TERRAIN_CHUNK_TILES, height - y0);
+                SDL_Rect dest = {x0 * TILE_SIZE - view.x, y0 * TILE_SIZE - view.y, tilesX * TILE_SIZE, tilesY * TILE_SIZE};
+                if (targets && !chunk.texture) {
+                    chunk.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, dest.w, dest.h);
+                    chunk.dirty = true;
+                    if (chunk.texture) liveChunks++;
+                }
+                if (!chunk.texture) {
+                    calls += drawTiles(renderer, tileTextures, tileAt, x0, y0, tilesX, tilesY, dest.x, dest.y);
+                    continue;
+                }
+                if (chunk.dirty) {
+                    SDL_SetRenderTarget(renderer, chunk.texture);
+                    calls += drawTiles(renderer, tileTextures, tileAt, x0, y0, tilesX, tilesY, 0, 0);
+                    SDL_SetRenderTarget(renderer, nullptr);
+                    chunk.dirty = false;
+                }
+                SDL_RenderCopy(renderer, chunk.texture, nullptr, &dest);
+                calls++;
+            }
         }
+        if (liveChunks > TERRAIN_CACHED_CHUNKS) evict(cx0 - 1, cy0 - 1, cx1 + 1, cy1 + 1);
+        return calls;
     }
 
-    void sendCommand(const Command& cmd) {
-        std::string data = "CMD " + std::to_string(cmd.timestamp) + " " + cmd.type + " " + 
-                           std::to_string(cmd.id) + " " + std::to_string(cmd.x) + " " + std::to_string(cmd.y);
-        TCPsocket sock = isServer && client ? client : server;
-        if (sock) SDLNet_TCP_Send(sock, data.c_str(), data.size() + 1);
+    void destroy() {
+        for (auto& chunk : chunks) {
+            if (chunk.texture) SDL_DestroyTexture(chunk.texture);
+            chunk = Chunk{};
+        }
+        liveChunks = 0;
     }
 
-    void sendState(const ECS& ecs) {
-        std::string data = "STATE " + std::to_string(ecs.entities.size()) + " ";
-        for (auto id : ecs.entities) {
-            data += std::to_string(id) + "," +
-                    std::to_string(ecs.positions[id].x) + "," + 
-                    std::to_string(ecs.positions[id].y) + "," + 
-                    std::to_string(static_cast<int>(ecs.factions[id])) + "," +
-                    (ecs.workers.count(id) ? "W" : ecs.buildings.count(id) ? "B" : "R") + ";";
+private:
+    struct Chunk { SDL_Texture* texture = nullptr; bool dirty = true; };
+    std::vector<Chunk> chunks;
+    int width = 0, height = 0, cols = 0, rows = 0;
+    int liveChunks = 0;
+
+    // Frees every chunk texture outside the given chunk range (the view plus a margin for scrolling back)
+    void evict(int cx0, int cy0, int cx1, int cy1) {
+        for (int cy = 0; cy < rows; cy++) {
+            for (int cx = 0; cx < cols; cx++) {
+                Chunk& chunk = chunks[cy * cols + cx];
+                if (!chunk.texture || (cx >= cx0 && cx <= cx1 && cy >= cy0 && cy <= cy1)) continue;
+                SDL_DestroyTexture(chunk.texture);
+                chunk = Chunk{};
+                liveChunks--;
+            }
         }
-        TCPsocket sock = isServer && client ? client : server;
-        if (sock) SDLNet_TCP_Send(sock, data.c_str(), data.size() + 1);
     }
 
-    void receiveData(ECS& ecs, SDL_Texture* terranUnitTex, SDL_Texture* zergUnitTex, SDL_Texture* protossUnitTex, 
-                     SDL_Texture* resTex, SDL_Texture* terranCCTex, SDL_Texture* terranBarracksTex, 
-                     SDL_Texture* zergHatcheryTex, SDL_Texture* zergSpawningPoolTex, SDL_Texture* protossNexusTex, 
-                     SDL_Texture* protossGatewayTex) {
-        char buffer[2048];
-        TCPsocket sock = isServer ? server : client;
-        if (sock && SDLNet_CheckSockets(set, 0) > 0 && SDLNet_SocketReady(sock)) {
-            int received = SDLNet_TCP_Recv(sock, buffer, sizeof(buffer) - 1);
-            if (received > 0) {
-                buffer[received] = '\0'; // Ensure null termination
-                if (strncmp(buffer, "STATE", 5) == 0) {
-                    int entityCount;
-                    if (sscanf(buffer + 6, "%d", &entityCount) != 1) return;
-                    char* token = strtok(buffer + 8, ";");
-                    std::map<EntityID, bool> updated;
-                    while (token) {
-                        EntityID id;
-                        int x, y, fac;
-                        char type;
-                        if (sscanf(token, "%zu,%d,%d,%d,%c", &id, &x, &y, &fac, &type) != 5) break;
-                        Faction faction = static_cast<Faction>(fac);
-                        if (!ecs.positions.count(id)) {
-                            ecs.createEntity();
-                            ecs.entities.back() = id;
-                            if (type == 'W') {
-                                ecs.workers[id] = WorkerComponent{};
-                                ecs.attacks[id] = {faction == PROTOSS ? 8 : 6, 1, id};
-                                ecs.renders[id] = {faction == TERRAN ? terranUnitTex : faction == ZERG ? zergUnitTex : protossUnitTex};
-                            } else if (type == 'B') {
-                                ecs.buildings[id] = BuildingComponent{};
-                                ecs.renders[id] = {faction == TERRAN && x == 5 ? terranCCTex : faction == TERRAN ? terranBarracksTex : 
-                                                  faction == ZERG && x == 15 ? zergHatcheryTex : zergSpawningPoolTex};
-                            } else {
-                                ecs.renders[id] = {resTex};
-                            }
-                            ecs.healths[id] = {type == 'B' ? 200 : type == 'R' ? 100 : 40};
-                            ecs.movements[id] = {};
-                        }
-                        ecs.positions[id] = {x, y, static_cast<float>(x), static_cast<float>(y), SDL_GetTicks()};
-                        ecs.factions[id] = faction;
-                        updated[id] = true;
-                        token = strtok(NULL, ";");
-                    }
-                    for (auto it = ecs.entities.begin(); it != ecs.entities.end();) {
-                        if (!updated.count(*it)) ecs.destroyEntity(*it);
-                        else ++it;
-                    }
-                } else if (strncmp(buffer, "CMD", 3) == 0) {
-                    Command cmd;
-                    char typeBuf[16];
-                    if (sscanf(buffer + 4, "%u %15s %zu %d %d", &cmd.timestamp, typeBuf, &cmd.id, &cmd.x, &cmd.y) != 5) return;
-                    cmd.type = typeBuf;
-                    commandQueue.push(cmd);
-                }
+    template <typename TileAt>
+    static int drawTiles(SDL_Renderer* renderer, SDL_Texture* const* tileTextures, TileAt tileAt, int x0, int y0,
+                         int tilesX, int tilesY, int screenX, int screenY) {
+        for (int y = 0; y < tilesY; y++) {
+            for (int x = 0; x < tilesX; x++) {
+                SDL_Rect dest = {screenX + x * TILE_SIZE, screenY + y * TILE_SIZE, TILE_SIZE, TILE_SIZE};
+                SDL_RenderCopy(renderer, tileTextures[tileAt(x0 + x, y0 + y)], nullptr, &dest);
             }
         }
+        return tilesX * tilesY;
+    }
+};
+
+// A sprite is a rectangle of some texture, in pixels and in normalized coordinates for SDL_RenderGeometry
+struct Sprite { SDL_Texture* texture; SDL_Rect src; float u0, v0, u1, v1; };
+
+// Sprite Atlas: unit, building and resource images packed into one texture of TILE_SIZE cells. Entities keep
+// their own texture pointer as the sprite handle; find() maps it to its atlas cell, or to the texture itself
+// if the atlas could not be built.
+class SpriteAtlas {
+public:
+    SDL_Texture* texture = nullptr;
+
+    ~SpriteAtlas() { destroy(); }
+
+    // Takes ownership of image, which is packed by build()
+    void add(SDL_Texture* handle, SDL_Surface* image) {
+        pending.push_back({handle, image});
+        sprites.push_back({handle, {handle, {0, 0, 0, 0}, 0.0f, 0.0f, 1.0f, 1.0f}});
     }
 
-    void acceptConnection() {
-        if (isServer && !client) {
-            client = SDLNet_TCP_Accept(server);
-            if (client) SDLNet_TCP_AddSocket(set, client);
+    bool build(SDL_Renderer* renderer) {
+        int count = static_cast<int>(pending.size());
+        int columns = std::min(ATLAS_COLUMNS, std::max(1, count)), rowCount = (count + columns - 1) / columns;
+        int atlasWidth = columns * TILE_SIZE, atlasHeight = std::max(1, rowCount) * TILE_SIZE;
+        SDL_Surface* page = SDL_CreateRGBSurfaceWithFormat(0, atlasWidth, atlasHeight, 32, SDL_PIXELFORMAT_RGBA32);
+        if (page) {
+            for (int i = 0; i < count; i++) {
+                SDL_Rect cell = {i % columns * TILE_SIZE, i / columns * TILE_SIZE, TILE_SIZE, TILE_SIZE};
+                SDL_SetSurfaceBlendMode(pending[i].second, SDL_BLENDMODE_NONE); // Copy alpha as is
+                SDL_BlitScaled(pending[i].second, nullptr, page, &cell);
+                sprites[i].second = {nullptr, cell, static_cast<float>(cell.x) / atlasWidth, static_cast<float>(cell.y) / atlasHeight,
+                                     static_cast<float>(cell.x + cell.w) / atlasWidth, static_cast<float>(cell.y + cell.h) / atlasHeight};
+            }
+            texture = SDL_CreateTextureFromSurface(renderer, page);
+            SDL_FreeSurface(page);
+        }
+        if (texture) {
+            SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+            for (auto& entry : sprites) entry.second.texture = texture;
+        } else {
+            for (auto& entry : sprites) entry.second = {entry.first, {0, 0, 0, 0}, 0.0f, 0.0f, 1.0f, 1.0f};
         }
+        freePending();
+        return texture != nullptr;
     }
 
-    ~Network() {
-        if (server) SDLNet_TCP_Close(server);
-        if (client) SDLNet_TCP_Close(client);
-        if (set) SDLNet_FreeSocketSet(set);
-        SDLNet_Quit();
+    const Sprite* find(SDL_Texture* handle) const {
+        for (const auto& entry : sprites) if (entry.first == handle) return &entry.second;
+        return nullptr;
+    }
+
+    void destroy() {
+        freePending();
+        sprites.clear();
+        if (texture) SDL_DestroyTexture(texture);
+        texture = nullptr;
+    }
+
+private:
+    std::vector<std::pair<SDL_Texture*, SDL_Surface*>> pending;
+    std::vector<std::pair<SDL_Texture*, Sprite>> sprites; // A handful of entries, so a linear search is fastest
+
+    void freePending() {
+        for (auto& entry : pending) SDL_FreeSurface(entry.second);
+        pending.clear();
+    }
+};
+
+// Sprite Batch: quads collected over a frame, sorted by texture (stable, so draw order holds within one) and
+// submitted with one SDL_RenderGeometry call per texture; with the atlas that is one call for every entity
+class SpriteBatch {
+public:
+    void add(const Sprite& sprite, const SDL_FRect& dest) { quads.push_back({&sprite, dest}); }
+
+    // Returns the number of draw calls issued
+    int flush(SDL_Renderer* renderer) {
+        std::stable_sort(quads.begin(), quads.end(), [](const Quad& a, const Quad& b) { return a.sprite->texture < b.sprite->texture; });
+        int calls = 0;
+        for (size_t begin = 0; begin < quads.size();) {
+            SDL_Texture* texture = quads[begin].sprite->texture;
+            size_t end = begin;
+            while (end < quads.size() && quads[end].sprite->texture == texture) end++;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+            vertices.clear();
+            indices.clear();
+            for (size_t i = begin; i < end; i++) {
+                const Sprite& sprite = *quads[i].sprite;
+                const SDL_FRect& d = quads[i].dest;
+                int base = static_cast<int>(vertices.size());
+                SDL_Color white = {255, 255, 255, 255};
+                vertices.push_back({{d.x, d.y}, white, {sprite.u0, sprite.v0}});
+                vertices.push_back({{d.x + d.w, d.y}, white, {sprite.u1, sprite.v0}});
+                vertices.push_back({{d.x + d.w, d.y + d.h}, white, {sprite.u1, sprite.v1}});
+                vertices.push_back({{d.x, d.y + d.h}, white, {sprite.u0, sprite.v1}});
+                for (int corner : {0, 1, 2, 0, 2, 3}) indices.push_back(base + corner);
+            }
+            SDL_RenderGeometry(renderer, texture, vertices.data(), static_cast<int>(vertices.size()), indices.data(), static_cast<int>(indices.size()));
+            calls++;
+#else
+            for (size_t i = begin; i < end; i++) {
+                const Sprite& sprite = *quads[i].sprite;
+                const SDL_FRect& d = quads[i].dest;
+                SDL_Rect dest = {static_cast<int>(d.x), static_cast<int>(d.y), static_cast<int>(d.w), static_cast<int>(d.h)};
+                SDL_RenderCopy(renderer, texture, sprite.src.w ? &sprite.src : nullptr, &dest);
+                calls++;
+            }
+#endif
+            begin = end;
+        }
+        quads.clear();
+        return calls;
     }
+
+private:
+    struct Quad { const Sprite* sprite; SDL_FRect dest; };
+    std::vector<Quad> quads;
+    std::vector<SDL_Vertex> vertices;
+    std::vector<int> indices;
 };
 
 // Audio
@@ -397,9 +5041,14 @@ public:
     SDL_Window* window = nullptr;
     SDL_Renderer* renderer = nullptr;
     TTF_Font* font = nullptr;
-    int map[MAP_HEIGHT][MAP_WIDTH];
-    ECS ecs;
+    TileMap map;
+    Simulation sim;
+    ECS& ecs = sim.ecs;
     std::vector<EntityID> selectedUnits;
+    bool dragging = false;
+    int dragStartX = 0, dragStartY = 0, dragEndX = 0, dragEndY = 0;
+    CommandType armedOrder = CMD_MOVE; // T or B makes the next right-click a patrol or a barracks placement
+    int cameraX = 0, cameraY = 0; // Top-left of the view, in map pixels
     SDL_Texture* terrainTextures[2] = {nullptr, nullptr};
     SDL_Texture* terranUnitTexture = nullptr;
     SDL_Texture* zergUnitTexture = nullptr;
@@ -411,53 +5060,48 @@ public:
     SDL_Texture* zergSpawningPoolTexture = nullptr;
     SDL_Texture* protossNexusTexture = nullptr;
     SDL_Texture* protossGatewayTexture = nullptr;
-    int minerals = 50;
-    AIController ai;
+    TerrainCache terrain;
+    SpriteAtlas atlas;
+    SpriteBatch sprites;
+    int drawCalls = 0; // Terrain and sprite draw calls of the last frame
+    std::vector<SDL_Rect> fogRects;
     Network network;
     Audio audio;
-    SpatialGrid spatialGrid;
     bool isServer = true;
+    bool lockstep = false;
+    LockstepSession session;
+    ReplayWriter recorder;
+    SaveWriter saver;
+    std::string autosavePath;
+    uint32_t seed = 0;
+    Uint32 lastFrameTime = 0, tickAccumulator = 0;
 
-    Game() : spatialGrid(MAP_WIDTH, MAP_HEIGHT) {
-        srand(static_cast<unsigned>(time(nullptr)));
-        for (int y = 0; y < MAP_HEIGHT; y++) {
-            for (int x = 0; x < MAP_WIDTH; x++) {
-                map[y][x] = rand() % 2;
-            }
+    // The map decides the world's size; a generated one is redrawn from the seed. A save replaces the starting
+    // entities, and its seed redraws the map it was played on.
+    explicit Game(TileMap&& tiles, const SaveReader* save = nullptr) : map(std::move(tiles)), sim(map.width, map.height) {
+        if (save) {
+            seedSimulation(save->seed);
+            save->restore(sim);
+            return;
         }
+        seedSimulation(static_cast<uint32_t>(time(nullptr)));
         std::vector<EntityConfig> configs = {
             {TERRAN, 5, 5, 200, false, true, {}, "terran_command_center.png"},
             {TERRAN, 10, 10, 100, false, false, {}, "minerals.png"},
             {TERRAN, 6, 6, 40, true, false, {}, "terran_marine.png"},
             {TERRAN, 7, 7, 200, false, true, {UNIT}, "terran_barracks.png"},
-            {ZERG, 15, 15, 200, false, true, {}, "zerg_hatchery.png"},
-            {ZERG, 16, 16, 40, true, false, {}, "zerg_zergling.png"}
+            {ZERG, 15, 12, 200, false, true, {}, "zerg_hatchery.png"},
+            {ZERG, 16, 13, 40, true, false, {}, "zerg_zergling.png"}
         };
-        setupEntities(configs);
+        sim.setupEntities(configs);
     }
 
-    void setupEntities(const std::vector<EntityConfig>& configs) {
-        EntityID terranBase = 0, zergBase = 0;
-        for (const auto& config : configs) {
-            EntityID id = ecs.createEntity();
-            ecs.positions[id] = {config.x, config.y, static_cast<float>(config.x), static_cast<float>(config.y), SDL_GetTicks()};
-            ecs.healths[id] = {config.health};
-            ecs.factions[id] = config.faction;
-            ecs.renders[id] = {nullptr}; // Set in init()
-            if (config.isWorker) {
-                ecs.workers[id] = WorkerComponent{};
-                ecs.attacks[id] = {config.faction == PROTOSS ? 8 : 6, 1, id};
-                ecs.movements[id] = {};
-                if (config.faction == ZERG) ai.aiUnits.push_back(id);
-            } else if (config.isBuilding) {
-                ecs.buildings[id] = BuildingComponent{.produceableUnits = config.produceableUnits};
-                if (config.faction == TERRAN && config.x == 5) terranBase = id;
-                if (config.faction == ZERG && config.x == 15) zergBase = id;
-            }
-        }
-        for (auto& worker : ecs.workers) {
-            worker.second.base = (ecs.factions[worker.first] == TERRAN ? terranBase : zergBase);
-        }
+    // Everything random in the simulation derives from this seed, so lockstep peers only need to share it
+    void seedSimulation(uint32_t value) {
+        seed = value;
+        if (!map.mapped()) map.generate(map.width, map.height, seed);
+        terrain.invalidateAll();
+        sim.seed(seed);
     }
 
     bool init() {
@@ -476,6 +5120,7 @@ public:
             if (zergSpawningPoolTexture) SDL_DestroyTexture(zergSpawningPoolTexture);
             if (protossNexusTexture) SDL_DestroyTexture(protossNexusTexture);
             if (protossGatewayTexture) SDL_DestroyTexture(protossGatewayTexture);
+            atlas.destroy();
             TTF_Quit();
             IMG_Quit();
             Mix_Quit();
@@ -488,22 +5133,31 @@ public:
         }
         window = SDL_CreateWindow("Starcraft-like", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH, SCREEN_HEIGHT, 0);
         if (!window) { cleanupOnFailure(); return false; }
-        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
         if (!renderer) { cleanupOnFailure(); return false; }
 
         font = TTF_OpenFont("font.ttf", 24);
         terrainTextures[GRASS] = IMG_LoadTexture(renderer, "terrain0.png");
         terrainTextures[DIRT] = IMG_LoadTexture(renderer, "terrain1.png");
-        terranUnitTexture = IMG_LoadTexture(renderer, "terran_marine.png");
-        zergUnitTexture = IMG_LoadTexture(renderer, "zerg_zergling.png");
-        protossUnitTexture = IMG_LoadTexture(renderer, "protoss_zealot.png");
-        resourceTexture = IMG_LoadTexture(renderer, "minerals.png");
-        terranCCTexture = IMG_LoadTexture(renderer, "terran_command_center.png");
-        terranBarracksTexture = IMG_LoadTexture(renderer, "terran_barracks.png");
-        zergHatcheryTexture = IMG_LoadTexture(renderer, "zerg_hatchery.png");
-        zergSpawningPoolTexture = IMG_LoadTexture(renderer, "zerg_spawning_pool.png");
-        protossNexusTexture = IMG_LoadTexture(renderer, "protoss_nexus.png");
-        protossGatewayTexture = IMG_LoadTexture(renderer, "protoss_gateway.png");
+        // Sprite textures double as handles into the atlas their images are packed into
+        auto loadSprite = [&](const char* path) -> SDL_Texture* {
+            SDL_Surface* image = IMG_Load(path);
+            if (!image) return nullptr;
+            SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, image);
+            if (texture) atlas.add(texture, image);
+            else SDL_FreeSurface(image);
+            return texture;
+        };
+        terranUnitTexture = loadSprite("terran_marine.png");
+        zergUnitTexture = loadSprite("zerg_zergling.png");
+        protossUnitTexture = loadSprite("protoss_zealot.png");
+        resourceTexture = loadSprite("minerals.png");
+        terranCCTexture = loadSprite("terran_command_center.png");
+        terranBarracksTexture = loadSprite("terran_barracks.png");
+        zergHatcheryTexture = loadSprite("zerg_hatchery.png");
+        zergSpawningPoolTexture = loadSprite("zerg_spawning_pool.png");
+        protossNexusTexture = loadSprite("protoss_nexus.png");
+        protossGatewayTexture = loadSprite("protoss_gateway.png");
 
         if (!font || !terrainTextures[GRASS] || !terrainTextures[DIRT] || !terranUnitTexture || 
             !zergUnitTexture || !protossUnitTexture || !resourceTexture || !terranCCTexture || 
@@ -513,191 +5167,296 @@ public:
             cleanupOnFailure();
             return false;
         }
+        if (!atlas.build(renderer)) std::cerr << "Sprite atlas unavailable, drawing sprites from their own textures: " << SDL_GetError() << std::endl;
+        terrain.reset(map.width, map.height);
 
-        for (auto id : ecs.entities) {
-            if (ecs.workers.count(id)) ecs.renders[id].texture = ecs.factions[id] == TERRAN ? terranUnitTexture : 
-                                                                 ecs.factions[id] == ZERG ? zergUnitTexture : protossUnitTexture;
-            else if (!ecs.buildings.count(id)) ecs.renders[id].texture = resourceTexture;
-            else if (ecs.factions[id] == TERRAN && ecs.positions[id].x == 5) ecs.renders[id].texture = terranCCTexture;
-            else if (ecs.factions[id] == TERRAN) ecs.renders[id].texture = terranBarracksTexture;
-            else if (ecs.factions[id] == ZERG) ecs.renders[id].texture = zergHatcheryTexture;
-        }
+        ecs.each<RenderComponent, PositionComponent, Faction>([&](EntityID id, RenderComponent& render, PositionComponent& pos, Faction& faction) {
+            if (ecs.has<MovementComponent>(id)) render.texture = faction == TERRAN ? terranUnitTexture : 
+                                                               faction == ZERG ? zergUnitTexture : protossUnitTexture;
+            else if (!ecs.has<BuildingComponent>(id)) render.texture = resourceTexture;
+            else if (faction == TERRAN && pos.x == 5) render.texture = terranCCTexture;
+            else if (faction == TERRAN) render.texture = terranBarracksTexture;
+            else if (faction == ZERG) render.texture = zergHatcheryTexture;
+        });
 
+        sim.marineTexture = terranUnitTexture;
+        sim.barracksTexture = terranBarracksTexture;
         SDL_SetWindowData(window, "game", this);
+        lastFrameTime = SDL_GetTicks();
         if (isServer) network.initServer();
         else network.initClient("localhost");
         return true;
     }
 
     void handleInput(SDL_Event& event) {
-        if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT) {
-            int mx = event.button.x / TILE_SIZE;
-            int my = event.button.y / TILE_SIZE;
+        if (event.type == SDL_RENDER_TARGETS_RESET) {
+            terrain.invalidateAll(); // Target contents were lost
+        } else if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT) {
+            dragging = true;
+            dragStartX = dragEndX = event.button.x;
+            dragStartY = dragEndY = event.button.y;
+        } else if (event.type == SDL_MOUSEMOTION && dragging) {
+            dragEndX = event.motion.x;
+            dragEndY = event.motion.y;
+        } else if (event.type == SDL_MOUSEBUTTONUP && event.button.button == SDL_BUTTON_LEFT && dragging) {
+            // A plain click is a one-tile box
+            dragging = false;
+            std::vector<EntityID> boxed;
+            sim.spatialGrid.queryRect((dragStartX + cameraX) / TILE_SIZE, (dragStartY + cameraY) / TILE_SIZE, 
+                                      (event.button.x + cameraX) / TILE_SIZE, (event.button.y + cameraY) / TILE_SIZE, boxed);
             selectedUnits.clear();
-            for (auto id : spatialGrid.getEntitiesAt(mx, my)) {
-                if (ecs.workers.count(id) || ecs.attacks.count(id)) {
-                    selectedUnits.push_back(id);
-                    audio.playEffect();
-                }
+            for (auto id : boxed) {
+                if (ecs.has<WorkerComponent>(id) || ecs.has<AttackComponent>(id) || 
+                    (ecs.has<BuildingComponent>(id) && ecs.at<Faction>(id) == localFaction())) selectedUnits.push_back(id);
             }
+            if (!selectedUnits.empty()) audio.playEffect();
         } else if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_RIGHT) {
-            int mx = event.button.x / TILE_SIZE;
-            int my = event.button.y / TILE_SIZE;
+            int mx = (event.button.x + cameraX) / TILE_SIZE;
+            int my = (event.button.y + cameraY) / TILE_SIZE;
+            // Right-click on an enemy attacks it, on minerals sends workers to harvest, anywhere else moves
+            std::vector<EntityID> clicked;
+            sim.spatialGrid.queryRect(mx, my, mx, my, clicked);
+            EntityID enemy = INVALID_ENTITY, resource = INVALID_ENTITY;
+            for (auto id : clicked) {
+                if (ecs.has<AttackComponent>(id) && ecs.at<Faction>(id) != localFaction()) enemy = id;
+                else if (!(ecs.maskOf(id) & NON_RESOURCE_MASK)) resource = id;
+            }
             for (auto id : selectedUnits) {
-                if (ecs.workers.count(id)) {
-                    for (auto res : ecs.entities) {
-                        if (!ecs.workers.count(res) && !ecs.buildings.count(res) && 
-                            ecs.positions[res].x == mx && ecs.positions[res].y == my) {
-                            Command cmd{SDL_GetTicks(), "MOVE", id, mx, my};
-                            network.sendCommand(cmd);
-                            network.commandQueue.push(cmd);
-                            break;
-                        }
-                    }
-                }
+                if (!ecs.has<MovementComponent>(id)) continue;
+                Command cmd{.timestamp = SDL_GetTicks(), .type = CMD_MOVE, .id = id, .move = {mx, my}};
+                if (armedOrder == CMD_PATROL) cmd = {.timestamp = cmd.timestamp, .type = CMD_PATROL, .id = id, .patrol = {mx, my}};
+                else if (armedOrder == CMD_BUILD && !ecs.has<WorkerComponent>(id)) continue;
+                else if (armedOrder == CMD_BUILD) cmd = {.timestamp = cmd.timestamp, .type = CMD_BUILD, .id = id, .build = {mx, my}};
+                else if (enemy != INVALID_ENTITY) cmd = {.timestamp = cmd.timestamp, .type = CMD_ATTACK, .id = id, .attack = {enemy}};
+                else if (resource != INVALID_ENTITY && ecs.has<WorkerComponent>(id)) cmd = {.timestamp = cmd.timestamp, .type = CMD_GATHER, .id = id, .gather = {resource}};
+                issueCommand(cmd);
+                if (cmd.type == CMD_BUILD) break; // One worker builds
             }
-        } else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p && minerals >= 50) {
-            for (auto id : ecs.entities) {
-                if (ecs.buildings.count(id) && !ecs.buildings[id].produceableUnits.empty()) {
-                    EntityID newUnit = ecs.createEntity();
-                    ecs.positions[newUnit] = {ecs.positions[id].x + 1, ecs.positions[id].y, 
-                                             static_cast<float>(ecs.positions[id].x + 1), static_cast<float>(ecs.positions[id].y), SDL_GetTicks()};
-                    ecs.healths[newUnit] = {40};
-                    ecs.factions[newUnit] = TERRAN;
-                    ecs.renders[newUnit] = {terranUnitTexture};
-                    ecs.attacks[newUnit] = {6, 1, newUnit};
-                    ecs.movements[newUnit] = {};
-                    minerals -= 50;
-                    Command cmd{SDL_GetTicks(), "PRODUCE", newUnit, ecs.positions[id].x + 1, ecs.positions[id].y};
-                    network.sendCommand(cmd);
-                    network.commandQueue.push(cmd);
-                    break;
-                }
+            armedOrder = CMD_MOVE;
+        } else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_s) {
+            for (auto id : selectedUnits) {
+                if (ecs.has<MovementComponent>(id)) issueCommand({.timestamp = SDL_GetTicks(), .type = CMD_STOP, .id = id, .move = {}});
+            }
+        } else if (event.type == SDL_KEYDOWN && (event.key.keysym.sym == SDLK_t || event.key.keysym.sym == SDLK_b)) {
+            armedOrder = event.key.keysym.sym == SDLK_t ? CMD_PATROL : CMD_BUILD;
+        } else if (event.type == SDL_KEYDOWN && (event.key.keysym.sym == SDLK_LEFT || event.key.keysym.sym == SDLK_RIGHT || 
+                                                 event.key.keysym.sym == SDLK_UP || event.key.keysym.sym == SDLK_DOWN)) {
+            SDL_Keycode key = event.key.keysym.sym;
+            int step = CAMERA_SCROLL_TILES * TILE_SIZE;
+            cameraX += key == SDLK_LEFT ? -step : key == SDLK_RIGHT ? step : 0;
+            cameraY += key == SDLK_UP ? -step : key == SDLK_DOWN ? step : 0;
+            cameraX = std::clamp(cameraX, 0, std::max(0, map.width * TILE_SIZE - SCREEN_WIDTH));
+            cameraY = std::clamp(cameraY, 0, std::max(0, map.height * TILE_SIZE - SCREEN_HEIGHT));
+            if (!ownsState()) {
+                network.sendView({cameraX / TILE_SIZE, cameraY / TILE_SIZE, (cameraX + SCREEN_WIDTH - 1) / TILE_SIZE, 
+                                  (cameraY + SCREEN_HEIGHT - 1) / TILE_SIZE});
+            }
+        } else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F3) {
+            profiler().setOverlay(!profiler().overlayShown());
+        } else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F5 && ownsState()) {
+            SaveWriter quick;
+            if (quick.save(sim, "quicksave.scsv")) std::cout << "Saved quicksave.scsv (" << quick.bytesWritten / 1024 << " KB)" << std::endl;
+            else std::cerr << "Cannot write quicksave.scsv" << std::endl;
+        } else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p) {
+            // Each selected building that trains anything queues its first unit; the host checks cost and queue room
+            for (auto id : selectedUnits) {
+                const BuildingComponent* building = ecs.get<BuildingComponent>(id);
+                if (!building || building->produceableUnits.empty()) continue;
+                issueCommand({.timestamp = SDL_GetTicks(), .type = CMD_PRODUCE, .id = id, 
+                              .produce = {static_cast<uint8_t>(building->produceableUnits.front())}});
             }
         }
     }
 
-    void update() {
-        network.acceptConnection();
-        network.receiveData(ecs, terranUnitTexture, zergUnitTexture, protossUnitTexture, resourceTexture, 
-                            terranCCTexture, terranBarracksTexture, zergHatcheryTexture, zergSpawningPoolTexture, 
-                            protossNexusTexture, protossGatewayTexture);
+    // In lockstep mode commands wait for their tick; otherwise they run locally and are mirrored to the peer
+    void issueCommand(const Command& cmd) {
+        if (lockstep) {
+            session.queueLocal(cmd);
+            return;
+        }
+        network.sendCommand(cmd);
+        if (runsLocally(cmd)) sim.queueCommand(cmd);
+    }
 
-        spatialGrid.update(ecs);
+    // The host plays Terran; a client plays the faction of the slot the host gave it
+    Faction localFaction() const { return playerFaction(isServer ? 0 : std::max(network.localPlayer, 0)); }
 
-        while (!network.commandQueue.empty()) {
-            Command cmd = network.commandQueue.front();
-            network.commandQueue.pop();
-            if (cmd.type == "MOVE" && ecs.workers.count(cmd.id)) {
-                ecs.workers[cmd.id].targetResource = 0;
-                for (auto res : ecs.entities) {
-                    if (!ecs.workers.count(res) && !ecs.buildings.count(res) && 
-                        ecs.positions[res].x == cmd.x && ecs.positions[res].y == cmd.y) {
-                        ecs.workers[cmd.id].targetResource = res;
-                        break;
-                    }
-                }
-                ecs.movements[cmd.id].path = findPath(ecs.positions[cmd.id].x, ecs.positions[cmd.id].y, cmd.x, cmd.y, map, ecs);
-                ecs.movements[cmd.id].pathIndex = 0;
-            } else if (cmd.type == "PRODUCE" && !ecs.positions.count(cmd.id)) {
-                ecs.createEntity();
-                ecs.entities.back() = cmd.id;
-                ecs.positions[cmd.id] = {cmd.x, cmd.y, static_cast<float>(cmd.x), static_cast<float>(cmd.y), cmd.timestamp};
-                ecs.healths[cmd.id] = {40};
-                ecs.factions[cmd.id] = TERRAN;
-                ecs.renders[cmd.id] = {terranUnitTexture};
-                ecs.attacks[cmd.id] = {6, 1, cmd.id};
-                ecs.movements[cmd.id] = {};
-            }
+    // A streaming client only mirrors the host's snapshots, so it has no state of its own to save or record
+    bool ownsState() const { return isServer || lockstep; }
+
+    // Every AUTOSAVE_INTERVAL_TICKS, rewrites the chunks of the autosave that changed since the previous one
+    void autosave() {
+        if (autosavePath.empty() || sim.tick % AUTOSAVE_INTERVAL_TICKS != 0) return;
+        PROFILE_ZONE("autosave");
+        if (!saver.autosave(sim, autosavePath)) std::cerr << "Cannot write autosave " << autosavePath << std::endl;
+    }
+
+    // Only the host creates units, so every state change passes through its ticks (and its replay log);
+    // clients receive new units with the next snapshot
+    bool runsLocally(const Command& cmd) const { return isServer || cmd.type != CMD_PRODUCE; }
+
+    void update() {
+        {
+            PROFILE_ZONE("network receive");
+            network.receiveData(ecs, terranUnitTexture, zergUnitTexture, protossUnitTexture, resourceTexture, 
+                                terranCCTexture, terranBarracksTexture, zergHatcheryTexture, zergSpawningPoolTexture, 
+                                protossNexusTexture, protossGatewayTexture);
         }
 
         Uint32 now = SDL_GetTicks();
-        for (auto id : ecs.entities) {
-            if (ecs.movements.count(id) && !ecs.movements[id].path.empty() && ecs.movements[id].pathIndex < ecs.movements[id].path.size()) {
-                float t = static_cast<float>(now - ecs.positions[id].lastUpdate) / 100.0f;
-                int nextX = ecs.movements[id].path[ecs.movements[id].pathIndex].x;
-                int nextY = ecs.movements[id].path[ecs.movements[id].pathIndex].y;
-                ecs.positions[id].interpX = ecs.positions[id].x + (nextX - ecs.positions[id].x) * t;
-                ecs.positions[id].interpY = ecs.positions[id].y + (nextY - ecs.positions[id].y) * t;
-                if (t >= 1.0f) {
-                    ecs.positions[id].x = nextX;
-                    ecs.positions[id].y = nextY;
-                    ecs.positions[id].interpX = static_cast<float>(nextX);
-                    ecs.positions[id].interpY = static_cast<float>(nextY);
-                    ecs.positions[id].lastUpdate = now;
-                    ecs.movements[id].pathIndex++;
-                    if (ecs.movements[id].pathIndex >= ecs.movements[id].path.size()) ecs.movements[id].path.clear();
-                }
-            }
-            if (ecs.workers.count(id)) {
-                if (ecs.workers[id].targetResource && !ecs.workers[id].isCarrying) {
-                    EntityID res = ecs.workers[id].targetResource;
-                    if (ecs.positions.count(res) && ecs.positions[id].x == ecs.positions[res].x && 
-                        ecs.positions[id].y == ecs.positions[res].y && ecs.healths[res].health > 0) {
-                        ecs.healths[res].health -= 8;
-                        ecs.workers[id].minerals += 8;
-                        ecs.workers[id].isCarrying = true;
-                    }
-                } else if (ecs.workers[id].isCarrying) {
-                    EntityID base = ecs.workers[id].base;
-                    if (ecs.positions.count(base) && ecs.positions[id].x == ecs.positions[base].x && 
-                        ecs.positions[id].y == ecs.positions[base].y) {
-                        minerals += ecs.workers[id].minerals;
-                        ecs.workers[id].minerals = 0;
-                        ecs.workers[id].isCarrying = false;
-                        ecs.workers[id].targetResource = 0;
-                    }
+        Uint32 elapsed = now - lastFrameTime;
+        lastFrameTime = now;
+        if (lockstep) {
+            updateLockstep(elapsed);
+        } else {
+            Command cmd;
+            while (network.commandQueue.pop(cmd)) {
+                if (runsLocally(cmd)) sim.queueCommand(cmd);
+            }
+            // Fixed-rate ticks: a faster frame rate renders more often but never simulates more
+            tickAccumulator = std::min(tickAccumulator + elapsed, SIM_TICK_MS * MAX_CATCHUP_TICKS);
+            while (tickAccumulator >= SIM_TICK_MS) {
+                sim.simulate();
+                recorder.recordTick(sim);
+                autosave();
+                if (isServer) {
+                    PROFILE_ZONE("network send");
+                    network.sendState(ecs, sim.visibility);
                 }
+                tickAccumulator -= SIM_TICK_MS;
             }
         }
+        PROFILE_ZONE("network flush");
+        network.flush();
+    }
 
-        for (auto it = ecs.entities.begin(); it != ecs.entities.end();) {
-            if (ecs.healths[*it].health <= 0) {
-                ecs.destroyEntity(*it);
-                network.sendState(ecs);
-                it = ecs.entities.begin();
-            } else ++it;
+    // Runs as many fixed ticks as real time allows, stalling when the peer's commands are late
+    void updateLockstep(Uint32 elapsed) {
+        if (!session.started) {
+            if (isServer && network.connected()) {
+                network.sendStart(seed);
+                session.start(0);
+            } else if (!isServer && network.startReceived) {
+                seedSimulation(network.startSeed);
+                session.start(1);
+            } else {
+                return;
+            }
+            tickAccumulator = 0;
+        }
+        while (!network.tickMessages.empty()) {
+            session.receiveRemote(network.tickMessages.front());
+            network.tickMessages.pop();
+        }
+        tickAccumulator = std::min(tickAccumulator + elapsed, SIM_TICK_MS * MAX_CATCHUP_TICKS);
+        while (tickAccumulator >= SIM_TICK_MS) {
+            TickMessage msg;
+            if (session.sealLocal(msg)) network.sendTick(msg);
+            if (!session.ready()) break;
+            session.takeCommands(sim);
+            sim.simulate();
+            recorder.recordTick(sim);
+            autosave();
+            session.finishTick(sim.stateChecksum());
+            tickAccumulator -= SIM_TICK_MS;
         }
-        ai.update(ecs, map, minerals);
-        if (isServer) network.sendState(ecs);
     }
 
     void render() {
+        PROFILE_ZONE("render");
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
 
-        for (int y = 0; y < MAP_HEIGHT; y++) {
-            for (int x = 0; x < MAP_WIDTH; x++) {
-                SDL_Rect dest = {x * TILE_SIZE, y * TILE_SIZE, TILE_SIZE, TILE_SIZE};
-                SDL_RenderCopy(renderer, terrainTextures[map[y][x]], NULL, &dest);
+        SDL_Rect view = {cameraX, cameraY, SCREEN_WIDTH, SCREEN_HEIGHT};
+        // Tile bytes without a texture of their own draw as grass
+        drawCalls = terrain.draw(renderer, terrainTextures, [&](int x, int y) { return map.at(x, y) == DIRT ? DIRT : GRASS; }, view);
+
+        // Spectators see everything; players only what their faction's units and buildings see
+        int player = isServer ? 0 : network.localPlayer;
+        Faction faction = localFaction();
+        auto fogged = [&](int x, int y) { return player >= 0 && !sim.visibility.isVisible(faction, x, y); };
+
+        // Draw between the last two ticks by how far real time is into the next one
+        float alpha = std::min(1.0f, static_cast<float>(tickAccumulator) / SIM_TICK_MS);
+        ecs.each<PositionComponent, RenderComponent, Faction>([&](EntityID, const PositionComponent& pos, const RenderComponent& render,
+                                                                  const Faction& owner) {
+            const Sprite* sprite = render.texture ? atlas.find(render.texture) : nullptr;
+            bool onScreen = (pos.x + 1) * TILE_SIZE > view.x && (pos.y + 1) * TILE_SIZE > view.y && 
+                            pos.x * TILE_SIZE < view.x + view.w && pos.y * TILE_SIZE < view.y + view.h;
+            if (sprite && onScreen && (owner == faction || !fogged(pos.x, pos.y))) {
+                float x = (pos.prevFx + (pos.fx - pos.prevFx) * alpha) / FIXED_ONE;
+                float y = (pos.prevFy + (pos.fy - pos.prevFy) * alpha) / FIXED_ONE;
+                sprites.add(*sprite, {x * TILE_SIZE - view.x, y * TILE_SIZE - view.y, static_cast<float>(TILE_SIZE), static_cast<float>(TILE_SIZE)});
             }
-        }
+        });
+        drawCalls += sprites.flush(renderer);
 
-        for (auto id : ecs.entities) {
-            if (ecs.renders.count(id) && ecs.renders[id].texture) {
-                SDL_Rect dest = {static_cast<int>(ecs.positions[id].interpX * TILE_SIZE), 
-                                 static_cast<int>(ecs.positions[id].interpY * TILE_SIZE), TILE_SIZE, TILE_SIZE};
-                SDL_RenderCopy(renderer, ecs.renders[id].texture, NULL, &dest);
+        // Fog: one translucent rectangle per run of hidden tiles in a row, all in a single call
+        fogRects.clear();
+        for (int y = view.y / TILE_SIZE; y < map.height && y * TILE_SIZE < view.y + view.h; y++) {
+            for (int x = view.x / TILE_SIZE; x < map.width && x * TILE_SIZE < view.x + view.w; x++) {
+                if (!fogged(x, y)) continue;
+                int start = x;
+                while (x + 1 < map.width && (x + 1) * TILE_SIZE < view.x + view.w && fogged(x + 1, y)) x++;
+                fogRects.push_back({start * TILE_SIZE - view.x, y * TILE_SIZE - view.y, (x - start + 1) * TILE_SIZE, TILE_SIZE});
             }
         }
+        if (!fogRects.empty()) {
+            SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+            SDL_RenderFillRects(renderer, fogRects.data(), static_cast<int>(fogRects.size()));
+            SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+            drawCalls++;
+        }
+
+        if (dragging) {
+            SDL_Rect box = {std::min(dragStartX, dragEndX), std::min(dragStartY, dragEndY), 
+                            abs(dragEndX - dragStartX), abs(dragEndY - dragStartY)};
+            SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+            SDL_RenderDrawRect(renderer, &box);
+        }
+
+        drawText("Minerals: " + std::to_string(sim.minerals) + "  Draw calls: " + std::to_string(drawCalls), 10, 10);
+        if (const RemoteClient* peer = network.primaryPeer()) {
+            char stats[64];
+            snprintf(stats, sizeof(stats), "RTT: %d ms  Loss: %.1f%%  Clients: %zu", static_cast<int>(peer->transport.rttMs), 
+                     peer->transport.lossRatio() * 100.0f, network.peers.size());
+            drawText(stats, 10, 40);
+        }
+        if (profiler().overlayShown()) drawProfile();
+
+        PROFILE_ZONE("present");
+        SDL_RenderPresent(renderer);
+    }
+
+    // F3 overlay: each zone's mean milliseconds per frame over the last PROFILER_WINDOW_FRAMES frames
+    void drawProfile() {
+        int y = 70;
+        profiler().forEachZone([&](const char* name, double ms) {
+            char line[64];
+            snprintf(line, sizeof(line), "%-16s %6.2f ms", name, ms);
+            drawText(line, 10, y);
+            y += 24;
+        });
+    }
 
+    void drawText(const std::string& text, int x, int y) {
         SDL_Color color = {255, 255, 255, 255};
-        std::string mineralText = "Minerals: " + std::to_string(minerals);
-        SDL_Surface* surface = TTF_RenderText_Solid(font, mineralText.c_str(), color);
+        SDL_Surface* surface = TTF_RenderText_Solid(font, text.c_str(), color);
         if (surface) {
             SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
             if (texture) {
-                SDL_Rect dest = {10, 10, surface->w, surface->h};
+                SDL_Rect dest = {x, y, surface->w, surface->h};
                 SDL_RenderCopy(renderer, texture, NULL, &dest);
                 SDL_DestroyTexture(texture);
             }
             SDL_FreeSurface(surface);
         }
-
-        SDL_RenderPresent(renderer);
     }
 
     void clean() {
+        recorder.close();
+        profiler().finish();
         for (int i = 0; i < 2; i++) if (terrainTextures[i]) SDL_DestroyTexture(terrainTextures[i]);
         if (terranUnitTexture) SDL_DestroyTexture(terranUnitTexture);
         if (zergUnitTexture) SDL_DestroyTexture(zergUnitTexture);
@@ -709,6 +5468,8 @@ public:
         if (zergSpawningPoolTexture) SDL_DestroyTexture(zergSpawningPoolTexture);
         if (protossNexusTexture) SDL_DestroyTexture(protossNexusTexture);
         if (protossGatewayTexture) SDL_DestroyTexture(protossGatewayTexture);
+        terrain.destroy();
+        atlas.destroy();
         if (font) TTF_CloseFont(font);
         if (renderer) SDL_DestroyRenderer(renderer);
         if (window) SDL_DestroyWindow(window);
@@ -719,8 +5480,86 @@ public:
     }
 };
 
-int main() {
-    Game game;
+int main(int argc, char* argv[]) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--replay") return runReplay(argv[i + 1]);
+    }
+    // A map file fixes the world size, so it is opened before the game is built
+    TileMap map;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) != "--map") continue;
+        if (!map.load(argv[i + 1])) {
+            std::cerr << "Cannot open map " << argv[i + 1] << " (not a version " << MAP_FILE_VERSION << " map of at most " 
+                      << MAP_MAX_SIDE << "x" << MAP_MAX_SIDE << " tiles)" << std::endl;
+            return 1;
+        }
+        if (map.width < MAP_WIDTH || map.height < MAP_HEIGHT) {
+            std::cerr << "Map " << argv[i + 1] << " is smaller than the " << MAP_WIDTH << "x" << MAP_HEIGHT << " the starting bases need" << std::endl;
+            return 1;
+        }
+    }
+    // So does a save, whose size a map file has to match
+    SaveReader save;
+    bool loading = false;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) != "--load") continue;
+        if (!save.open(argv[i + 1])) {
+            std::cerr << "Cannot load " << argv[i + 1] << ": " << save.error << std::endl;
+            return 1;
+        }
+        if (map.mapped() && (map.width != save.width || map.height != save.height)) {
+            std::cerr << argv[i + 1] << " was saved on a " << save.width << "x" << save.height << " map" << std::endl;
+            return 1;
+        }
+        loading = true;
+    }
+    if (!map.mapped()) map.generate(loading ? save.width : MAP_WIDTH, loading ? save.height : MAP_HEIGHT, 0);
+    Game game(std::move(map), loading ? &save : nullptr);
+    std::string recordPath;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--client") game.isServer = false;
+        else if (arg == "--spectate") {
+            game.isServer = false;
+            game.network.spectate = true;
+        }
+        else if (arg == "--lockstep") {
+            game.lockstep = true;
+            game.sim.setDeterministic(true);
+        }
+        else if (arg == "--loss" && i + 1 < argc) game.network.link.loss = static_cast<float>(atof(argv[++i])) / 100.0f;
+        else if (arg == "--latency" && i + 1 < argc) game.network.link.latencyMs = static_cast<Uint32>(atoi(argv[++i]));
+        else if (arg == "--jitter" && i + 1 < argc) game.network.link.jitterMs = static_cast<Uint32>(atoi(argv[++i]));
+        else if (arg == "--record" && i + 1 < argc) recordPath = argv[++i];
+        else if ((arg == "--map" || arg == "--load") && i + 1 < argc) i++; // Opened above
+        else if (arg == "--autosave" && i + 1 < argc) game.autosavePath = argv[++i];
+        else if (arg == "--profile") profiler().setOverlay(true);
+        else if (arg == "--trace" && i + 3 < argc) {
+            profiler().captureTrace(argv[i + 1], static_cast<uint32_t>(atoi(argv[i + 2])), static_cast<uint32_t>(atoi(argv[i + 3])));
+            i += 3;
+        }
+    }
+    if (loading && (!game.isServer || game.lockstep)) {
+        // Peers would start from the host's seed and the default bases rather than the save
+        std::cerr << "--load needs the host without --lockstep" << std::endl;
+        return 1;
+    }
+    if (!game.autosavePath.empty() && !game.ownsState()) {
+        std::cerr << "--autosave needs the host or --lockstep" << std::endl;
+        game.autosavePath.clear();
+    }
+    if (!recordPath.empty()) {
+        // A streaming client's state comes from snapshots, which the log does not hold
+        if (!game.ownsState()) {
+            std::cerr << "--record needs the host or --lockstep" << std::endl;
+        } else if (loading) {
+            std::cerr << "--record cannot start from a save; replays rebuild the match from its starting entities" << std::endl;
+        } else if (!game.recorder.open(recordPath)) {
+            std::cerr << "Cannot write replay " << recordPath << std::endl;
+        } else {
+            game.sim.setDeterministic(true);
+        }
+    }
     if (!game.init()) {
         std::cerr << "Initialization failed: " << SDL_GetError() << std::endl;
         game.clean();
@@ -736,8 +5575,177 @@ int main() {
         }
         game.update();
         game.render();
+        profiler().endFrame();
     }
 
     game.clean();
     return 0;
 }
+#else
+// Headless benchmark: builds a world of the requested size, keeps it busy with harvest orders and reports tick
+// throughput, time per system and peak memory, so scaling regressions show up without a window
+long peakRssKB() {
+#ifdef _WIN32
+    return 0;
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Full save, an autosave one tick later and a load into a fresh simulation, timed; the load must reproduce the state
+void benchmarkSave(Simulation& sim, const std::string& path) {
+    auto milliseconds = [](std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    };
+    SaveWriter saver;
+    auto start = std::chrono::steady_clock::now();
+    if (!saver.save(sim, path)) {
+        std::cerr << "Cannot write save " << path << std::endl;
+        return;
+    }
+    double saveMs = milliseconds(start);
+    size_t saveBytes = saver.bytesWritten;
+    sim.simulate();
+    start = std::chrono::steady_clock::now();
+    bool autosaved = saver.autosave(sim, path);
+    double autosaveMs = milliseconds(start);
+
+    start = std::chrono::steady_clock::now();
+    SaveReader reader;
+    if (!autosaved || !reader.open(path)) {
+        std::cerr << "Save " << path << " did not read back: " << reader.error << std::endl;
+        return;
+    }
+    Simulation loaded(reader.width, reader.height);
+    reader.restore(loaded);
+    double loadMs = milliseconds(start);
+    printf("Save: %.2f MB in %.2f ms; autosave a tick later wrote %.2f MB%s in %.2f ms; load %.2f ms, %s\n",
+           saveBytes / 1048576.0, saveMs, saver.bytesWritten / 1048576.0, saver.wroteAll ? " (whole file)" : "", autosaveMs, loadMs,
+           loaded.stateChecksum() == sim.stateChecksum() ? "state matches" : "STATE DIFFERS");
+    fflush(stdout);
+}
+
+void runBenchmark(int entities, int ticks, const std::string& recordPath, const std::string& savePath, const TileMap& map) {
+    // Square map with about four tiles per entity (at most MAP_MAX_SIDE, so the run can be saved and replayed) unless
+    // a map file gives the size; the two bases keep the game's coordinates
+    int side = std::clamp(static_cast<int>(std::sqrt(entities * 4.0)), 64, MAP_MAX_SIDE);
+    int width = map.mapped() ? map.width : side, height = map.mapped() ? map.height : side;
+    Simulation sim(width, height);
+    sim.seed(42);
+    SimRandom rng(42);
+    std::vector<EntityConfig> configs = {
+        {TERRAN, 5, 5, 200, false, true, {}, "terran_command_center.png"},
+        {ZERG, 15, 15, 200, false, true, {}, "zerg_hatchery.png"}
+    };
+    int buildings = entities / 20, resources = entities / 5;
+    for (int i = static_cast<int>(configs.size()); i < entities; i++) {
+        int x = static_cast<int>(rng.below(width)), y = static_cast<int>(rng.below(height));
+        Faction faction = i % 2 ? ZERG : TERRAN;
+        if (i < buildings) configs.push_back({faction, x, y, 200, false, true, {}, ""});
+        else if (i < buildings + resources) configs.push_back({TERRAN, x, y, 100, false, false, {}, ""});
+        else configs.push_back({faction, x, y, 40, true, false, {}, ""});
+    }
+    sim.setupEntities(configs);
+    ReplayWriter recorder;
+    if (!recordPath.empty()) {
+        if (recorder.open(recordPath)) sim.setDeterministic(true);
+        else std::cerr << "Cannot write replay " << recordPath << std::endl;
+    }
+
+    // Orders go to a few mineral patches so units share flow fields, as grouped orders do in a match
+    std::vector<EntityID> workers;
+    std::vector<EntityID> targets;
+    sim.ecs.each<WorkerComponent, Faction>([&](EntityID id, WorkerComponent&, Faction& faction) {
+        if (faction == TERRAN) workers.push_back(id);
+    });
+    sim.ecs.each<PositionComponent>([&](EntityID id, PositionComponent&) {
+        if (targets.size() < 32) targets.push_back(id);
+    }, NON_RESOURCE_MASK);
+    size_t ordersPerTick = std::max<size_t>(1, workers.size() / 200);
+
+    sim.simulate(); // First tick builds the grid, obstacles and hierarchy
+    recorder.recordTick(sim);
+    profiler().endFrame();
+    sim.times = SystemTimes{};
+    sim.times.enabled = true;
+    auto start = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < ticks; tick++) {
+        for (size_t i = 0; i < ordersPerTick && !workers.empty() && !targets.empty(); i++) {
+            EntityID target = targets[rng.below(static_cast<uint32_t>(targets.size()))];
+            EntityID worker = workers[rng.below(static_cast<uint32_t>(workers.size()))];
+            sim.queueCommand({.timestamp = static_cast<Uint32>(tick), .type = CMD_GATHER, .id = worker, .gather = {target}});
+        }
+        sim.simulate();
+        recorder.recordTick(sim);
+        profiler().endFrame();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%9d %5dx%-5d %9.1f", entities, width, height, ticks / seconds);
+    for (int system = 0; system < SystemTimes::COUNT; system++) printf(" %9.3f", sim.times.seconds[system] * 1000.0 / ticks);
+    printf(" %9.1f\n", peakRssKB() / 1024.0);
+    fflush(stdout);
+    if (!savePath.empty()) benchmarkSave(sim, savePath);
+}
+
+int main(int argc, char* argv[]) {
+    int ticks = 200;
+    std::vector<int> sizes = {1000, 10000, 50000};
+    std::string recordPath, savePath;
+    TileMap map;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--ticks" && i + 1 < argc) ticks = std::max(1, atoi(argv[++i]));
+        else if (arg == "--save" && i + 1 < argc) savePath = argv[++i];
+        else if (arg == "--entities" && i + 1 < argc) sizes = {std::max(2, atoi(argv[++i]))};
+        else if (arg == "--record" && i + 1 < argc) recordPath = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc) return runReplay(argv[++i]);
+        else if (arg == "--trace" && i + 3 < argc) {
+            // Ticks are the frames here
+            profiler().captureTrace(argv[i + 1], static_cast<uint32_t>(atoi(argv[i + 2])), static_cast<uint32_t>(atoi(argv[i + 3])));
+            i += 3;
+        } else if (arg == "--write-map" && i + 3 < argc) {
+            // Random map file for --map and the game: --write-map path width height
+            const char* path = argv[i + 1];
+            int width = atoi(argv[i + 2]), height = atoi(argv[i + 3]);
+            if (width < 1 || height < 1 || width > MAP_MAX_SIDE || height > MAP_MAX_SIDE) {
+                std::cerr << "Map sides must be 1.." << MAP_MAX_SIDE << std::endl;
+                return 1;
+            }
+            map.generate(width, height, 42);
+            if (!map.save(path)) {
+                std::cerr << "Cannot write map " << path << std::endl;
+                return 1;
+            }
+            return 0;
+        } else if (arg == "--map" && i + 1 < argc) {
+            auto start = std::chrono::steady_clock::now();
+            if (!map.load(argv[++i]) || map.width < MAP_WIDTH || map.height < MAP_HEIGHT) {
+                std::cerr << "Cannot open map " << argv[i] << std::endl;
+                return 1;
+            }
+            printf("Opened %dx%d map in %.3f ms\n", map.width, map.height, 
+                   std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+    if (!recordPath.empty() && sizes.size() != 1) {
+        std::cerr << "--record needs a single --entities count" << std::endl;
+        return 1;
+    }
+    printf("%9s %11s %9s", "entities", "map", "ticks/s");
+    for (int system = 0; system < SystemTimes::COUNT; system++) printf(" %9s", SystemTimes::names[system]);
+    printf(" %9s\n", "peak MB");
+    printf("%31s", "");
+    for (int system = 0; system < SystemTimes::COUNT; system++) printf(" %9s", "ms/tick");
+    printf("\n");
+    for (int entities : sizes) runBenchmark(entities, ticks, recordPath, savePath, map);
+    profiler().finish();
+    return 0;
+}
+#endif